@@ -1,16 +1,61 @@
 #include "benchmark/benchmark.h"
 #include "chronowrap.hpp"
+#include "chronowrap_array.hpp"
+#include "chronowrap_coarseclock.hpp"
+#include "chronowrap_detect.hpp"
+#include "chronowrap_histogram.hpp"
+#include "chronowrap_logreader.hpp"
+#include "chronowrap_parallel.hpp"
+#include "chronowrap_ratelimit.hpp"
+#include "chronowrap_timerwheel.hpp"
+#include "chronowrap_trace.hpp"
+#include "chronowrap_tscclock.hpp"
+#include "chronowrap_window.hpp"
+#include "chronowrap_simd.hpp"
 #include "TimeClass.h"
 
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <queue>
 #include <sstream>
 #include <string>
+#include <vector>
 
 //#define BASIC_BENCHMARK_TEST(x) BENCHMARK(x)->Arg(8)->Arg(512)->Arg(8192)
 
-const char CHRONOFORMAT[] = "%Y/%M/%d %H:%m:%s.%x";
+constexpr char CHRONOFORMAT[] = "%Y/%M/%d %H:%m:%s.%x";
 const char TIMECLASSFORMAT[] = "YYYY/MM/DD HH:mm:ss.xxx";
 const char TIMESTAMP[] = "2018/07/14 22:14:35.243";
 
+constexpr compiled_format CHRONOFORMAT_CT(CHRONOFORMAT);
+//Names, 12 hour clock, microseconds and an offset, for the specifiers that aren't plain digits
+constexpr char EXTENDEDFORMAT[] = "%a %e %b %Y %I:%m:%s.%u %p %z";
+const char EXTENDEDTIMESTAMP[] = "Sat 14 Jul 2018 10:14:35.243000 PM +0000";
+constexpr compiled_format EXTENDEDFORMAT_CT(EXTENDEDFORMAT);
+
+//Counting allocator hook so the allocation free paths can prove it
+std::atomic<size_t> g_allocations(0);
+
+void* operator new(size_t size)
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+//Out of line, so GCC doesn't see free() on a pointer from operator new and warn about a mismatch
+CHRONOWRAP_NOINLINE void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
 
 void BM_Empty(benchmark::State &state)
 {
@@ -29,6 +74,62 @@ void BM_chrono_tstampcreate(benchmark::State &state)
 	state.SetLabel(ss.str());
 }
 
+//0: timestamp::now(), which goes through system_clock. 1: tsc_clock. 2: coarse_clock.
+void BM_chrono_now(benchmark::State &state)
+{
+	static const tsc_clock clock;
+	timestamp t;
+	if (state.range(0) == 1)
+	{
+		for (auto _ : state)
+			benchmark::DoNotOptimize(t = clock.now());
+		state.SetLabel(clock.isactive() ? "tsc" : "tsc (inactive)");
+	}
+	else if (state.range(0) == 2)
+	{
+		coarse_clock coarse;
+		coarse.start();
+		compact_timestamp c;
+		for (auto _ : state)
+			benchmark::DoNotOptimize(c = coarse.nowcompact());
+		state.SetLabel("coarse");
+	}
+	else
+	{
+		for (auto _ : state)
+			benchmark::DoNotOptimize(t = timestamp::now());
+		state.SetLabel("system_clock");
+	}
+}
+
+//Start and stop overhead: one restart and one elapsed reading per iteration
+void BM_chrono_stopwatch(benchmark::State &state)
+{
+	stopwatch<> watch;
+	timediff t = watch.elapsed();
+	for (auto _ : state)
+	{
+		watch.restart();
+		benchmark::DoNotOptimize(t = watch.stop());
+	}
+
+	std::stringstream ss;
+	ss << t.asnanoseconds<long long>() << "ns";
+	state.SetLabel(ss.str());
+}
+
+void BM_chrono_stopwatch_lap(benchmark::State &state)
+{
+	stopwatch<> watch;
+	timediff t = watch.elapsed();
+	for (auto _ : state)
+		benchmark::DoNotOptimize(t = watch.lap());
+
+	std::stringstream ss;
+	ss << t.asnanoseconds<long long>() << "ns";
+	state.SetLabel(ss.str());
+}
+
 void BM_chrono_fromstring(benchmark::State &state)
 {
 	timestamp t;
@@ -41,6 +142,327 @@ void BM_chrono_fromstring(benchmark::State &state)
 	state.SetLabel(ss.str());
 }
 
+void BM_chrono_fromstring_compiled(benchmark::State &state)
+{
+	const compiled_format format(CHRONOFORMAT);
+	const size_t tlen = sizeof(TIMESTAMP) - 1;
+	timestamp t;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(t.fromstring(TIMESTAMP, tlen, format));
+
+	std::stringstream ss;
+	ss << t.tostdstring(CHRONOFORMAT);
+	state.SetLabel(ss.str());
+}
+
+void BM_chrono_fromstring_constexpr(benchmark::State &state)
+{
+	const std::string_view tstamp(TIMESTAMP);
+	timestamp t;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(t = timestamp::parse<CHRONOFORMAT_CT>(tstamp));
+
+	std::stringstream ss;
+	ss << t.tostdstring<CHRONOFORMAT_CT>();
+	state.SetLabel(ss.str());
+}
+
+//A day's worth of distinct timestamps, one per 86.4 seconds, for the batch parsers
+std::vector<std::string> maketimestamps(size_t count)
+{
+	std::vector<std::string> ret;
+	timestamp t = timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP);
+	for (size_t i = 0; i < count; ++i)
+		ret.push_back((t + milliseconds<long long>((long long)i * 86400)).tostdstring<CHRONOFORMAT_CT>());
+	return ret;
+}
+
+//A year of days, so the zone lookups cross both DST transitions
+void BM_chrono_fromstring_zone(benchmark::State &state)
+{
+	const compiled_format format(CHRONOFORMAT);
+	tzone zone;
+	if (!tzone::locate("America/New_York", zone))
+		zone = tzone::local();
+	std::vector<std::string> strings;
+	timestamp t = timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP);
+	for (int i = 0; i < 366; ++i)
+		strings.push_back((t + days<int>(i)).tostdstring<CHRONOFORMAT_CT>());
+
+	std::vector<timestamp> out(strings.size());
+	for (auto _ : state)
+		for (size_t i = 0; i < strings.size(); ++i)
+			benchmark::DoNotOptimize(out[i].fromstring(strings[i], format, zone));
+
+	state.SetItemsProcessed(state.iterations() * strings.size());
+	state.SetLabel(out.back().tostdstring(CHRONOFORMAT, zone) + " " + zone.name());
+}
+
+void BM_chrono_fromstring_simd(benchmark::State &state)
+{
+	const simd_parser parser(compiled_format(CHRONOFORMAT), simdlevel(state.range(0)));
+	const std::string_view tstamp(TIMESTAMP);
+	timestamp t;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(parser.parse(tstamp, t));
+
+	state.SetItemsProcessed(state.iterations());
+	std::stringstream ss;
+	ss << t.tostdstring<CHRONOFORMAT_CT>() << " level " << int(parser.activelevel());
+	state.SetLabel(ss.str());
+}
+
+//The extended specifiers through each parser: range(0) 0 runtime compiled, 1 constexpr, 2 simd_parser.
+//Compare with the digits only format in BM_chrono_fromstring_compiled and BM_chrono_fromstring_simd.
+void BM_chrono_fromstring_extended(benchmark::State &state)
+{
+	const compiled_format format(EXTENDEDFORMAT);
+	const simd_parser parser(format);
+	const std::string_view tstamp(EXTENDEDTIMESTAMP);
+	timestamp t;
+	bool ok = false;
+	for (auto _ : state)
+	{
+		switch (state.range(0))
+		{
+		case 0: benchmark::DoNotOptimize(ok = t.fromstring(tstamp.data(), tstamp.size(), format, 0)); break;
+		case 1: benchmark::DoNotOptimize(t = timestamp::parse<EXTENDEDFORMAT_CT>(tstamp)); ok = t.isvalid(); break;
+		default: benchmark::DoNotOptimize(ok = parser.parse(tstamp, t)); break;
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations());
+	state.SetLabel(ok ? t.tostdstring(EXTENDEDFORMAT, 0) : "failed");
+}
+
+void BM_chrono_parsebatch_scalar(benchmark::State &state)
+{
+	const compiled_format format(CHRONOFORMAT);
+	const std::vector<std::string> strings = maketimestamps(size_t(state.range(0)));
+	std::vector<timestamp> out(strings.size());
+	for (auto _ : state)
+		for (size_t i = 0; i < strings.size(); ++i)
+			benchmark::DoNotOptimize(out[i].fromstring(strings[i], format));
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	state.SetLabel(out.back().tostdstring<CHRONOFORMAT_CT>());
+}
+
+void BM_chrono_parsebatch_simd(benchmark::State &state)
+{
+	const compiled_format format(CHRONOFORMAT);
+	const std::vector<std::string> strings = maketimestamps(size_t(state.range(0)));
+	const std::vector<std::string_view> views(strings.begin(), strings.end());
+	std::vector<timestamp> out(strings.size());
+	for (auto _ : state)
+		benchmark::DoNotOptimize(parse_batch(views.data(), out.data(), views.size(), format));
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	state.SetLabel(out.back().tostdstring<CHRONOFORMAT_CT>());
+}
+
+//A million strings parsed by a thread_pool of range(0) threads
+void BM_chrono_parsebatch_pool(benchmark::State &state)
+{
+	const compiled_format format(CHRONOFORMAT);
+	const std::vector<std::string> strings = maketimestamps(size_t(1) << 20);
+	const std::vector<std::string_view> views(strings.begin(), strings.end());
+	std::vector<timestamp> out(strings.size());
+	std::vector<std::uint64_t> errors((strings.size() + 63) / 64);
+	thread_pool pool(size_t(state.range(0)));
+	size_t parsed = 0;
+	for (auto _ : state)
+		parsed = parse_batch(views.data(), out.data(), views.size(), format, pool, errors.data());
+
+	state.SetItemsProcessed(state.iterations() * views.size());
+	state.SetLabel(std::to_string(views.size() - parsed) + " failed");
+}
+
+//Per core scaling: every benchmark thread parses its own slice of a shared million strings
+void BM_chrono_parsebatch_threads(benchmark::State &state)
+{
+	static const compiled_format format(CHRONOFORMAT);
+	static const std::vector<std::string> strings = maketimestamps(size_t(1) << 20);
+	static const std::vector<std::string_view> views(strings.begin(), strings.end());
+	static std::vector<timestamp> out(strings.size());
+	static std::vector<std::uint64_t> errors((strings.size() + 63) / 64);
+	//Slices start on a bitmap word
+	const size_t slice = (views.size() / size_t(state.threads) + 63) / 64 * 64;
+	const size_t begin = std::min(views.size(), slice * size_t(state.thread_index));
+	const size_t count = std::min(views.size() - begin, slice);
+	inline_executor serial;
+	for (auto _ : state)
+		parse_batch(views.data() + begin, out.data() + begin, count, format, serial, errors.data() + begin / 64);
+
+	state.SetItemsProcessed(state.iterations() * count);
+}
+
+//tryparse on a good string, range(0) 0, or one with a bad minute, 1. Compare with BM_chrono_fromstring_compiled.
+void BM_chrono_tryparse(benchmark::State &state)
+{
+	const compiled_format format(CHRONOFORMAT);
+	const std::string_view tstamp = state.range(0) ? "2018/07/14 22:1x:35.243" : TIMESTAMP;
+	timestamp t;
+	parse_result r;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(r = t.tryparse(tstamp, format));
+
+	state.SetLabel(r ? t.tostdstring(CHRONOFORMAT) : "failed at " + std::to_string(r.offset));
+}
+
+//A batch with range(0) percent malformed strings, with and without per field stats, range(1)
+void BM_chrono_parsebatch_stats(benchmark::State &state)
+{
+	const compiled_format format(CHRONOFORMAT);
+	std::vector<std::string> strings = maketimestamps(1024);
+	for (size_t i = 0; i < strings.size(); ++i)
+		if (i * 100 / strings.size() < size_t(state.range(0)))
+			strings[(i * 617) % strings.size()].replace(17, 2, "--");
+	const std::vector<std::string_view> views(strings.begin(), strings.end());
+	std::vector<timestamp> out(strings.size());
+	parse_stats stats;
+	for (auto _ : state)
+	{
+		if (state.range(1))
+		{
+			stats = parse_stats();
+			benchmark::DoNotOptimize(parse_batch(views.data(), out.data(), views.size(), format, stats));
+		}
+		else
+			benchmark::DoNotOptimize(parse_batch(views.data(), out.data(), views.size(), format));
+	}
+
+	state.SetItemsProcessed(state.iterations() * strings.size());
+	if (state.range(1))
+		state.SetLabel(std::to_string(stats.fields[int(fmtfield::second)]) + " bad seconds");
+}
+
+//range(0): 0 "Z", 1 a +hh:mm offset, 2 nanoseconds and an offset
+void BM_chrono_parse_iso8601(benchmark::State &state)
+{
+	const char* const samples[] = { "2018-07-14T22:14:35.243Z", "2018-07-15T00:14:35.243+02:00", "2018-07-15T00:14:35.243456789+02:00" };
+	const std::string_view tstamp = samples[state.range(0)];
+	timestamp t;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(t = timestamp::parse_iso8601(tstamp));
+
+	state.SetLabel(t.format_rfc3339());
+}
+
+//range(0) fraction digits, -1 for as few as are exact
+void BM_chrono_format_rfc3339(benchmark::State &state)
+{
+	const timestamp t = timestamp::parse_iso8601("2018-07-14T22:14:35.243Z");
+	char buf[timestamp::RFC3339_MAX];
+	size_t len = 0;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(len = t.format_rfc3339(buf, sizeof(buf), int(state.range(0)), 7200));
+
+	state.SetLabel(std::string(buf, len));
+}
+
+//One string in each layout detect_format knows
+const char* const DETECT_SAMPLES[] = { "2018-07-14T22:14:35.243", "2018-07-14T22:14:35.243Z", "Sat, 14 Jul 2018 22:14:35 +0000",
+	"Jul 14 22:14:35", "1531606475", "1531606475243" };
+
+void BM_chrono_detect(benchmark::State &state)
+{
+	std::vector<std::string_view> samples(std::begin(DETECT_SAMPLES), std::end(DETECT_SAMPLES));
+	int found = 0;
+	for (auto _ : state)
+		for (std::string_view s : samples)
+			benchmark::DoNotOptimize(found += int(detect_format(s).layout));
+
+	state.SetItemsProcessed(state.iterations() * samples.size());
+}
+
+//auto_parser on a steady stream of one layout, range(0) 0, or every string in a different layout than the last, 1.
+//Compare the steady case with BM_chrono_fromstring_compiled, which knows the format up front.
+void BM_chrono_autoparse(benchmark::State &state)
+{
+	std::vector<std::string_view> samples;
+	if (state.range(0))
+		samples.assign(std::begin(DETECT_SAMPLES), std::end(DETECT_SAMPLES));
+	else
+		samples.assign(6, DETECT_SAMPLES[0]);
+	auto_parser parser(tzone::utc(), 2018);
+	timestamp t;
+	for (auto _ : state)
+		for (std::string_view s : samples)
+			benchmark::DoNotOptimize(parser.parse(s, t));
+
+	state.SetItemsProcessed(state.iterations() * samples.size());
+	state.SetLabel(std::string(layoutname(parser.format().layout)) + ", " + std::to_string(parser.detectcount()) + " detections");
+}
+
+//assigntmparam as it was before the field parsers, for comparison: a std::string, zero padding and std::stoi in a try block
+bool stoiparam(const char** start, const char* end, int mincount, int maxcount, int& param, int paramlow, int paramhigh)
+{
+	const int count = std::min(int(end - *start), maxcount);
+	if (count < mincount)
+		return false;
+	int temp;
+	try {
+		temp = std::stoi(pad0right(std::string(*start, count), maxcount));
+	}
+	catch (std::exception&)
+	{
+		return false;
+	}
+	if (temp < paramlow || temp > paramhigh)
+		return false;
+	param = temp;
+	*start += count;
+	return true;
+}
+
+//range(0) percent of the strings have "--" for seconds. range(1) is how they're read: 0 field by field with
+//assigntmparam, 1 field by field with the old std::stoi version of it, 2 timestamp::fromstring with a compiled format.
+void BM_chrono_fromstring_malformed(benchmark::State &state)
+{
+	const compiled_format format(CHRONOFORMAT);
+	std::vector<std::string> strings = maketimestamps(1024);
+	for (size_t i = 0; i < strings.size(); ++i)
+		if (i * 100 / strings.size() < size_t(state.range(0)))
+			strings[(i * 617) % strings.size()].replace(17, 2, "--");
+
+	static const int widths[] = { 4, 2, 2, 2, 2, 2, 3 };
+	static const int lows[] = { 0, 1, 1, 0, 0, 0, 0 };
+	static const int highs[] = { 9999, 12, 31, 23, 59, 59, 999 };
+	auto fields = [&](const std::string& str, auto param) {
+		const char* s = str.data();
+		const char* const end = s + str.size();
+		int value = 0;
+		for (int f = 0; f < 7; ++f)
+		{
+			if (!param(&s, end, widths[f], widths[f], value, lows[f], highs[f]))
+				return false;
+			s += f < 6; //separator
+		}
+		return true;
+	};
+
+	size_t failed = 0;
+	timestamp t;
+	for (auto _ : state)
+	{
+		failed = 0;
+		for (const std::string& str : strings)
+		{
+			if (state.range(1) == 0)
+				failed += !fields(str, assigntmparam);
+			else if (state.range(1) == 1)
+				failed += !fields(str, stoiparam);
+			else
+				failed += !t.fromstring(str, format);
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations() * strings.size());
+	const char* modes[] = { "field parsers", "stoi", "fromstring" };
+	state.SetLabel(std::string(modes[state.range(1)]) + ", " + std::to_string(failed) + " failed");
+}
+
 void BM_chrono_tostring(benchmark::State &state)
 {
 	std::string result;
@@ -53,6 +475,87 @@ void BM_chrono_tostring(benchmark::State &state)
 	state.SetLabel(ss.str());
 }
 
+void BM_chrono_tostring_constexpr(benchmark::State &state)
+{
+	std::string result;
+	timestamp t = timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP);
+	for (auto _ : state) result = t.tostdstring<CHRONOFORMAT_CT>();
+
+	std::stringstream ss;
+	ss << result;
+	state.SetLabel(ss.str());
+}
+
+void BM_chrono_tostring_format_to(benchmark::State &state)
+{
+	const compiled_format format(CHRONOFORMAT);
+	timestamp t;
+	t.fromstring(TIMESTAMP, sizeof(TIMESTAMP) - 1, format);
+	char buf[64];
+	size_t len = 0;
+
+	const size_t before = g_allocations.load();
+	for (auto _ : state)
+		benchmark::DoNotOptimize(len = t.format_to(buf, sizeof(buf), format));
+	const size_t allocs = g_allocations.load() - before;
+
+	if (allocs)
+		state.SkipWithError("format_to allocated");
+	state.counters["allocs"] = double(allocs);
+	state.SetLabel(std::string(buf, len));
+}
+
+//Formatting the extended specifiers, range(0) 0 with format_to and 1 with the constexpr format. Compare with BM_chrono_tostring_format_to.
+void BM_chrono_tostring_extended(benchmark::State &state)
+{
+	const compiled_format format(EXTENDEDFORMAT);
+	timestamp t;
+	t.fromstring(EXTENDEDTIMESTAMP, sizeof(EXTENDEDTIMESTAMP) - 1, format, 0);
+	char buf[compiled_format::MAX_OUTPUT];
+	size_t len = 0;
+	std::string result;
+	for (auto _ : state)
+	{
+		if (state.range(0))
+			benchmark::DoNotOptimize(result = t.tostdstring<EXTENDEDFORMAT_CT>());
+		else
+			benchmark::DoNotOptimize(len = t.format_to(buf, sizeof(buf), format, 0));
+	}
+
+	state.SetLabel(state.range(0) ? result : std::string(buf, len));
+}
+
+void BM_chrono_tostring_utc(benchmark::State &state)
+{
+	const compiled_format format(CHRONOFORMAT);
+	timestamp t;
+	t.fromstring(TIMESTAMP, sizeof(TIMESTAMP) - 1, format, 0);
+	char buf[64];
+	size_t len = 0;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(len = t.format_to(buf, sizeof(buf), format, 0));
+
+	state.SetLabel(std::string(buf, len));
+}
+
+void BM_chrono_tostring_cached(benchmark::State &state)
+{
+	timestamp_formatter formatter{ compiled_format(CHRONOFORMAT) };
+	timestamp t = timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP);
+	const timediff step = milliseconds<int>(int(state.range(0)));
+	char buf[64];
+	size_t len = 0;
+
+	//A monotonic stream, like stamping log lines
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(len = formatter.format_to(buf, sizeof(buf), t));
+		t += step;
+	}
+
+	state.SetLabel(std::string(buf, len));
+}
+
 void BM_chrono_tdiffcreate(benchmark::State &state)
 {
 	//timediff t(std::chrono::seconds(state.range(0)));
@@ -80,6 +583,58 @@ void BM_chrono_tstampsubtract(benchmark::State &state)
 	state.SetLabel(ss.str());
 }
 
+void BM_chrono_tstampsubtract_compact(benchmark::State &state)
+{
+	const compact_timestamp tstamp1(timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP));
+	const compact_timestamp tstamp2 = tstamp1 - std::chrono::seconds(state.range(0));
+	compact_timediff t;
+
+	for (auto _ : state)
+		benchmark::DoNotOptimize(t = tstamp1 - tstamp2);
+
+	std::stringstream ss;
+	ss << t.asseconds<float>();
+	state.SetLabel(ss.str());
+}
+
+template<class TS>
+void BM_chrono_tstampadd(benchmark::State &state)
+{
+	TS t(timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP));
+	const std::chrono::milliseconds step(state.range(0));
+
+	for (auto _ : state)
+		benchmark::DoNotOptimize(t += step);
+
+	std::stringstream ss;
+	ss << sizeof(TS) << " bytes";
+	state.SetLabel(ss.str());
+}
+
+//Sums the gaps across a column of timestamps. The loop is memory bound, so the element size shows up directly.
+template<class TS>
+void BM_chrono_tstampcolumn(benchmark::State &state)
+{
+	const TS start(timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP));
+	std::vector<TS> column;
+	for (int i = 0; i < state.range(0); ++i)
+		column.push_back(start + std::chrono::milliseconds(i));
+
+	long long total = 0;
+	for (auto _ : state)
+	{
+		total = 0;
+		for (size_t i = 1; i < column.size(); ++i)
+			total += (column[i] - column[i - 1]).template asnanoseconds<long long>();
+		benchmark::DoNotOptimize(total);
+	}
+
+	state.SetBytesProcessed(state.iterations() * state.range(0) * sizeof(TS));
+	std::stringstream ss;
+	ss << sizeof(TS) << " bytes, " << total;
+	state.SetLabel(ss.str());
+}
+
 
 
 //TimeClass Benchmarks
@@ -145,20 +700,477 @@ void BM_timeclass_tdiffcreate(benchmark::State &state) {
 //	state.SetLabel(ss.str());
 //}
 
+//Shifting and reducing a series, as an array of timestamps and as a column
+void BM_chrono_series_add(benchmark::State &state)
+{
+	const timestamp start = timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP);
+	std::vector<timestamp> series;
+	for (int i = 0; i < state.range(0); ++i)
+		series.push_back(start + std::chrono::milliseconds(i));
+
+	const timediff step = std::chrono::milliseconds(1);
+	for (auto _ : state)
+	{
+		for (timestamp& t : series)
+			t += step;
+		benchmark::DoNotOptimize(series.data());
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_chrono_array_add(benchmark::State &state)
+{
+	const compact_timestamp start(timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP));
+	timestamp_array column;
+	for (int i = 0; i < state.range(0); ++i)
+		column.push_back(start + std::chrono::milliseconds(i));
+
+	const compact_timediff step = std::chrono::milliseconds(1);
+	for (auto _ : state)
+	{
+		column += step;
+		benchmark::DoNotOptimize(column.data());
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_chrono_series_deltasum(benchmark::State &state)
+{
+	const timestamp start = timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP);
+	std::vector<timestamp> series;
+	for (int i = 0; i < state.range(0); ++i)
+		series.push_back(start + std::chrono::milliseconds(i));
+
+	double total = 0;
+	for (auto _ : state)
+	{
+		total = 0;
+		for (size_t i = 1; i < series.size(); ++i)
+			total += (series[i] - series[i - 1]).asseconds<double>();
+		benchmark::DoNotOptimize(total);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	state.SetLabel(std::to_string(total));
+}
+
+void BM_chrono_array_deltasum(benchmark::State &state)
+{
+	const compact_timestamp start(timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP));
+	timestamp_array column;
+	for (int i = 0; i < state.range(0); ++i)
+		column.push_back(start + std::chrono::milliseconds(i));
+
+	timediff_array deltas;
+	double total = 0;
+	for (auto _ : state)
+	{
+		column.deltas(deltas);
+		benchmark::DoNotOptimize(total = deltas.sum().asseconds<double>());
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	state.SetLabel(std::to_string(total));
+}
+
+void BM_chrono_array_minmax(benchmark::State &state)
+{
+	const compact_timestamp start(timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP));
+	timestamp_array column;
+	for (int i = 0; i < state.range(0); ++i)
+		column.push_back(start + std::chrono::milliseconds((i * 7919) % state.range(0)));
+
+	compact_timediff span;
+	for (auto _ : state)
+		benchmark::DoNotOptimize(span = column.max() - column.min());
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	state.SetLabel(std::to_string(span.asseconds<double>()));
+}
+
+//Lines of a log with a leading timestamp and a message, one in ten without a stamp
+std::string makelog(size_t lines)
+{
+	std::string ret;
+	const std::vector<std::string> stamps = maketimestamps(lines);
+	for (size_t i = 0; i < lines; ++i)
+	{
+		if (i % 10)
+			ret += stamps[i] + ' ';
+		ret += "INFO request handled in 12ms, status 200, path /api/v1/items\n";
+	}
+	return ret;
+}
+
+void BM_chrono_logscan_getline(benchmark::State &state)
+{
+	const std::string log = makelog(size_t(state.range(0)));
+	size_t found = 0;
+	for (auto _ : state)
+	{
+		std::istringstream in(log);
+		std::string line;
+		timestamp t;
+		found = 0;
+		while (std::getline(in, line))
+			found += t.fromstring(line.substr(0, sizeof(TIMESTAMP) - 1), CHRONOFORMAT);
+		benchmark::DoNotOptimize(found);
+	}
+	state.SetBytesProcessed(state.iterations() * log.size());
+	state.SetLabel(std::to_string(found));
+}
+
+void BM_chrono_logscan(benchmark::State &state)
+{
+	const std::string log = makelog(size_t(state.range(0)));
+	const log_reader reader{ compiled_format(CHRONOFORMAT) };
+	size_t found = 0;
+	for (auto _ : state)
+	{
+		found = 0;
+		reader.scan(log, [&](const log_line& line) { found += line.time.isvalid(); });
+		benchmark::DoNotOptimize(found);
+	}
+	state.SetBytesProcessed(state.iterations() * log.size());
+	state.SetLabel(std::to_string(found));
+}
+
+//Percentiles the old way: keep every timediff and sort
+void BM_chrono_percentile_sort(benchmark::State &state)
+{
+	std::vector<long long> samples;
+	for (auto _ : state)
+	{
+		samples.clear();
+		for (int i = 0; i < state.range(0); ++i)
+			samples.push_back(microseconds<int>((i * 7919) % 100000).asnanoseconds<long long>());
+		std::sort(samples.begin(), samples.end());
+		benchmark::DoNotOptimize(samples[samples.size() * 99 / 100]);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_chrono_percentile_histogram(benchmark::State &state)
+{
+	latency_histogram<> histogram;
+	timediff p99 = histogram.percentile(99);
+	for (auto _ : state)
+	{
+		histogram.reset();
+		for (int i = 0; i < state.range(0); ++i)
+			histogram.record(microseconds<int>((i * 7919) % 100000));
+		benchmark::DoNotOptimize(p99 = histogram.percentile(99));
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	state.SetLabel(std::to_string(p99.asmicroseconds<long long>()) + "us");
+}
+
+//Every thread records into one histogram, or into its own shard
+template<class H>
+void BM_chrono_histogram_record(benchmark::State &state)
+{
+	static H histogram;
+	const compact_timediff t = std::chrono::microseconds(250 + state.thread_index);
+	for (auto _ : state)
+		histogram.record(t);
+	state.SetItemsProcessed(state.iterations());
+}
+
+//Cost of one traced scope. 0: no session running. 1: a session writing binary to a scratch file.
+void BM_chrono_tracescope(benchmark::State &state)
+{
+	const char* path = "chronobench_trace.bin";
+	if (state.range(0))
+		trace_session::instance().start(path, trace_format::binary, std::chrono::milliseconds(10));
+	for (auto _ : state)
+	{
+		trace_scope scope("bench");
+		benchmark::ClobberMemory();
+	}
+	if (state.range(0))
+	{
+		trace_session::instance().stop();
+		state.SetLabel("dropped " + std::to_string(trace_session::instance().dropped()));
+		std::remove(path);
+	}
+}
+
+//Timeout churn: range(0) timers armed 0 to 60s out. Each iteration moves the clock on 1us and pushes one random
+//timer's deadline back to 30 to 60s from now, the way a connection's idle timeout is reset on traffic. Fired timers are re-armed.
+struct churn_timer : timer_node
+{
+	std::uint32_t generation = 0;
+};
+
+static std::uint64_t churnrandom(std::uint64_t& x)
+{
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+//Baseline: binary heap with lazy cancellation, each reset pushes a new entry and stale ones are skipped on pop
+void BM_chrono_timerqueue_churn(benchmark::State &state)
+{
+	using t_entry = std::pair<std::int64_t, std::pair<std::uint32_t, std::uint32_t>>;
+	const size_t n = size_t(state.range(0));
+	std::uint64_t seed = 88172645463325252ull;
+	std::int64_t now = compact_timestamp::now().count();
+	std::vector<std::uint32_t> generation(n);
+	std::vector<t_entry> initial(n);
+	for (size_t i = 0; i < n; ++i)
+		initial[i] = { now + std::int64_t(churnrandom(seed) % 60000000000ull), { std::uint32_t(i), 0u } };
+	std::priority_queue<t_entry, std::vector<t_entry>, std::greater<t_entry>> queue(std::greater<t_entry>(), std::move(initial));
+	size_t fired = 0;
+	for (auto _ : state)
+	{
+		now += 1000;
+		const std::uint32_t i = std::uint32_t(churnrandom(seed) % n);
+		queue.push({ now + 30000000000ll + std::int64_t(churnrandom(seed) % 30000000000ull), { i, ++generation[i] } });
+		while (queue.top().first <= now)
+		{
+			const auto [id, gen] = queue.top().second;
+			queue.pop();
+			if (gen != generation[id])
+				continue;
+			++fired;
+			queue.push({ now + 30000000000ll, { id, ++generation[id] } });
+		}
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.SetLabel(std::to_string(fired) + " fired");
+}
+
+void BM_chrono_timerwheel_churn(benchmark::State &state)
+{
+	const size_t n = size_t(state.range(0));
+	std::uint64_t seed = 88172645463325252ull;
+	compact_timestamp now = compact_timestamp::now();
+	std::vector<churn_timer> timers(n);
+	timer_wheel wheel(now);
+	for (auto& t : timers)
+		wheel.schedule(t, now + compact_timediff(std::int64_t(churnrandom(seed) % 60000000000ull)));
+	size_t fired = 0;
+	for (auto _ : state)
+	{
+		now += compact_timediff(1000);
+		wheel.schedule(timers[churnrandom(seed) % n], now + compact_timediff(30000000000ll + std::int64_t(churnrandom(seed) % 30000000000ull)));
+		fired += wheel.advance(now, [&](timer_node& t) { wheel.schedule(t, now + compact_timediff(30000000000ll)); });
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.SetLabel(std::to_string(fired) + " fired");
+}
+
+//Every thread churns its own slice of the timers on its own shard
+void BM_chrono_timerwheel_shardedchurn(benchmark::State &state)
+{
+	static const size_t n = 10000000;
+	static std::vector<churn_timer> timers(n);
+	static sharded_timer_wheel wheel(8);
+	const size_t first = n / size_t(state.threads) * size_t(state.thread_index);
+	const size_t count = n / size_t(state.threads);
+	std::uint64_t seed = 88172645463325252ull + std::uint64_t(state.thread_index);
+	compact_timestamp now = compact_timestamp::now();
+	for (size_t i = first; i < first + count; ++i)
+		wheel.schedule(timers[i], now + compact_timediff(std::int64_t(churnrandom(seed) % 60000000000ull)));
+	const size_t shard = wheel.threadshard();
+	std::vector<timer_node*> expired;
+	size_t fired = 0;
+	for (auto _ : state)
+	{
+		now += compact_timediff(1000);
+		wheel.schedule(timers[first + churnrandom(seed) % count], now + compact_timediff(30000000000ll + std::int64_t(churnrandom(seed) % 30000000000ull)));
+		fired += wheel.advance(shard, now, [&](timer_node& t) { expired.push_back(&t); });
+		for (timer_node* t : expired)
+			wheel.schedule(*t, now + compact_timediff(30000000000ll));
+		expired.clear();
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.SetLabel(std::to_string(fired) + " fired");
+}
+
+//Decisions per second from every thread on one shared limiter, allowing one request per 100ns with bursts of 1000
+template<class Clock> const Clock& benchclock();
+template<> const tsc_clock& benchclock<tsc_clock>()
+{
+	static tsc_clock clock;
+	return clock;
+}
+template<> const coarse_clock& benchclock<coarse_clock>()
+{
+	static coarse_clock clock;
+	clock.start();
+	return clock;
+}
+
+template<class Clock>
+bool ratelimitdecide(token_bucket<Clock>& limiter) { return limiter.tryacquire(); }
+template<class Clock>
+bool ratelimitdecide(gcra_limiter<Clock>& limiter) { return limiter.allow(); }
+
+template<class Limiter>
+void BM_chrono_ratelimit(benchmark::State &state)
+{
+	static Limiter limiter(benchclock<typename Limiter::clock_type>(), nanoseconds<int>(100), 1000);
+	size_t admitted = 0;
+	for (auto _ : state)
+		admitted += ratelimitdecide(limiter);
+	state.SetItemsProcessed(state.iterations());
+	state.counters["admitted"] = benchmark::Counter(double(admitted), benchmark::Counter::kIsRate);
+}
+
+//Every thread counting events into one per second window of 60 buckets, stamped from the coarse clock
+void BM_chrono_window_add(benchmark::State &state)
+{
+	static sliding_window<60> window;
+	const coarse_clock& clock = benchclock<coarse_clock>();
+	for (auto _ : state)
+		window.add(clock.nowcompact(), 250);
+	state.SetItemsProcessed(state.iterations());
+}
+
+void BM_chrono_window_rate(benchmark::State &state)
+{
+	sliding_window<60> window;
+	compact_timestamp t = compact_timestamp::now();
+	for (int i = 0; i < 6000; ++i)
+		window.add(t + compact_timediff(std::int64_t(i) * 10000000));
+	t += std::chrono::seconds(60);
+	double rate = 0;
+	for (auto _ : state)
+	{
+		rate += window.rate(t);
+		benchmark::DoNotOptimize(rate);
+	}
+}
+
+//Flooring a day of minute stamps to the hour. 0: format to the hour and parse back, the old workaround. 1: floor_to().
+void BM_chrono_floor(benchmark::State &state)
+{
+	std::vector<timestamp> times;
+	const timestamp t = timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP);
+	for (int i = 0; i < 1440; ++i)
+		times.push_back(t + minutes<int>(i));
+	const compiled_format hourformat("%Y/%M/%d %H");
+	const timediff hour = hours<int>(1);
+	timestamp out;
+	for (auto _ : state)
+		for (const timestamp& time : times)
+		{
+			if (state.range(0))
+				out = floor_to(time, hour);
+			else
+				out.fromstring(time.tostdstring("%Y/%M/%d %H", 0), hourformat, 0);
+			benchmark::DoNotOptimize(out);
+		}
+	state.SetItemsProcessed(state.iterations() * times.size());
+	state.SetLabel(out.tostdstring(CHRONOFORMAT, 0));
+}
+
+//Start of the local day for a year of times a minute apart
+void BM_chrono_floor_to_day(benchmark::State &state)
+{
+	tzone zone;
+	if (!tzone::locate("America/New_York", zone))
+		zone = tzone::local();
+	const compact_timestamp first(timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP));
+	std::vector<compact_timestamp> times(size_t(state.range(0)));
+	for (size_t i = 0; i < times.size(); ++i)
+		times[i] = first + compact_timediff(std::chrono::minutes(std::int64_t(i)));
+	std::vector<compact_timestamp> out(times.size());
+	for (auto _ : state)
+		for (size_t i = 0; i < times.size(); ++i)
+			out[i] = floor_to_day(times[i], zone);
+	state.SetItemsProcessed(state.iterations() * times.size());
+}
+
+//Same through the batch version, which reuses each day's bounds for the whole run of times in it
+void BM_chrono_floor_to_day_batch(benchmark::State &state)
+{
+	tzone zone;
+	if (!tzone::locate("America/New_York", zone))
+		zone = tzone::local();
+	const compact_timestamp first(timestamp::parse<CHRONOFORMAT_CT>(TIMESTAMP));
+	std::vector<compact_timestamp> times(size_t(state.range(0)));
+	for (size_t i = 0; i < times.size(); ++i)
+		times[i] = first + compact_timediff(std::chrono::minutes(std::int64_t(i)));
+	std::vector<compact_timestamp> out(times.size());
+	for (auto _ : state)
+	{
+		floor_to(times.data(), out.data(), times.size(), calendar_unit::day, zone);
+		benchmark::DoNotOptimize(out.data());
+	}
+	state.SetItemsProcessed(state.iterations() * times.size());
+}
+
 BENCHMARK(BM_Empty);
 BENCHMARK(BM_chrono_tstampcreate);
+BENCHMARK(BM_chrono_stopwatch);
+BENCHMARK(BM_chrono_stopwatch_lap);
+BENCHMARK(BM_chrono_now)->Arg(0)->Arg(1)->Arg(2);
+BENCHMARK(BM_chrono_tracescope)->Arg(0)->Arg(1);
 BENCHMARK(BM_timeclass_create);
 
 BENCHMARK(BM_chrono_fromstring);
+BENCHMARK(BM_chrono_fromstring_compiled);
+BENCHMARK(BM_chrono_fromstring_constexpr);
+BENCHMARK(BM_chrono_fromstring_zone);
+BENCHMARK(BM_chrono_fromstring_simd)->DenseRange(int(simdlevel::scalar), int(simdlevel::avx2));
+BENCHMARK(BM_chrono_fromstring_extended)->DenseRange(0, 2);
+BENCHMARK(BM_chrono_parsebatch_scalar)->Arg(1024);
+BENCHMARK(BM_chrono_parsebatch_simd)->Arg(1024);
+BENCHMARK(BM_chrono_parsebatch_pool)->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
+BENCHMARK(BM_chrono_parsebatch_threads)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_chrono_fromstring_malformed)->Args({ 0, 0 })->Args({ 0, 1 })->Args({ 0, 2 })->Args({ 10, 0 })->Args({ 10, 1 })->Args({ 10, 2 })
+	->Args({ 50, 0 })->Args({ 50, 1 })->Args({ 50, 2 });
+BENCHMARK(BM_chrono_tryparse)->Arg(0)->Arg(1);
+BENCHMARK(BM_chrono_parse_iso8601)->Arg(0)->Arg(1)->Arg(2);
+BENCHMARK(BM_chrono_format_rfc3339)->Arg(-1)->Arg(0)->Arg(9);
+BENCHMARK(BM_chrono_detect);
+BENCHMARK(BM_chrono_autoparse)->Arg(0)->Arg(1);
+BENCHMARK(BM_chrono_parsebatch_stats)->Args({ 0, 0 })->Args({ 0, 1 })->Args({ 10, 0 })->Args({ 10, 1 });
+BENCHMARK(BM_chrono_logscan_getline)->Arg(1 << 16);
+BENCHMARK(BM_chrono_logscan)->Arg(1 << 16);
 BENCHMARK(BM_timeclass_fromstring);
 
 BENCHMARK(BM_chrono_tostring);
+BENCHMARK(BM_chrono_tostring_constexpr);
+BENCHMARK(BM_chrono_tostring_format_to);
+BENCHMARK(BM_chrono_tostring_extended)->Arg(0)->Arg(1);
+BENCHMARK(BM_chrono_tostring_utc);
+BENCHMARK(BM_chrono_tostring_cached)->Arg(1)->Arg(1000);
 BENCHMARK(BM_timeclass_tostring);
 
 BENCHMARK(BM_chrono_tdiffcreate)->Arg(50);
 BENCHMARK(BM_timeclass_tdiffcreate)->Arg(50);
 
 BENCHMARK(BM_chrono_tstampsubtract)->Arg(50);
+BENCHMARK(BM_chrono_tstampsubtract_compact)->Arg(50);
+BENCHMARK_TEMPLATE(BM_chrono_tstampadd, timestamp)->Arg(50);
+BENCHMARK_TEMPLATE(BM_chrono_tstampadd, compact_timestamp)->Arg(50);
+BENCHMARK_TEMPLATE(BM_chrono_tstampcolumn, timestamp)->Arg(1 << 22);
+BENCHMARK_TEMPLATE(BM_chrono_tstampcolumn, compact_timestamp)->Arg(1 << 22);
+
+BENCHMARK(BM_chrono_series_add)->Arg(1 << 16);
+BENCHMARK(BM_chrono_array_add)->Arg(1 << 16);
+BENCHMARK(BM_chrono_series_deltasum)->Arg(1 << 16);
+BENCHMARK(BM_chrono_array_deltasum)->Arg(1 << 16);
+BENCHMARK(BM_chrono_array_minmax)->Arg(1 << 16);
+BENCHMARK(BM_chrono_floor)->Arg(0)->Arg(1);
+BENCHMARK(BM_chrono_floor_to_day)->Arg(525600);
+BENCHMARK(BM_chrono_floor_to_day_batch)->Arg(525600);
+
+BENCHMARK(BM_chrono_percentile_sort)->Arg(1 << 16);
+BENCHMARK(BM_chrono_percentile_histogram)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_chrono_histogram_record, latency_histogram<>)->ThreadRange(1, 8);
+BENCHMARK_TEMPLATE(BM_chrono_histogram_record, sharded_histogram<>)->ThreadRange(1, 8);
+BENCHMARK(BM_chrono_timerqueue_churn)->Arg(1 << 16)->Arg(10000000);
+BENCHMARK(BM_chrono_timerwheel_churn)->Arg(1 << 16)->Arg(10000000);
+BENCHMARK(BM_chrono_timerwheel_shardedchurn)->ThreadRange(1, 8);
+BENCHMARK_TEMPLATE(BM_chrono_ratelimit, token_bucket<tsc_clock>)->ThreadRange(1, 64);
+BENCHMARK_TEMPLATE(BM_chrono_ratelimit, token_bucket<coarse_clock>)->ThreadRange(1, 64);
+BENCHMARK_TEMPLATE(BM_chrono_ratelimit, gcra_limiter<tsc_clock>)->ThreadRange(1, 64);
+BENCHMARK_TEMPLATE(BM_chrono_ratelimit, gcra_limiter<coarse_clock>)->ThreadRange(1, 64);
+BENCHMARK(BM_chrono_window_add)->ThreadRange(1, 8);
+BENCHMARK(BM_chrono_window_rate);
 //BENCHMARK(BM_timeclass_tstampsubtract)->Arg(50);
 
 BENCHMARK_MAIN();
@@ -2,10 +2,33 @@
 
 #include <chrono>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 //#include <cstdlib>
 
+//For rarely taken paths that would otherwise bloat the hot loops they're called from
+#ifdef _MSC_VER
+#define CHRONOWRAP_NOINLINE __declspec(noinline)
+#else
+#define CHRONOWRAP_NOINLINE __attribute__((noinline))
+#endif
+
 const int S_IN_MINUTE = 60;
 const int S_IN_HOUR = S_IN_MINUTE * 60;
 const int S_IN_DAY = S_IN_HOUR * 24;
@@ -69,8 +92,9 @@ class timediff
 
 public:
 	constexpr timediff(const timediff& rhs) : sec(rhs.sec), nsec(rhs.nsec) {}
+	constexpr timediff& operator=(const timediff& rhs) = default;
 	//Simplified constructor if the type is in seconds
-	constexpr timediff(t_sec s) : nsec(0), sec(s) {}
+	constexpr timediff(t_sec s) : sec(s), nsec(0) {}
 	//Templated constructor for other types
 	template<class T> constexpr timediff(T dur)
 	{
@@ -93,311 +117,2323 @@ public:
 };
 
 //TimeDiff functions for integral types:
-template <class I> timediff weeks(typename std::enable_if<std::_Is_integral<I>::value, I>::type t) { return timediff(std::chrono::seconds(t * S_IN_WEEK)); }
-template <class I> timediff days(typename std::enable_if<std::_Is_integral<I>::value, I>::type t) { return timediff(std::chrono::seconds(t * S_IN_DAY)); }
-template <class I> timediff hours(typename std::enable_if<std::_Is_integral<I>::value, I>::type t) { return timediff(std::chrono::seconds(t * S_IN_HOUR)); }
-template <class I> timediff minutes(typename std::enable_if<std::_Is_integral<I>::value, I>::type t) { return timediff(std::chrono::seconds(t * S_IN_MINUTE)); }
-template <class I> timediff seconds(typename std::enable_if<std::_Is_integral<I>::value, I>::type t) { return timediff(std::chrono::seconds(t)); }
-template <class I> timediff milliseconds(typename std::enable_if<std::_Is_integral<I>::value, I>::type t) { return timediff(std::chrono::milliseconds(t)); }
-template <class I> timediff microseconds(typename std::enable_if<std::_Is_integral<I>::value, I>::type t) { return timediff(std::chrono::microseconds(t)); }
-template <class I> timediff nanoseconds(typename std::enable_if<std::_Is_integral<I>::value, I>::type t) { return timediff(std::chrono::nanoseconds(t)); }
+template <class I> timediff weeks(typename std::enable_if<std::is_integral<I>::value, I>::type t) { return timediff(std::chrono::seconds(t * S_IN_WEEK)); }
+template <class I> timediff days(typename std::enable_if<std::is_integral<I>::value, I>::type t) { return timediff(std::chrono::seconds(t * S_IN_DAY)); }
+template <class I> timediff hours(typename std::enable_if<std::is_integral<I>::value, I>::type t) { return timediff(std::chrono::seconds(t * S_IN_HOUR)); }
+template <class I> timediff minutes(typename std::enable_if<std::is_integral<I>::value, I>::type t) { return timediff(std::chrono::seconds(t * S_IN_MINUTE)); }
+template <class I> timediff seconds(typename std::enable_if<std::is_integral<I>::value, I>::type t) { return timediff(std::chrono::seconds(t)); }
+template <class I> timediff milliseconds(typename std::enable_if<std::is_integral<I>::value, I>::type t) { return timediff(std::chrono::milliseconds(t)); }
+template <class I> timediff microseconds(typename std::enable_if<std::is_integral<I>::value, I>::type t) { return timediff(std::chrono::microseconds(t)); }
+template <class I> timediff nanoseconds(typename std::enable_if<std::is_integral<I>::value, I>::type t) { return timediff(std::chrono::nanoseconds(t)); }
 
 
 //Convenience wrappers for non integral types:
-template <class T> timediff weeks(typename std::enable_if<!std::_Is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T>(t * S_IN_WEEK)); }
-template <class T> timediff days(typename std::enable_if<!std::_Is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T>(t * S_IN_DAY)); }
-template <class T> timediff hours(typename std::enable_if<!std::_Is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T>(t * S_IN_HOUR)); }
-template <class T> timediff minutes(typename std::enable_if<!std::_Is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T>(t * S_IN_MINUTE)); }
-template <class T> timediff seconds(typename std::enable_if<!std::_Is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T>(t)); }
-template <class T> timediff milliseconds(typename std::enable_if<!std::_Is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T, std::milli>(t)); }
-template <class T> timediff microseconds(typename std::enable_if<!std::_Is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T, std::micro>(t)); }
-template <class T> timediff nanoseconds(typename std::enable_if<!std::_Is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T, std::nano>(t)); }
+template <class T> timediff weeks(typename std::enable_if<!std::is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T>(t * S_IN_WEEK)); }
+template <class T> timediff days(typename std::enable_if<!std::is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T>(t * S_IN_DAY)); }
+template <class T> timediff hours(typename std::enable_if<!std::is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T>(t * S_IN_HOUR)); }
+template <class T> timediff minutes(typename std::enable_if<!std::is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T>(t * S_IN_MINUTE)); }
+template <class T> timediff seconds(typename std::enable_if<!std::is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T>(t)); }
+template <class T> timediff milliseconds(typename std::enable_if<!std::is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T, std::milli>(t)); }
+template <class T> timediff microseconds(typename std::enable_if<!std::is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T, std::micro>(t)); }
+template <class T> timediff nanoseconds(typename std::enable_if<!std::is_integral<T>::value, T>::type t) { return timediff(std::chrono::duration<T, std::nano>(t)); }
 
-//TIMESTAMP TYPE
-class timestamp
+
+//MONOTONIC TYPES. A point on a clock that never goes backwards, for measuring intervals.
+//Differences are timediffs like timestamp's, but NTP and manual clock changes don't show up in them.
+template<class Clock = std::chrono::steady_clock>
+class monotonic_timestamp
 {
-	using t_nsec = std::chrono::nanoseconds;
-	using t_sec = std::chrono::seconds;
-	using t_msec = std::chrono::milliseconds;
-	using t_sysclock = std::chrono::system_clock;
-	using t_hiresclock = std::chrono::high_resolution_clock;
-	template<class T> using t_timepoint = std::chrono::time_point<T>;
+	typename Clock::time_point time;
 
-	//This is just a wrapper around a couple of chrono classes.
-	t_timepoint<t_sysclock> time;
-	bool hastime = false;
+public:
+	using clock = Clock;
 
-	//private functions
-	template<class TT, class FT> static constexpr TT durcast(FT rhs) { return std::chrono::duration_cast<TT>(rhs); }
+	constexpr monotonic_timestamp() : time() {}
+	explicit constexpr monotonic_timestamp(typename Clock::time_point t) : time(t) {}
 
-public:
-	constexpr timestamp(const t_timepoint<t_sysclock>& t, bool ht) : time(t), hastime(ht) {}
-	constexpr timestamp() : hastime(false), time(t_sec(0)) {};
-	constexpr timestamp(const timestamp& rhs) : hastime(rhs.hastime), time(rhs.time) {}
+	static monotonic_timestamp now() { return monotonic_timestamp(Clock::now()); }
+	constexpr typename Clock::time_point astimepoint() const { return time; }
 
-	constexpr static timestamp now() { return timestamp(t_sysclock::now(), true); }
-	constexpr t_timepoint<t_sysclock> astimepoint() const { return time; }
-	constexpr bool isvalid() const { return hastime; }
+	timediff operator-(const monotonic_timestamp& rhs) const { return timediff(time - rhs.time); }
+	monotonic_timestamp operator+(const timediff& rhs) const { return monotonic_timestamp(time + std::chrono::duration_cast<typename Clock::duration>(rhs.data().first + rhs.data().second)); }
+	monotonic_timestamp operator-(const timediff& rhs) const { return monotonic_timestamp(time - std::chrono::duration_cast<typename Clock::duration>(rhs.data().first + rhs.data().second)); }
 
-	timediff operator-(const timestamp& rhs) const { return timediff((time.time_since_epoch() - rhs.time.time_since_epoch())/* + (nano - rhs.nano)*/); }
-	constexpr timestamp operator+(const timediff& rhs) const { return timestamp(time + rhs.data().first + durcast<std::chrono::system_clock::duration>(rhs.data().second), true); }
-	constexpr timestamp operator-(const timediff& rhs) const { return timestamp(time - rhs.data().first - durcast<std::chrono::system_clock::duration>(rhs.data().second), true); }
+	constexpr bool operator==(const monotonic_timestamp& rhs) const { return time == rhs.time; }
+	constexpr bool operator!=(const monotonic_timestamp& rhs) const { return time != rhs.time; }
+	constexpr bool operator<(const monotonic_timestamp& rhs) const { return time < rhs.time; }
+	constexpr bool operator>(const monotonic_timestamp& rhs) const { return time > rhs.time; }
+	constexpr bool operator<=(const monotonic_timestamp& rhs) const { return time <= rhs.time; }
+	constexpr bool operator>=(const monotonic_timestamp& rhs) const { return time >= rhs.time; }
+};
 
-	constexpr timestamp& operator+=(const timediff& rhs) { return *this = *this + rhs; }
-	constexpr timestamp& operator-=(const timediff& rhs) { return *this = *this - rhs; }
+//Elapsed time with pause/resume and laps. split() is the total so far, lap() the time since the previous lap.
+//Time spent stopped doesn't count towards either.
+template<class Clock = std::chrono::steady_clock>
+class stopwatch
+{
+	using t_dur = typename Clock::duration;
 
-	bool fromstring(const char* tstamp, const char* format, size_t tlen, size_t flen);
-	bool fromstring(const std::string& tstamp, const std::string& format) { return fromstring(tstamp.c_str(), format.c_str(), tstamp.size(), format.size()); }
-	std::string tostdstring(const std::string& format);
+	typename Clock::time_point started;
+	t_dur banked = t_dur::zero();  //elapsed before the last start
+	t_dur lapmark = t_dur::zero(); //elapsed at the last lap
+	bool running = false;
+
+	t_dur total() const { return running ? banked + (Clock::now() - started) : banked; }
+
+public:
+	using clock = Clock;
+
+	explicit stopwatch(bool startnow = true) { if (startnow) start(); }
+
+	//Starts, or resumes after stop()
+	void start()
+	{
+		if (running)
+			return;
+		started = Clock::now();
+		running = true;
+	}
+	//Pauses. Returns the total elapsed time.
+	timediff stop()
+	{
+		if (running)
+		{
+			banked += Clock::now() - started;
+			running = false;
+		}
+		return timediff(banked);
+	}
+	//Zeroes the stopwatch and leaves it stopped
+	void reset()
+	{
+		banked = lapmark = t_dur::zero();
+		running = false;
+	}
+	//Zeroes the stopwatch and starts it again
+	void restart()
+	{
+		reset();
+		start();
+	}
+	bool isrunning() const { return running; }
+
+	timediff elapsed() const { return timediff(total()); }
+	timediff split() const { return elapsed(); }
+	//Time since the previous lap, or since the start for the first one
+	timediff lap()
+	{
+		const t_dur now = total();
+		const t_dur ret = now - lapmark;
+		lapmark = now;
+		return timediff(ret);
+	}
 };
 
+//FORMAT ENGINE. The value slots parsing fills and formatting reads, indexed by fmtfield.
+//yearday, weekday, ampm and utcoffset are only filled when parsing specifiers that set them; formatting works them out
+//from the date, except utcoffset, which is always filled. epoch has no slot value, it's there to name the field in errors.
+enum class fmtfield : unsigned char { year = 0, month, day, hour, minute, second, milli, nano, yearday, weekday, ampm, utcoffset, epoch, literal };
+const int FMT_FIELDCOUNT = int(fmtfield::literal);
+//utcoffset slot value when the string had no offset
+const int FMT_NOOFFSET = INT_MIN;
 
-//Modifies the start pointer and advances it by the number of characters read in.
-inline bool assigntmparam(const char ** start, const char* end, int mincount, int maxcount, int& param, int paramlow, int paramhigh)
+//How an op is read and written. digits and fraction are the fast path, handled inline by every parser;
+//the rest go through readfield and writefield.
+enum class fmtkind : unsigned char
 {
-	//Assert that the user isn't stupid:
-	_ASSERT(start);
-	_ASSERT(end);
-	const char* s_ptr = *start;
-	_ASSERT(s_ptr);
-	_ASSERT(end > s_ptr);
+	literal,
+	digits,     //zero padded, exactly width digits
+	fraction,   //up to width digits, right padded with zeros, in the slot's own units
+	scaled,     //a fraction of fewer than 9 digits, scaled to nanoseconds
+	spaced,     //space padded digits
+	hour12,     //01 to 12, into the hour slot; made 24 hour by an ampm op
+	ampm,       //AM or PM
+	monthabbr,  //Jan
+	monthname,  //January
+	weekdayabbr,//Sun. Parsed but not checked against the date.
+	yearday,    //001 to 366
+	utcoffset,  //+hhmm
+	epoch       //seconds since 1970-01-01 UTC, optionally negative. Sets the date, time and offset.
+};
 
-	int temp;
-	int count = std::min(int(end - s_ptr), maxcount);
-	if (count < mincount)
-		return false;
+//Specifier table: symbol, value slot, kind, most characters written/read, fewest characters accepted when parsing.
+//%x, %f and %u are variable width and right padded with zeros, so "%x" on "5" reads 500ms. %<n>f is a fraction of n digits.
+struct fmtspec
+{
+	char symbol;
+	fmtfield field;
+	fmtkind kind;
+	unsigned char width;
+	unsigned char minwidth;
+};
+//The original specifiers, %Y through %f, come first, so the uncompiled fromstring can find them with a short search
+const int FMT_BASICSPECS = 8;
+constexpr fmtspec FORMAT_SPECS[] = {
+	{ 'Y', fmtfield::year, fmtkind::digits, 4, 4 }, { 'M', fmtfield::month, fmtkind::digits, 2, 2 }, { 'd', fmtfield::day, fmtkind::digits, 2, 2 },
+	{ 'H', fmtfield::hour, fmtkind::digits, 2, 2 }, { 'm', fmtfield::minute, fmtkind::digits, 2, 2 }, { 's', fmtfield::second, fmtkind::digits, 2, 2 },
+	{ 'x', fmtfield::milli, fmtkind::fraction, 3, 1 }, { 'f', fmtfield::nano, fmtkind::fraction, 9, 1 }, { 'u', fmtfield::nano, fmtkind::scaled, 6, 1 },
+	{ 'b', fmtfield::month, fmtkind::monthabbr, 3, 3 }, { 'B', fmtfield::month, fmtkind::monthname, 9, 3 }, { 'a', fmtfield::weekday, fmtkind::weekdayabbr, 3, 3 },
+	{ 'j', fmtfield::yearday, fmtkind::yearday, 3, 3 }, { 'e', fmtfield::day, fmtkind::spaced, 2, 2 }, { 'I', fmtfield::hour, fmtkind::hour12, 2, 2 },
+	{ 'p', fmtfield::ampm, fmtkind::ampm, 2, 2 }, { 'z', fmtfield::utcoffset, fmtkind::utcoffset, 5, 5 }, { 'E', fmtfield::epoch, fmtkind::epoch, 13, 1 } };
 
-	//should we do a heap allocation to store the string? might be faster....
-	//char digits[maxcount];
+//Kinds whose output length depends on the value
+constexpr bool variableoutput(fmtkind kind) { return kind == fmtkind::monthname || kind == fmtkind::epoch; }
 
-	//Is this faster? I don't like this... Need to do a speed comparison.
-	try {
-		const std::string tstring = pad0right(std::string(s_ptr, count), maxcount);
-		temp = std::stoi(tstring);
+//FORMAT_SPECS index + 1 by symbol, 0 for characters that aren't specifiers
+struct fmtspecindex
+{
+	unsigned char index[128] = {};
+	constexpr fmtspecindex()
+	{
+		for (int i = 0; i < int(sizeof(FORMAT_SPECS) / sizeof(FORMAT_SPECS[0])); ++i)
+			index[int(FORMAT_SPECS[i].symbol)] = (unsigned char)(i + 1);
 	}
-	catch (std::exception&)
+};
+constexpr fmtspecindex FORMAT_SPEC_INDEX;
+
+//Looks up the specifier after a '%' and advances format past it. False, leaving format alone, if it isn't one.
+constexpr bool findspec(const char*& format, const char* fend, fmtspec& spec)
+{
+	if (format >= fend)
+		return false;
+	const char sym = *format;
+	//%<n>f, a fraction of n digits
+	if (sym >= '1' && sym <= '9' && fend - format > 1 && format[1] == 'f')
 	{
+		format += 2;
+		spec = { 'f', fmtfield::nano, sym == '9' ? fmtkind::fraction : fmtkind::scaled, (unsigned char)(sym - '0'), 1 };
+		return true;
+	}
+	const int index = (unsigned char)sym < 128 ? FORMAT_SPEC_INDEX.index[(unsigned char)sym] : 0;
+	if (!index)
+		return false;
+	spec = FORMAT_SPECS[index - 1];
+	++format;
+	return true;
+}
+
+//One step of a compiled format: a field or a run of literal characters
+struct fmtop
+{
+	fmtfield field;
+	unsigned char width;    //most characters in the field, or characters in the literal run
+	unsigned char minwidth; //fewest characters accepted, equal to width for fixed width kinds
+	unsigned char literal;  //index of the literal run in compiled_format's literal buffer
+	unsigned short offset;  //byte offset from the start of the string, valid while the format is fixed width
+	fmtkind kind;
+};
+
+//A format string scanned once up front. Parsing with it skips the per-call specifier lookups,
+//so the hot path is just the field loads and literal compares listed in the op table.
+//Everything here is constexpr, so a compiled_format can also be built at compile time and handed to timestamp::parse<>.
+class compiled_format
+{
+public:
+	static const size_t MAX_OPS = 32;
+	static const size_t MAX_LITERALS = 64;
+	//Longest output any valid format can produce
+	static const size_t MAX_OUTPUT = MAX_LITERALS + MAX_OPS * 13;
+
+private:
+	fmtop ops[MAX_OPS] = {};
+	char literals[MAX_LITERALS] = {};
+	unsigned char opcount = 0;
+	unsigned char litcount = 0;
+	unsigned short minlength = 0;
+	bool fixedwidth = true;
+	//Not next to minlength, or the compiler updates both with one wide load that can't forward from addliteral's stores
+	unsigned short maxlen = 0;
+	bool fixedoutput = true;
+	bool simple = true;
+	bool valid = false;
+
+	constexpr bool addliteral(char c);
+	constexpr bool addfield(const fmtspec& spec);
+
+public:
+	constexpr compiled_format() = default;
+	explicit constexpr compiled_format(const char* format, size_t flen = 0);
+	explicit constexpr compiled_format(std::string_view format) : compiled_format(format.data(), format.size()) {}
+	explicit compiled_format(const std::string& format) : compiled_format(format.c_str(), format.size()) {}
+
+	//False if the format had an unknown specifier or didn't fit in the op table
+	constexpr bool isvalid() const { return valid; }
+	//True if every op starts at a fixed offset, i.e. a variable width fraction can only be the last field
+	constexpr bool isfixedwidth() const { return fixedwidth; }
+	//True if formatting always writes maxlength() characters, i.e. there's no %B or %E
+	constexpr bool isfixedoutput() const { return fixedoutput; }
+	//True if every field is digits or a fraction, the kinds the parsers handle inline
+	constexpr bool issimple() const { return simple; }
+	//Shortest string that can match. For fixed width formats this is the exact length.
+	constexpr size_t length() const { return minlength; }
+	//Longest string this format can produce or match
+	constexpr size_t maxlength() const { return maxlen; }
+
+	constexpr const fmtop* begin() const { return ops; }
+	constexpr const fmtop* end() const { return ops + opcount; }
+	constexpr size_t size() const { return opcount; }
+	constexpr const fmtop& operator[](size_t i) const { return ops[i]; }
+	constexpr const char* literal(const fmtop& op) const { return literals + op.literal; }
+};
+
+constexpr bool compiled_format::addliteral(char c)
+{
+	if (litcount >= MAX_LITERALS)
 		return false;
+
+	//Extend the previous literal run if there is one
+	if (!opcount || ops[opcount - 1].field != fmtfield::literal)
+	{
+		if (opcount >= MAX_OPS)
+			return false;
+		if (opcount && ops[opcount - 1].minwidth != ops[opcount - 1].width)
+			fixedwidth = false;
+		ops[opcount++] = { fmtfield::literal, 0, 0, litcount, minlength, fmtkind::literal };
 	}
+	fmtop& op = ops[opcount - 1];
+	++op.width;
+	++op.minwidth;
+	literals[litcount++] = c;
+	++minlength;
+	++maxlen;
+	return true;
+}
 
-	if (temp < paramlow || temp > paramhigh)
+constexpr bool compiled_format::addfield(const fmtspec& spec)
+{
+	if (opcount >= MAX_OPS)
 		return false;
-	param = temp;
-	*start += count; //advance the pointer
+
+	if (opcount && ops[opcount - 1].minwidth != ops[opcount - 1].width)
+		fixedwidth = false;
+	if (variableoutput(spec.kind))
+		fixedoutput = false;
+	if (spec.kind != fmtkind::digits && spec.kind != fmtkind::fraction)
+		simple = false;
+
+	ops[opcount++] = { spec.field, spec.width, spec.minwidth, 0, minlength, spec.kind };
+	minlength += spec.minwidth;
+	maxlen += spec.width;
 	return true;
 }
 
-inline constexpr int lowIndex(const char* s, const char lowchar)
+//Specifiers are listed in FORMAT_SPECS. Use %% for a literal '%'.
+constexpr compiled_format::compiled_format(const char* format, size_t flen)
 {
-	int i = 0;
-	while (*s && *s != lowchar)
+	if (!format)
+		return;
+	if (!flen)
+		while (format[flen])
+			++flen;
+
+	const char* fend = format + flen;
+	while (format < fend)
 	{
-		++s;
-		++i;
+		if (*format != '%')
+		{
+			if (!addliteral(*format++))
+				return;
+			continue;
+		}
+
+		if (++format >= fend)
+			return;
+		if (*format == '%')
+		{
+			++format;
+			if (!addliteral('%'))
+				return;
+			continue;
+		}
+
+		fmtspec spec = {};
+		if (!findspec(format, fend, spec) || !addfield(spec))
+			return;
 	}
-	return i;
+	valid = true;
 }
 
-//Uses lookup table, only works for values under 10^10
-inline int smallatoi(const char* const snum, int slen)
+//CIVIL DATES. Proleptic Gregorian calendar math with no loops or tables, valid for any year.
+//Days are counted from 1970-01-01. Based on Howard Hinnant's days_from_civil/civil_from_days.
+struct civildate
 {
-	if (slen > 10)
-		return 0;
-	static constexpr int powten[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
-	int ret = 0;
+	long long year;
+	int month;
+	int day;
+};
 
-	for (int i = 0; i < slen; ++i)
+//Broken down calendar time. month and day are 1 based.
+struct civiltime
+{
+	int year;
+	int month;
+	int day;
+	int hour;
+	int minute;
+	int second;
+	int nanosecond;
+};
+
+//Floor division for positive b, so times before 1970 split into the right day
+constexpr long long floordiv(long long a, long long b) { return a / b - (a % b < 0); }
+
+constexpr long long days_from_civil(long long y, int m, int d)
+{
+	//Count years from March so the leap day is the last day of the year
+	y -= m <= 2;
+	const long long era = floordiv(y, 400);
+	const long long yoe = y - era * 400;
+	const long long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	const long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+constexpr civildate civil_from_days(long long days)
+{
+	days += 719468;
+	const long long era = floordiv(days, 146097);
+	const long long doe = days - era * 146097;
+	const long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	const long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	const long long mp = (5 * doy + 2) / 153;
+	const int d = int(doy - (153 * mp + 2) / 5 + 1);
+	const int m = int(mp < 10 ? mp + 3 : mp - 9);
+	return { yoe + era * 400 + (m <= 2), m, d };
+}
+
+//0 is Sunday. 1970-01-01 was a Thursday.
+constexpr int weekday_from_days(long long days) { return int(days + 4 - floordiv(days + 4, 7) * 7); }
+
+constexpr int days_in_month(long long y, int m)
+{
+	return m == 2 ? 28 + (y % 4 == 0 && (y % 100 != 0 || y % 400 == 0)) : 30 + ((m + (m > 7)) & 1);
+}
+
+//TIME ZONES. A tzone is a cheap handle to an immutable table of UTC offset periods, loaded once per zone from a
+//TZif file (/usr/share/zoneinfo, $TZDIR or an embedded copy) and shared by every handle. Lookups take no locks
+//and write nothing shared: the period this thread used last is checked first, and only a miss does a binary search.
+class tzone
+{
+	struct period
 	{
-		ret += (snum[i] - '0') * powten[slen - i - 1];
+		long long start; //UTC seconds since the epoch at which offset takes effect
+		int offset;      //seconds east of UTC
+	};
+
+	struct zonedata
+	{
+		std::string name;
+		std::vector<period> periods; //sorted by start, the first one starts at LLONG_MIN
+		bool system = false;         //no table available, ask the C runtime instead
+	};
+
+	//The zone and period this thread looked up last. Only ever compared and bounds checked, so a stale one is just a miss.
+	struct lookuphint
+	{
+		const zonedata* zone = nullptr;
+		size_t index = 0;
+	};
+	static lookuphint& threadhint()
+	{
+		thread_local lookuphint hint;
+		return hint;
 	}
-	return ret;
+
+	std::shared_ptr<const zonedata> data;
+
+	explicit tzone(std::shared_ptr<const zonedata> d) : data(std::move(d)) {}
+
+	static std::shared_ptr<zonedata> makefixed(const std::string& name, int offset);
+	static bool parseposix(const char*& s, const char* end, std::vector<period>& periods, long long from);
+	static int systemoffset(long long utcsec);
+
+public:
+	//Years past the last transition in a TZif file are filled in from its POSIX rule up to this year
+	static const int RULE_HORIZON = 2200;
+
+	tzone() : tzone(utc()) {}
+
+	static const tzone& utc();
+	//Fixed offset in seconds east of UTC
+	static tzone fixed(int utcoffset);
+	//The machine's zone: $TZ, then /etc/localtime, then the C runtime on systems without zoneinfo
+	static const tzone& local();
+	//IANA name, e.g. "America/New_York". Loaded on first use and cached. Returns false if the zone can't be found.
+	static bool locate(std::string_view name, tzone& zone);
+	//Builds a zone from TZif data, e.g. an embedded copy of the database
+	static bool fromtzif(const void* tzif, size_t len, std::string_view name, tzone& zone);
+	//Builds a zone from a POSIX TZ string like "EST5EDT,M3.2.0,M11.1.0"
+	static bool fromposix(std::string_view rule, tzone& zone);
+
+	const std::string& name() const { return data->name; }
+
+	//Offset in seconds east of UTC in effect at a UTC time
+	int offsetat(long long utcsec) const;
+	//Offset for a local wall clock time. Ambiguous times resolve to the earlier instant, and times
+	//skipped by a transition use the offset from before it, which moves them forward.
+	int offsetfromlocal(long long localsec) const;
+
+	bool operator==(const tzone& rhs) const { return data == rhs.data; }
+	bool operator!=(const tzone& rhs) const { return data != rhs.data; }
+};
+
+inline std::shared_ptr<tzone::zonedata> tzone::makefixed(const std::string& name, int offset)
+{
+	auto z = std::make_shared<zonedata>();
+	z->name = name;
+	z->periods.push_back({ LLONG_MIN, offset });
+	return z;
+}
+
+inline const tzone& tzone::utc()
+{
+	static const tzone zone(makefixed("UTC", 0));
+	return zone;
+}
+
+inline tzone tzone::fixed(int utcoffset)
+{
+	if (!utcoffset)
+		return utc();
+	char name[16];
+	const int mins = std::abs(utcoffset) / S_IN_MINUTE;
+	snprintf(name, sizeof(name), "UTC%c%02d:%02d", utcoffset < 0 ? '-' : '+', mins / 60, mins % 60);
+	return tzone(makefixed(name, utcoffset));
 }
 
-inline time_t time_to_epoch(const struct tm *ltm, int utcdiff) {
-	const int mon_days[] =
-	{ 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
-	long tyears, tdays, leaps, utc_hrs;
-	int i;
+inline int tzone::systemoffset(long long utcsec)
+{
+	tm t;
+	const time_t trep = time_t(utcsec);
+#ifdef _WIN32
+	localtime_s(&t, &trep);
+#else
+	localtime_r(&trep, &t);
+#endif
+	return int(days_from_civil(t.tm_year + 1900LL, t.tm_mon + 1, t.tm_mday) * S_IN_DAY + t.tm_hour * S_IN_HOUR + t.tm_min * S_IN_MINUTE + t.tm_sec - utcsec);
+}
 
-	tyears = ltm->tm_year - 70; // tm->tm_year is from 1900.
-	leaps = (tyears + 2) / 4; // no of next two lines until year 2100.
-	//i = (ltm->tm_year  100) / 100;
-	//leaps -= ( (i/4)*3 + i%4 );
-	tdays = 0;
-	for (i = 0; i < ltm->tm_mon; i++) tdays += mon_days[i];
+inline int tzone::offsetat(long long utcsec) const
+{
+	const zonedata& z = *data;
+	if (z.system)
+		return systemoffset(utcsec);
 
-	tdays += ltm->tm_mday - 1; // days of month passed.
-	tdays = tdays + (tyears * 365) + leaps;
+	const std::vector<period>& p = z.periods;
+	if (p.size() == 1)
+		return p[0].offset;
+	lookuphint& hint = threadhint();
+	size_t i = hint.index;
+	if (hint.zone == &z && i < p.size() && p[i].start <= utcsec && (i + 1 == p.size() || utcsec < p[i + 1].start))
+		return p[i].offset;
 
-	utc_hrs = ltm->tm_hour + utcdiff; // for your time zone.
-	return (tdays * 86400) + (utc_hrs * 3600) + (ltm->tm_min * 60) + ltm->tm_sec;
+	i = size_t(std::upper_bound(p.begin(), p.end(), utcsec, [](long long u, const period& q) { return u < q.start; }) - p.begin()) - 1;
+	hint.zone = &z;
+	hint.index = i;
+	return p[i].offset;
 }
 
-inline bool timestamp::fromstring(const char* tstamp, const char* format, size_t tlen, size_t flen)
+inline int tzone::offsetfromlocal(long long localsec) const
 {
-	if (!tstamp || !format)
+	if (!data->system && data->periods.size() == 1)
+		return data->periods[0].offset;
+
+	//Offsets either side of the wall clock time. No zone changes twice within a couple of days.
+	const int before = offsetat(localsec - S_IN_DAY);
+	const int after = offsetat(localsec + S_IN_DAY);
+	//The larger offset maps to the earlier instant, so try it first
+	const int high = std::max(before, after);
+	const int low = std::min(before, after);
+	if (offsetat(localsec - high) == high)
+		return high;
+	if (offsetat(localsec - low) == low)
+		return low;
+	//Skipped by a transition, neither offset maps back to itself
+	return before;
+}
+
+//Reads the POSIX TZ rule at s and appends its transitions after from. See tzset(3) for the syntax.
+inline bool tzone::parseposix(const char*& s, const char* end, std::vector<period>& periods, long long from)
+{
+	auto name = [&]() {
+		if (s < end && *s == '<')
+		{
+			while (s < end && *s != '>')
+				++s;
+			return s < end && *s++ == '>';
+		}
+		const char* start = s;
+		while (s < end && isalpha((unsigned char)*s))
+			++s;
+		return s - start >= 3;
+	};
+	//[+-]hh[:mm[:ss]], returned in seconds
+	auto hms = [&](long long& out) {
+		int sign = 1;
+		if (s < end && (*s == '+' || *s == '-'))
+			sign = *s++ == '-' ? -1 : 1;
+		long long parts[3] = { 0, 0, 0 };
+		for (int n = 0; n < 3; ++n)
+		{
+			if (n && (s >= end || *s != ':'))
+				break;
+			if (n)
+				++s;
+			if (s >= end || !isdigit((unsigned char)*s))
+				return false;
+			while (s < end && isdigit((unsigned char)*s))
+				parts[n] = parts[n] * 10 + (*s++ - '0');
+		}
+		out = sign * (parts[0] * S_IN_HOUR + parts[1] * S_IN_MINUTE + parts[2]);
+		return true;
+	};
+	auto number = [&](int& out) {
+		if (s >= end || !isdigit((unsigned char)*s))
+			return false;
+		out = 0;
+		while (s < end && isdigit((unsigned char)*s))
+			out = out * 10 + (*s++ - '0');
+		return true;
+	};
+
+	struct rule
+	{
+		char kind = 'M';
+		int month = 0, week = 0, weekday = 0, day = 0;
+		long long time = 2 * S_IN_HOUR;
+	};
+	auto daterule = [&](rule& r) {
+		if (s >= end || *s++ != ',')
+			return false;
+		bool ok;
+		if (s < end && *s == 'M')
+		{
+			++s;
+			ok = number(r.month) && s < end && *s++ == '.' && number(r.week) && s < end && *s++ == '.' && number(r.weekday);
+		}
+		else
+		{
+			r.kind = (s < end && *s == 'J') ? *s++ : 'n';
+			ok = number(r.day);
+		}
+		if (ok && s < end && *s == '/')
+		{
+			++s;
+			ok = hms(r.time);
+		}
+		return ok;
+	};
+	//Local time of a rule's transition in a year, in seconds since the epoch
+	auto ruletime = [](const rule& r, long long year) {
+		long long day;
+		if (r.kind == 'M')
+		{
+			const long long first = days_from_civil(year, r.month, 1);
+			const long long next = r.month == 12 ? days_from_civil(year + 1, 1, 1) : days_from_civil(year, r.month + 1, 1);
+			day = first + (r.weekday - weekday_from_days(first) + 7) % 7 + (r.week - 1) * 7;
+			while (day >= next)
+				day -= 7;
+		}
+		else if (r.kind == 'J')
+		{
+			//1 to 365, Feb 29th is never counted
+			const bool leap = days_from_civil(year, 3, 1) - days_from_civil(year, 2, 28) == 2;
+			day = days_from_civil(year, 1, 1) + r.day - 1 + (leap && r.day >= 60);
+		}
+		else
+			day = days_from_civil(year, 1, 1) + r.day;
+		return day * S_IN_DAY + r.time;
+	};
+
+	long long stdoff;
+	if (!name() || !hms(stdoff))
 		return false;
+	stdoff = -stdoff; //POSIX offsets are west of UTC
 
-	if (!tlen)
-		tlen = strlen(tstamp);
-	if (!flen)
-		flen = strlen(format);
+	//No DST. A TZif table is already correct up to its end, so there is nothing to add.
+	if (s >= end)
+	{
+		if (periods.empty())
+			periods.push_back({ LLONG_MIN, int(stdoff) });
+		return true;
+	}
 
-	const char* tend = tstamp + tlen;
-	const char* fend = format + flen;
+	if (!name())
+		return false;
+	long long dstoff = stdoff + S_IN_HOUR;
+	if (s < end && *s != ',')
+	{
+		if (!hms(dstoff))
+			return false;
+		dstoff = -dstoff;
+	}
 
-	tm t = { 0 };
-	//t.tm_isdst = 0;
-	int ms = 0;
-	int ns = 0;
-	//I'd rather only go through one string at a time if possible
-	//Format string is used to get positions of different info in the time string
-	static constexpr char symbols[] = "YMdHmsxf";
-	constexpr int lowadjust = lowIndex(symbols, 'x');
-	static constexpr char symlen[] = "42222239";
+	//Rules default to the US ones, as glibc does
+	rule start, finish;
+	start.month = 3, start.week = 2;
+	finish.month = 11, finish.week = 1;
+	if (s < end && *s == ',' && (!daterule(start) || !daterule(finish)))
+		return false;
 
-	int * const tmpos[] = { &(t.tm_year), &(t.tm_mon), &(t.tm_mday), &(t.tm_hour), &(t.tm_min), &(t.tm_sec), &ms, &ns };
-	//Buffer to use for int conversions:
-	char chBuf[10];
+	if (periods.empty())
+		periods.push_back({ LLONG_MIN, int(stdoff) });
+	const long long firstyear = civil_from_days(floordiv(std::max(from, -S_IN_DAY * 3650LL), S_IN_DAY)).year;
+	for (long long year = firstyear; year <= RULE_HORIZON; ++year)
+	{
+		long long on = ruletime(start, year) - stdoff;
+		long long off = ruletime(finish, year) - dstoff;
+		period first = { on, int(dstoff) };
+		period second = { off, int(stdoff) };
+		//Southern hemisphere zones leave DST early in the year
+		if (off < on)
+			std::swap(first, second);
+		for (const period& p : { first, second })
+			if (p.start > from && p.start > periods.back().start && p.offset != periods.back().offset)
+				periods.push_back(p);
+	}
+	return true;
+}
 
-	while (tstamp < tend && format < fend)
+inline bool tzone::fromposix(std::string_view rule, tzone& zone)
+{
+	auto z = std::make_shared<zonedata>();
+	z->name = std::string(rule);
+	const char* s = rule.data();
+	if (!parseposix(s, s + rule.size(), z->periods, LLONG_MIN) || s != rule.data() + rule.size())
+		return false;
+	zone = tzone(std::move(z));
+	return true;
+}
+
+//Parses RFC 8536 TZif data. Version 2+ files use the 64 bit block and the POSIX footer for years past the table.
+inline bool tzone::fromtzif(const void* tzif, size_t len, std::string_view name, tzone& zone)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(tzif);
+	const unsigned char* const end = p + len;
+	auto be = [](const unsigned char* b, int bytes) {
+		unsigned long long v = 0;
+		for (int i = 0; i < bytes; ++i)
+			v = (v << 8) | b[i];
+		//Sign extend 32 bit values
+		return bytes == 4 ? (long long)(int)(unsigned)v : (long long)v;
+	};
+
+	if (!p || len < 44 || memcmp(p, "TZif", 4))
+		return false;
+	const bool v2 = p[4] >= '2';
+
+	int timesize = 4;
+	for (int pass = 0; pass < (v2 ? 2 : 1); ++pass)
 	{
+		if (end - p < 44 || memcmp(p, "TZif", 4))
+			return false;
+		const long long isutcnt = be(p + 20, 4), isstdcnt = be(p + 24, 4), leapcnt = be(p + 28, 4);
+		const long long timecnt = be(p + 32, 4), typecnt = be(p + 36, 4), charcnt = be(p + 40, 4);
+		if (timecnt < 0 || typecnt <= 0 || charcnt < 0 || leapcnt < 0 || isstdcnt < 0 || isutcnt < 0)
+			return false;
+		const long long blocklen = timecnt * timesize + timecnt + typecnt * 6 + charcnt + leapcnt * (timesize + 4) + isstdcnt + isutcnt;
+		if (end - (p + 44) < blocklen)
+			return false;
 
-		if (*format == '%' && ++format < fend)
+		if (v2 && pass == 0)
 		{
-			//const char* chPos = strchr(symbols, *format);
-			int index = 0;
-			for (; index < sizeof(symbols) / sizeof(char); ++index)
-				if (symbols[index] == *format)
-					break;
+			//Skip the 32 bit block
+			p += 44 + blocklen;
+			timesize = 8;
+			continue;
+		}
 
-			if (index < sizeof(symbols) / sizeof(char))
-			{
-				//int fIndex = int(chPos - symbols);
-				int paramlen = symlen[index] - '0';
-				//Checks
-				if (tstamp + paramlen > tend)
-					return false;
+		const unsigned char* times = p + 44;
+		const unsigned char* idx = times + timecnt * timesize;
+		const unsigned char* types = idx + timecnt;
+		auto typeoffset = [&](long long t) { return int(be(types + t * 6, 4)); };
 
-				//For year, month, day, hour, and second, the number lengths are fixed. For ms and ns, the lengths are variable. Two sections to deal with this.
-				if (index < lowadjust)
-				{
-					for (int i = 0; i < paramlen; ++i)
-					{
-						if (*tstamp - '0' > 9)
-							return false;
-						chBuf[i] = *tstamp++;
-					}
-				}
-				else
-				{
-					int i = 0;
-					while (i < paramlen)
-					{
-						if (tstamp[i] - '0' > 9)
-							break;
-						chBuf[i] = *tstamp++;
-						++i;
-					}
-					while (i < paramlen)
-						chBuf[i++] = '0';
-				}
-				
-				chBuf[paramlen] = '\0';
-				//*tmpos[fIndex] = std::stoi(chBuf);
-				*tmpos[index] = smallatoi(chBuf, paramlen);
-			}
+		auto z = std::make_shared<zonedata>();
+		z->name = std::string(name);
+		//Type 0 covers everything before the first transition
+		z->periods.push_back({ LLONG_MIN, typeoffset(0) });
+		for (long long i = 0; i < timecnt; ++i)
+		{
+			if (idx[i] >= typecnt)
+				return false;
+			const period next = { be(times + i * timesize, timesize), typeoffset(idx[i]) };
+			if (next.offset != z->periods.back().offset)
+				z->periods.push_back(next);
 		}
-		else
-			++tstamp;
-		++format;
+		p += 44 + blocklen;
+
+		//Footer: \n<POSIX TZ>\n
+		if (v2 && p < end && *p == '\n')
+		{
+			const char* s = reinterpret_cast<const char*>(p + 1);
+			const char* fend = s;
+			while (fend < reinterpret_cast<const char*>(end) && *fend != '\n')
+				++fend;
+			const long long last = timecnt ? be(times + (timecnt - 1) * timesize, timesize) : LLONG_MIN;
+			if (fend > s && !parseposix(s, fend, z->periods, last))
+				return false;
+		}
+		zone = tzone(std::move(z));
+		return true;
 	}
+	return false;
+}
 
-	t.tm_year -= 1900;
-	--t.tm_mon;
+inline bool tzone::locate(std::string_view name, tzone& zone)
+{
+	if (name.empty() || name == "UTC" || name == "Etc/UTC")
+	{
+		zone = utc();
+		return true;
+	}
+	//Zones are never unloaded, the lock is only taken here and never during lookups
+	static std::mutex lock;
+	static std::map<std::string, tzone, std::less<>> loaded;
+	std::lock_guard<std::mutex> guard(lock);
+	auto found = loaded.find(name);
+	if (found != loaded.end())
+	{
+		zone = found->second;
+		return true;
+	}
 
-	//Bounds checking
-	if (t.tm_hour < 0 || t.tm_hour > 23)
-		return false;
-	if (t.tm_mday < 1 || t.tm_mday > 31)
-		return false;
-	if (t.tm_min < 0 || t.tm_min > 59)
+	if (name.find("..") != std::string_view::npos)
 		return false;
-	if (t.tm_mon < 0 || t.tm_mon > 11)
+	const char* dir = getenv("TZDIR");
+	std::string path = std::string(dir && *dir ? dir : "/usr/share/zoneinfo") + '/' + std::string(name);
+	if (name.front() == '/')
+		path = std::string(name);
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
 		return false;
-	if (t.tm_sec < 0 || t.tm_sec > 59)
+	const std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (!fromtzif(bytes.data(), bytes.size(), name, zone))
 		return false;
-	
-	long tz;
-	long dstoff;
-	_get_timezone(&tz);
-	_get_dstbias(&dstoff);
-	t.tm_sec += tz + dstoff;
-	//time_t tbase = std::mktime(&t);
-	time_t tbase = time_to_epoch(&t, 0);
-	if (ns)
-		time = std::chrono::system_clock::from_time_t(tbase) + durcast<std::chrono::system_clock::duration>(t_nsec(ns));
-	else
-		time = std::chrono::system_clock::from_time_t(tbase) + durcast<std::chrono::system_clock::duration>(t_msec(ms));
-
+	loaded.emplace(std::string(name), zone);
 	return true;
 }
 
+inline const tzone& tzone::local()
+{
+	static const tzone zone = [] {
+		tzone ret;
+		const char* tz = getenv("TZ");
+		if (tz && *tz)
+		{
+			if (*tz == ':')
+				++tz;
+			if (locate(tz, ret) || fromposix(tz, ret))
+				return ret;
+		}
+#ifndef _WIN32
+		if (locate("/etc/localtime", ret))
+			return ret;
+#endif
+		auto z = std::make_shared<zonedata>();
+		z->name = "system";
+		z->system = true;
+		return tzone(std::move(z));
+	}();
+	return zone;
+}
+
+//Why a parse failed. The field_errc reasons come first, in the same order, so they convert directly.
+enum class parse_errc : unsigned char { ok, too_short, not_digit, out_of_range, unknown_name, literal_mismatch, bad_format };
+const int PARSE_ERRC_COUNT = int(parse_errc::bad_format) + 1;
 
-//Uses input format to transform internal time_point into a formatted std::string. Usable format characters: %Y, %M, %d, %H, %m, %s, %x, %f
-inline std::string timestamp::tostdstring(const std::string& format)
+//What timestamp::tryparse found: 8 bytes, no allocation
+struct parse_result
 {
-	std::string ret;
-	ret.reserve(format.size());
-	auto split = splitstring(format, '%');
-	if (split.size() < 2)
-		return ret;
+	parse_errc ec = parse_errc::ok;
+	fmtfield field = fmtfield::literal; //the field at fault, literal for literal runs and bad formats
+	std::uint32_t offset = 0;           //byte offset into the string where it went wrong
+	explicit operator bool() const { return ec == parse_errc::ok; }
+};
 
-	tm t;
-	time_t trep = std::chrono::system_clock::to_time_t(time);
-	localtime_s(&t, &trep);
-	auto tfrac = time.time_since_epoch() - t_sec(trep); //removes seconds from the time since epoch, so we only have the nanoseconds
+//What ISO 8601 parsing does with a leap second, hh:mm:60. roll reads it as the first second of the next minute, the way
+//from_civil treats any second past 59. clamp holds it at the last nanosecond of :59, so it still sorts before the next minute.
+enum class leap_policy : unsigned char { reject, clamp, roll };
 
-	ret = split.front();
+//Failure counts for a batch of parses, by field and by reason, and the first failure in full
+struct parse_stats
+{
+	std::uint64_t parsed = 0;
+	std::uint64_t failed = 0;
+	std::uint64_t fields[FMT_FIELDCOUNT + 1] = {}; //indexed by fmtfield, literal runs last
+	std::uint64_t errors[PARSE_ERRC_COUNT] = {};  //indexed by parse_errc
+	size_t firstindex = SIZE_MAX;
+	parse_result first;
 
-	for (size_t n = 1; n < split.size(); ++n)
+	void add(size_t index, const parse_result& r)
 	{
-		if (!split[n].size())
+		if (r)
 		{
-			ret.push_back('%');
-			continue;
+			++parsed;
+			return;
 		}
-
-		switch (split[n].front())
+		++failed;
+		++fields[int(r.field)];
+		++errors[int(r.ec)];
+		if (index < firstindex)
 		{
-		case 'Y':
-			ret += std::to_string(t.tm_year + 1900);
-			break;
-		case 'M':
-			ret += pad0left(std::to_string(t.tm_mon + 1), 2);
-			break;
-		case 'd':
-			ret += pad0left(std::to_string(t.tm_mday), 2);
-			break;
-		case 'H':
-			ret += pad0left(std::to_string(t.tm_hour), 2);
-			break;
-		case 'm':
-			ret += pad0left(std::to_string(t.tm_min), 2);
-			break;
-		case 's':
-			ret += pad0left(std::to_string(t.tm_sec), 2);
-			break;
-		case 'x':
-			ret += pad0left(std::to_string(durcast<std::chrono::milliseconds>(tfrac).count()), 3);
-			break;
-		case 'f':
-			ret += pad0left(std::to_string(durcast<std::chrono::nanoseconds>(tfrac).count()), 9);
-			break;
+			firstindex = index;
+			first = r;
 		}
-
-		ret += split[n].substr(1, split[n].size() - 1);
 	}
+};
+
+//TIMESTAMP TYPE
+class timestamp
+{
+	using t_nsec = std::chrono::nanoseconds;
+	using t_sec = std::chrono::seconds;
+	using t_msec = std::chrono::milliseconds;
+	using t_sysclock = std::chrono::system_clock;
+	using t_hiresclock = std::chrono::high_resolution_clock;
+	template<class T> using t_timepoint = std::chrono::time_point<T>;
+
+	//This is just a wrapper around a couple of chrono classes.
+	t_timepoint<t_sysclock> time;
+	bool hastime = false;
+
+	//private functions
+	template<class TT, class FT> static constexpr TT durcast(FT rhs) { return std::chrono::duration_cast<TT>(rhs); }
+	friend class simd_parser;
+	friend class timestamp_formatter;
+	bool assignfields(const int* values);
+	bool assignfields(const int* values, int utcoffset);
+	bool assignfields(const int* values, const tzone& zone);
+	bool assignresolved(const int* values, int utcoffset, const tzone* zone);
+	bool assignresolved(const int* values);
+	bool fromstringextended(const char* tstamp, const char* tend, const char* format, const char* fend);
+	void civilfields(int* values, int utcoffset) const;
+	int zonefields(int* values, const tzone& zone) const;
+	int localfields(int* values) const;
+	static bool parsefields(const char* tstamp, size_t tlen, const compiled_format& format, int* values);
+	static parse_result checkfields(const char* tstamp, size_t tlen, const compiled_format& format, int* values);
+
+	template<const compiled_format& F, size_t I> static bool parseop(const char* base, const char*& s, const char* tend, int* values);
+	template<const compiled_format& F, size_t... I> static bool parseops(const char* s, const char* tend, int* values, std::index_sequence<I...>);
+	template<const compiled_format& F, size_t I> static void formatop(char* out, const int* values);
+	template<const compiled_format& F, size_t... I> static void formatops(char* out, const int* values, std::index_sequence<I...>);
+
+public:
+	constexpr timestamp(const t_timepoint<t_sysclock>& t, bool ht) : time(t), hastime(ht) {}
+	constexpr timestamp() : time(t_sec(0)), hastime(false) {};
+	constexpr timestamp(const timestamp& rhs) : time(rhs.time), hastime(rhs.hastime) {}
+	constexpr timestamp& operator=(const timestamp& rhs) = default;
+
+	static timestamp now() { return timestamp(t_sysclock::now(), true); }
+	constexpr t_timepoint<t_sysclock> astimepoint() const { return time; }
+	constexpr bool isvalid() const { return hastime; }
+
+	timediff operator-(const timestamp& rhs) const { return timediff((time.time_since_epoch() - rhs.time.time_since_epoch())/* + (nano - rhs.nano)*/); }
+	constexpr timestamp operator+(const timediff& rhs) const { return timestamp(time + rhs.data().first + durcast<std::chrono::system_clock::duration>(rhs.data().second), true); }
+	constexpr timestamp operator-(const timediff& rhs) const { return timestamp(time - rhs.data().first - durcast<std::chrono::system_clock::duration>(rhs.data().second), true); }
+
+	constexpr timestamp& operator+=(const timediff& rhs) { return *this = *this + rhs; }
+	constexpr timestamp& operator-=(const timediff& rhs) { return *this = *this - rhs; }
+
+	//Calendar conversions. utcoffset is in seconds east of UTC, so 0 means the fields are UTC.
+	//from_civil doesn't range check, out of range fields roll over into the next unit.
+	static constexpr timestamp from_civil(const civiltime& c, int utcoffset = 0);
+	constexpr civiltime to_civil(int utcoffset = 0) const;
+
+	bool fromstring(const char* tstamp, const char* format, size_t tlen, size_t flen);
+	bool fromstring(const std::string& tstamp, const std::string& format) { return fromstring(tstamp.c_str(), format.c_str(), tstamp.size(), format.size()); }
+	bool fromstring(const char* tstamp, size_t tlen, const compiled_format& format);
+	bool fromstring(std::string_view tstamp, const compiled_format& format) { return fromstring(tstamp.data(), tstamp.size(), format); }
+	std::string tostdstring(const std::string& format);
+	size_t format_to(char* out, size_t cap, const compiled_format& format) const;
+	template<class OutputIt> OutputIt format_to(OutputIt out, const compiled_format& format) const;
+
+	//Fixed UTC offset versions (seconds east of UTC). These never touch tm, mktime or localtime.
+	bool fromstring(const char* tstamp, size_t tlen, const compiled_format& format, int utcoffset);
+	bool fromstring(std::string_view tstamp, const compiled_format& format, int utcoffset) { return fromstring(tstamp.data(), tstamp.size(), format, utcoffset); }
+	std::string tostdstring(const std::string& format, int utcoffset) const;
+	size_t format_to(char* out, size_t cap, const compiled_format& format, int utcoffset) const;
+	template<class OutputIt> OutputIt format_to(OutputIt out, const compiled_format& format, int utcoffset) const;
+
+	//Time zone versions. The overloads without a zone use tzone::local().
+	bool fromstring(const char* tstamp, size_t tlen, const compiled_format& format, const tzone& zone);
+	bool fromstring(std::string_view tstamp, const compiled_format& format, const tzone& zone) { return fromstring(tstamp.data(), tstamp.size(), format, zone); }
+	std::string tostdstring(const std::string& format, const tzone& zone) const;
+	size_t format_to(char* out, size_t cap, const compiled_format& format, const tzone& zone) const;
+	template<class OutputIt> OutputIt format_to(OutputIt out, const compiled_format& format, const tzone& zone) const;
+
+	//fromstring, but saying which field failed, why, and at what byte offset. Fails on the same strings.
+	//The bool versions don't pay for the bookkeeping, so use these where the reason matters.
+	parse_result tryparse(std::string_view tstamp, const compiled_format& format);
+	parse_result tryparse(std::string_view tstamp, const compiled_format& format, int utcoffset);
+	parse_result tryparse(std::string_view tstamp, const compiled_format& format, const tzone& zone);
+
+	//ISO 8601 extended format, as profiled by RFC 3339: YYYY-MM-DD, then 'T', 't' or ' ', hh:mm:ss, an optional fraction
+	//of any length (read to the nanosecond, the rest dropped), then Z, z or +hh:mm. Strings without an offset are UTC, or
+	//wall clock time in zone. Days are checked against the month. Invalid on failure.
+	static timestamp parse_iso8601(std::string_view tstamp, leap_policy leap = leap_policy::reject);
+	static timestamp parse_iso8601(std::string_view tstamp, const tzone& zone, leap_policy leap = leap_policy::reject);
+	//YYYY-MM-DDThh:mm:ss[.fraction] then Z, or the offset when it isn't 0. digits is the fraction length, 0 to 9,
+	//or -1 for as few as are exact. Returns the length written, 0 if cap is too small or the year isn't 0 to 9999.
+	static const size_t RFC3339_MAX = 35;
+	size_t format_rfc3339(char* out, size_t cap, int digits = -1, int utcoffset = 0) const;
+	std::string format_rfc3339(int digits = -1, int utcoffset = 0) const;
+
+	//Compile time formats. F must be a constexpr compiled_format with static storage duration:
+	//	static constexpr compiled_format LOGFORMAT("%Y/%M/%d %H:%m:%s.%x");
+	//	timestamp t = timestamp::parse<LOGFORMAT>(sv);
+	//Each op is expanded into straight-line code, and fixed width layouts are bounds checked exactly once.
+	template<const compiled_format& F> static timestamp parse(std::string_view tstamp);
+	template<const compiled_format& F> std::string tostdstring() const;
+};
+
+
+inline constexpr int lowIndex(const char* s, const char lowchar)
+{
+	int i = 0;
+	while (*s && *s != lowchar)
+	{
+		++s;
+		++i;
+	}
+	return i;
+}
+
+//Uses lookup table, only works for values under 10^10
+inline int smallatoi(const char* const snum, int slen)
+{
+	if (slen > 10)
+		return 0;
+	static constexpr int powten[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+	int ret = 0;
+
+	for (int i = 0; i < slen; ++i)
+	{
+		ret += (snum[i] - '0') * powten[slen - i - 1];
+	}
+	return ret;
+}
+
+//"00" through "99", so digits can be written two at a time
+constexpr char DIGIT_PAIRS[] =
+	"0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+	"5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+//Writes value as exactly width zero padded digits. Higher digits that don't fit are dropped.
+inline void writedigits(char* out, unsigned value, int width)
+{
+	int i = width;
+	while (i >= 2)
+	{
+		const char* pair = DIGIT_PAIRS + (value % 100) * 2;
+		out[--i] = pair[1];
+		out[--i] = pair[0];
+		value /= 100;
+	}
+	if (i)
+		out[0] = char('0' + value % 10);
+}
+
+//FIELD PARSING
+//Non-throwing readers for the digit fields of a timestamp, shared by every parse path. Like std::from_chars they read
+//from [first, last), only store the value on success, and say where and why they stopped. Widths are at most 9 digits.
+
+enum class field_errc { ok, too_short, not_digit, out_of_range, unknown_name };
+
+struct field_result
+{
+	const char* ptr;  //past the digits on success, otherwise the character at fault (last if the input ran out)
+	field_errc ec;
+	explicit operator bool() const { return ec == field_errc::ok; }
+};
+static_assert(int(field_errc::unknown_name) == int(parse_errc::unknown_name), "field_errc must convert to parse_errc");
+
+//Reads width digits from p without bounds checking, for callers that already have. The digits are checked together,
+//so there's no branch per digit; value is stored even when some weren't digits, and the return says whether all were.
+inline bool readfixed(const char* p, int width, int& value)
+{
+	bool bad = false;
+	int v = 0;
+	for (int i = 0; i < width; ++i)
+	{
+		const unsigned digit = unsigned(p[i] - '0');
+		bad |= digit > 9;
+		v = v * 10 + int(digit);
+	}
+	value = v;
+	return !bad;
+}
+
+//Exactly width digits
+inline field_result parse_fixed(const char* first, const char* last, int width, int& value)
+{
+	assert(width >= 0 && width <= 9);
+	int v;
+	if (last - first >= width && readfixed(first, width, v))
+	{
+		value = v;
+		return { first + width, field_errc::ok };
+	}
+	while (first < last && unsigned(*first - '0') <= 9)
+		++first;
+	return { first, first < last ? field_errc::not_digit : field_errc::too_short };
+}
+
+//As many digits as there are, up to maxwidth, and no fewer than minwidth
+inline field_result parse_digits(const char* first, const char* last, int minwidth, int maxwidth, int& value, int* count = nullptr)
+{
+	assert(minwidth >= 0 && minwidth <= maxwidth && maxwidth <= 9);
+	const int avail = int(std::min<std::ptrdiff_t>(last - first, maxwidth));
+	int v = 0;
+	int n = 0;
+	for (; n < avail; ++n)
+	{
+		const unsigned digit = unsigned(first[n] - '0');
+		if (digit > 9)
+			break;
+		v = v * 10 + int(digit);
+	}
+	if (n < minwidth)
+		return { first + n, first + n < last ? field_errc::not_digit : field_errc::too_short };
+	value = v;
+	if (count)
+		*count = n;
+	return { first + n, field_errc::ok };
+}
+
+//A fraction of up to maxwidth digits, scaled as if right padded with zeros: "5" read as 3 digits is 500
+inline field_result parse_fraction(const char* first, const char* last, int minwidth, int maxwidth, int& value)
+{
+	static constexpr int powten[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+	int n = 0;
+	const field_result r = parse_digits(first, last, minwidth, maxwidth, value, &n);
+	if (r)
+		value *= powten[maxwidth - n];
+	return r;
+}
+
+//parse_digits, then a range check. Out of range values leave ptr at the start of the field.
+inline field_result parse_bounded(const char* first, const char* last, int minwidth, int maxwidth, int low, int high, int& value)
+{
+	int v;
+	const field_result r = parse_digits(first, last, minwidth, maxwidth, v);
+	if (!r)
+		return r;
+	if (v < low || v > high)
+		return { first, field_errc::out_of_range };
+	value = v;
+	return r;
+}
+
+constexpr char MONTH_ABBREVIATIONS[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+//A three letter English month abbreviation, any case, as 1 to 12
+inline field_result parse_monthabbr(const char* first, const char* last, int& value)
+{
+	if (last - first < 3)
+		return { last, field_errc::too_short };
+	const char* m = MONTH_ABBREVIATIONS;
+	for (int month = 1; month <= 12; ++month, m += 3)
+		if ((first[0] | 0x20) == (m[0] | 0x20) && (first[1] | 0x20) == m[1] && (first[2] | 0x20) == m[2])
+		{
+			value = month;
+			return { first + 3, field_errc::ok };
+		}
+	return { first, field_errc::unknown_name };
+}
+
+constexpr const char* MONTH_NAMES[] = { "January", "February", "March", "April", "May", "June", "July", "August", "September", "October", "November", "December" };
+
+//A full English month name, any case, as 1 to 12
+inline field_result parse_monthname(const char* first, const char* last, int& value)
+{
+	for (int month = 1; month <= 12; ++month)
+	{
+		const char* const name = MONTH_NAMES[month - 1];
+		const size_t len = strlen(name);
+		if (size_t(last - first) < len)
+			continue;
+		size_t i = 0;
+		while (i < len && (first[i] | 0x20) == (name[i] | 0x20))
+			++i;
+		if (i == len)
+		{
+			value = month;
+			return { first + len, field_errc::ok };
+		}
+	}
+	return { first, last - first < 3 ? field_errc::too_short : field_errc::unknown_name };
+}
+
+//Indexed by weekday_from_days
+constexpr char WEEKDAY_ABBREVIATIONS[] = "SunMonTueWedThuFriSat";
+
+//A three letter English weekday abbreviation, any case, as 0 (Sunday) to 6
+inline field_result parse_weekdayabbr(const char* first, const char* last, int& value)
+{
+	if (last - first < 3)
+		return { last, field_errc::too_short };
+	const char* w = WEEKDAY_ABBREVIATIONS;
+	for (int day = 0; day < 7; ++day, w += 3)
+		if ((first[0] | 0x20) == (w[0] | 0x20) && (first[1] | 0x20) == w[1] && (first[2] | 0x20) == w[2])
+		{
+			value = day;
+			return { first + 3, field_errc::ok };
+		}
+	return { first, field_errc::unknown_name };
+}
+
+//FIELD OPS. readfield and writefield handle every kind in FORMAT_SPECS, so the runtime, compile time and SIMD parsers
+//and formatters all share them. The hot kinds, digits and fraction, are also inlined by each caller.
+
+//Zeroes a value array before parsing, with no UTC offset
+inline void resetfields(int* values)
+{
+	std::fill(values, values + FMT_FIELDCOUNT, 0);
+	values[int(fmtfield::utcoffset)] = FMT_NOOFFSET;
+}
+
+//%E: seconds since the epoch, stored as UTC fields with a zero offset so no zone is applied
+inline field_result readepoch(const char* first, const char* last, int maxwidth, int* values)
+{
+	const char* p = first;
+	const bool negative = p < last && *p == '-';
+	p += negative;
+	const char* const digits = p;
+	const char* const end = last - first > maxwidth ? first + maxwidth : last;
+	long long secs = 0;
+	for (; p < end && unsigned(*p - '0') <= 9; ++p)
+		secs = secs * 10 + (*p - '0');
+	if (p == digits)
+		return { p, p == last ? field_errc::too_short : field_errc::not_digit };
+	if (negative)
+		secs = -secs;
+
+	const long long days = floordiv(secs, S_IN_DAY);
+	const int sod = int(secs - days * S_IN_DAY);
+	const civildate date = civil_from_days(days);
+	values[int(fmtfield::year)] = int(date.year);
+	values[int(fmtfield::month)] = date.month;
+	values[int(fmtfield::day)] = date.day;
+	values[int(fmtfield::hour)] = sod / S_IN_HOUR;
+	values[int(fmtfield::minute)] = sod % S_IN_HOUR / S_IN_MINUTE;
+	values[int(fmtfield::second)] = sod % S_IN_MINUTE;
+	values[int(fmtfield::utcoffset)] = 0;
+	return { p, field_errc::ok };
+}
+
+//Reads one non literal op into values. Range checks are left to assignfields, except for %z.
+CHRONOWRAP_NOINLINE inline field_result readfield(const fmtop& op, const char* first, const char* last, int* values)
+{
+	static constexpr int powten[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+	int& value = values[int(op.field)];
+	switch (op.kind)
+	{
+	case fmtkind::fraction:
+		return parse_fraction(first, last, op.minwidth, op.width, value);
+	case fmtkind::scaled:
+	{
+		const field_result r = parse_fraction(first, last, op.minwidth, op.width, value);
+		value *= powten[9 - op.width];
+		return r;
+	}
+	case fmtkind::spaced:
+		if (first < last && *first == ' ')
+			return parse_fixed(first + 1, last, op.width - 1, value);
+		return parse_fixed(first, last, op.width, value);
+	case fmtkind::ampm:
+	{
+		if (last - first < 2)
+			return { last, field_errc::too_short };
+		const char c = char(first[0] | 0x20);
+		if ((c != 'a' && c != 'p') || (first[1] | 0x20) != 'm')
+			return { first, field_errc::unknown_name };
+		value = c == 'a' ? 1 : 2;
+		return { first + 2, field_errc::ok };
+	}
+	case fmtkind::monthabbr:
+		return parse_monthabbr(first, last, value);
+	case fmtkind::monthname:
+		return parse_monthname(first, last, value);
+	case fmtkind::weekdayabbr:
+	{
+		//Stored one based, so zero still means absent
+		const field_result r = parse_weekdayabbr(first, last, value);
+		value += bool(r);
+		return r;
+	}
+	case fmtkind::utcoffset:
+	{
+		if (last - first < 5)
+			return { last, field_errc::too_short };
+		int hours, minutes;
+		if ((*first != '+' && *first != '-') || !(readfixed(first + 1, 2, hours) & readfixed(first + 3, 2, minutes)))
+			return { first, field_errc::not_digit };
+		if (hours > 23 || minutes > 59)
+			return { first, field_errc::out_of_range };
+		value = (*first == '-' ? -1 : 1) * (hours * S_IN_HOUR + minutes * S_IN_MINUTE);
+		return { first + 5, field_errc::ok };
+	}
+	case fmtkind::epoch:
+		return readepoch(first, last, op.width, values);
+	default:
+		return parse_fixed(first, last, op.width, value);
+	}
+}
+
+//Writes one non literal op. Returns the characters written, op.width for everything but %B and %E.
+//Weekday, day of year and epoch are worked out from the date fields, so formatting never needs their slots.
+CHRONOWRAP_NOINLINE inline size_t writefield(const fmtop& op, char* out, const int* values)
+{
+	static constexpr unsigned powten[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+	const int year = values[int(fmtfield::year)];
+	const int month = values[int(fmtfield::month)];
+	const int day = values[int(fmtfield::day)];
+	switch (op.kind)
+	{
+	case fmtkind::scaled:
+		writedigits(out, unsigned(values[int(op.field)]) / powten[9 - op.width], op.width);
+		return op.width;
+	case fmtkind::spaced:
+		writedigits(out, unsigned(values[int(op.field)]), op.width);
+		for (int i = 0; i < op.width - 1 && out[i] == '0'; ++i)
+			out[i] = ' ';
+		return op.width;
+	case fmtkind::hour12:
+		writedigits(out, unsigned((values[int(fmtfield::hour)] + 11) % 12 + 1), 2);
+		return 2;
+	case fmtkind::ampm:
+		out[0] = values[int(fmtfield::hour)] < 12 ? 'A' : 'P';
+		out[1] = 'M';
+		return 2;
+	case fmtkind::monthabbr:
+		memcpy(out, MONTH_ABBREVIATIONS + (month - 1) * 3, 3);
+		return 3;
+	case fmtkind::monthname:
+	{
+		const size_t len = strlen(MONTH_NAMES[month - 1]);
+		memcpy(out, MONTH_NAMES[month - 1], len);
+		return len;
+	}
+	case fmtkind::weekdayabbr:
+		memcpy(out, WEEKDAY_ABBREVIATIONS + weekday_from_days(days_from_civil(year, month, day)) * 3, 3);
+		return 3;
+	case fmtkind::yearday:
+		writedigits(out, unsigned(days_from_civil(year, month, day) - days_from_civil(year, 1, 1) + 1), 3);
+		return 3;
+	case fmtkind::utcoffset:
+	{
+		const int offset = values[int(fmtfield::utcoffset)];
+		const unsigned size = unsigned(offset < 0 ? -offset : offset);
+		out[0] = offset < 0 ? '-' : '+';
+		writedigits(out + 1, size / S_IN_HOUR, 2);
+		writedigits(out + 3, size % S_IN_HOUR / S_IN_MINUTE, 2);
+		return 5;
+	}
+	case fmtkind::epoch:
+	{
+		const long long secs = days_from_civil(year, month, day) * S_IN_DAY + values[int(fmtfield::hour)] * S_IN_HOUR
+			+ values[int(fmtfield::minute)] * S_IN_MINUTE + values[int(fmtfield::second)] - values[int(fmtfield::utcoffset)];
+		unsigned long long size = secs < 0 ? 0ULL - (unsigned long long)secs : (unsigned long long)secs;
+		char digits[20];
+		int n = 0;
+		do
+		{
+			digits[n++] = char('0' + size % 10);
+			size /= 10;
+		} while (size);
+		size_t len = 0;
+		if (secs < 0)
+			out[len++] = '-';
+		while (n)
+			out[len++] = digits[--n];
+		return len;
+	}
+	default:
+		writedigits(out, unsigned(values[int(op.field)]), op.width);
+		return op.width;
+	}
+}
+
+//Folds %p into the hour and %j into the month and day, when they weren't also given, then clears those slots.
+//Returns the field at fault, or literal if there wasn't one.
+inline fmtfield resolvefields(int* values)
+{
+	int& hour = values[int(fmtfield::hour)];
+	int& ampm = values[int(fmtfield::ampm)];
+	if (ampm)
+	{
+		if (hour < 1 || hour > 12)
+			return fmtfield::hour;
+		hour = hour % 12 + (ampm == 2 ? 12 : 0);
+		ampm = 0;
+	}
+
+	int& yearday = values[int(fmtfield::yearday)];
+	if (yearday)
+	{
+		const int year = values[int(fmtfield::year)];
+		if (yearday > 337 + days_in_month(year, 2))
+			return fmtfield::yearday;
+		if (!values[int(fmtfield::month)] && !values[int(fmtfield::day)])
+		{
+			const civildate c = civil_from_days(days_from_civil(year, 1, 1) + yearday - 1);
+			values[int(fmtfield::month)] = c.month;
+			values[int(fmtfield::day)] = c.day;
+		}
+		yearday = 0;
+	}
+	return fmtfield::literal;
+}
+
+//Reads between mincount and maxcount digits, right padded with zeros to maxcount, into param if it's within
+//[paramlow, paramhigh]. Advances start past the digits on success.
+inline bool assigntmparam(const char ** start, const char* end, int mincount, int maxcount, int& param, int paramlow, int paramhigh)
+{
+	assert(start);
+	assert(end);
+	assert(*start);
+	int temp;
+	const field_result r = parse_fraction(*start, end, mincount, maxcount, temp);
+	if (!r || temp < paramlow || temp > paramhigh)
+		return false;
+	param = temp;
+	*start = r.ptr;
+	return true;
+}
+
+//utcdiff is in hours and is added to the tm's hour
+inline time_t time_to_epoch(const struct tm *ltm, int utcdiff)
+{
+	const long long days = days_from_civil(ltm->tm_year + 1900LL, ltm->tm_mon + 1, ltm->tm_mday);
+	return time_t(days * S_IN_DAY + (ltm->tm_hour + utcdiff) * S_IN_HOUR + ltm->tm_min * S_IN_MINUTE + ltm->tm_sec);
+}
+
+inline bool timestamp::fromstring(const char* tstamp, const char* format, size_t tlen, size_t flen)
+{
+	if (!tstamp || !format)
+		return false;
+
+	if (!tlen)
+		tlen = strlen(tstamp);
+	if (!flen)
+		flen = strlen(format);
+
+	const char* const tend = tstamp + tlen;
+	const char* const fend = format + flen;
+	const char* const tstart = tstamp;
+	const char* const fstart = format;
+
+	int values[FMT_FIELDCOUNT];
+	resetfields(values);
+	//I'd rather only go through one string at a time if possible
+	//Format string is used to get positions of different info in the time string. Text between specifiers is skipped, not matched.
+	while (tstamp < tend && format < fend)
+	{
+		if (*format == '%' && ++format < fend)
+		{
+			int index = 0;
+			while (index < FMT_BASICSPECS && FORMAT_SPECS[index].symbol != *format)
+				++index;
+
+			if (index < FMT_BASICSPECS)
+			{
+				const fmtspec& spec = FORMAT_SPECS[index];
+				//For year, month, day, hour, and second, the number lengths are fixed. For ms and ns, the lengths are variable.
+				const field_result r = spec.kind == fmtkind::digits ? parse_fixed(tstamp, tend, spec.width, values[int(spec.field)])
+					: parse_fraction(tstamp, tend, 0, spec.width, values[int(spec.field)]);
+				if (!r)
+					return false;
+				tstamp = r.ptr;
+			}
+			//The other specifiers start again on the general path, so formats without them don't pay for it
+			else if (fmtspec spec; findspec(format, fend, spec))
+				return fromstringextended(tstart, tend, fstart, fend);
+		}
+		else
+			++tstamp;
+		++format;
+	}
+
+	return assignfields(values);
+}
+
+//The uncompiled fromstring for formats with specifiers past the first FMT_BASICSPECS
+CHRONOWRAP_NOINLINE inline bool timestamp::fromstringextended(const char* tstamp, const char* tend, const char* format, const char* fend)
+{
+	int values[FMT_FIELDCOUNT];
+	resetfields(values);
+	bool simple = true;
+	while (tstamp < tend && format < fend)
+	{
+		if (*format == '%' && ++format < fend)
+		{
+			fmtspec spec;
+			if (!findspec(format, fend, spec))
+			{
+				++format;
+				continue;
+			}
+			//Fractions may be empty here
+			field_result r;
+			if (spec.kind == fmtkind::digits)
+				r = parse_fixed(tstamp, tend, spec.width, values[int(spec.field)]);
+			else if (spec.kind == fmtkind::fraction)
+				r = parse_fraction(tstamp, tend, 0, spec.width, values[int(spec.field)]);
+			else
+			{
+				r = readfield({ spec.field, spec.width, spec.kind == fmtkind::scaled ? (unsigned char)0 : spec.minwidth, 0, 0, spec.kind }, tstamp, tend, values);
+				simple = false;
+			}
+			if (!r)
+				return false;
+			tstamp = r.ptr;
+		}
+		else
+		{
+			++tstamp;
+			++format;
+		}
+	}
+
+	return simple ? assignfields(values) : assignresolved(values);
+}
+
+//Reads fields indexed by fmtfield using a precompiled format. Fixed width formats are bounds checked once,
+//then every op is a load at a known offset.
+inline bool timestamp::parsefields(const char* tstamp, size_t tlen, const compiled_format& format, int* values)
+{
+	if (!tstamp || !format.isvalid() || tlen < format.length())
+		return false;
+	//Anything else takes tryparse's path, which handles every kind
+	if (!format.issimple())
+		return bool(checkfields(tstamp, tlen, format, values));
+
+	const bool fixed = format.isfixedwidth();
+	const char* const tend = tstamp + tlen;
+	const char* s = tstamp;
+	resetfields(values);
+
+	for (const fmtop& op : format)
+	{
+		if (!fixed && tend - s < op.minwidth)
+			return false;
+
+		if (op.field == fmtfield::literal)
+		{
+			if (memcmp(s, format.literal(op), op.width))
+				return false;
+			s += op.width;
+			continue;
+		}
+
+		//Variable width fractions read what's there and scale it as if it were right padded with zeros
+		const field_result r = op.minwidth == op.width ? parse_fixed(s, tend, op.width, values[int(op.field)])
+			: parse_fraction(s, tend, op.minwidth, op.width, values[int(op.field)]);
+		if (!r)
+			return false;
+		s = r.ptr;
+	}
+
+	return true;
+}
+
+inline bool timestamp::fromstring(const char* tstamp, size_t tlen, const compiled_format& format)
+{
+	int values[FMT_FIELDCOUNT];
+	return parsefields(tstamp, tlen, format, values) && (format.issimple() ? assignfields(values) : assignresolved(values));
+}
+
+inline bool timestamp::fromstring(const char* tstamp, size_t tlen, const compiled_format& format, int utcoffset)
+{
+	int values[FMT_FIELDCOUNT];
+	return parsefields(tstamp, tlen, format, values) && (format.issimple() ? assignfields(values, utcoffset) : assignresolved(values, utcoffset, nullptr));
+}
+
+inline bool timestamp::fromstring(const char* tstamp, size_t tlen, const compiled_format& format, const tzone& zone)
+{
+	int values[FMT_FIELDCOUNT];
+	return parsefields(tstamp, tlen, format, values) && (format.issimple() ? assignfields(values, zone) : assignresolved(values, 0, &zone));
+}
+
+//parsefields and assignfields' bounds checks in one pass, reporting the first failure
+CHRONOWRAP_NOINLINE inline parse_result timestamp::checkfields(const char* tstamp, size_t tlen, const compiled_format& format, int* values)
+{
+	if (!tstamp || !format.isvalid())
+		return { parse_errc::bad_format, fmtfield::literal, 0 };
+
+	const char* const tend = tstamp + tlen;
+	const char* s = tstamp;
+	std::uint32_t at[FMT_FIELDCOUNT] = {};
+	resetfields(values);
+
+	for (const fmtop& op : format)
+	{
+		if (op.field == fmtfield::literal)
+		{
+			const char* const literal = format.literal(op);
+			for (int i = 0; i < op.width; ++i, ++s)
+				if (s == tend || *s != literal[i])
+					return { s == tend ? parse_errc::too_short : parse_errc::literal_mismatch, fmtfield::literal, std::uint32_t(s - tstamp) };
+			continue;
+		}
+
+		at[int(op.field)] = std::uint32_t(s - tstamp);
+		//Variable width fractions read what's there and scale it as if it were right padded with zeros
+		const field_result r = op.kind == fmtkind::digits ? parse_fixed(s, tend, op.width, values[int(op.field)])
+			: op.kind == fmtkind::fraction ? parse_fraction(s, tend, op.minwidth, op.width, values[int(op.field)]) : readfield(op, s, tend, values);
+		if (!r)
+			return { parse_errc(r.ec), op.field, std::uint32_t(r.ptr - tstamp) };
+		s = r.ptr;
+	}
+
+	//The same bounds as assignfields
+	const fmtfield bad = resolvefields(values);
+	if (bad != fmtfield::literal)
+		return { parse_errc::out_of_range, bad, at[int(bad)] };
+	static constexpr int low[] = { INT_MIN, 1, 1, 0, 0, 0 };
+	static constexpr int high[] = { INT_MAX, 12, 31, 23, 59, 59 };
+	for (int f = int(fmtfield::month); f <= int(fmtfield::second); ++f)
+		if (values[f] < low[f] || values[f] > high[f])
+			return { parse_errc::out_of_range, fmtfield(f), at[f] };
+	return {};
+}
+
+inline parse_result timestamp::tryparse(std::string_view tstamp, const compiled_format& format)
+{
+	int values[FMT_FIELDCOUNT];
+	const parse_result r = checkfields(tstamp.data(), tstamp.size(), format, values);
+	if (r)
+		format.issimple() ? assignfields(values) : assignresolved(values);
+	return r;
+}
+
+inline parse_result timestamp::tryparse(std::string_view tstamp, const compiled_format& format, int utcoffset)
+{
+	int values[FMT_FIELDCOUNT];
+	const parse_result r = checkfields(tstamp.data(), tstamp.size(), format, values);
+	if (r)
+		format.issimple() ? assignfields(values, utcoffset) : assignresolved(values, utcoffset, nullptr);
+	return r;
+}
+
+inline parse_result timestamp::tryparse(std::string_view tstamp, const compiled_format& format, const tzone& zone)
+{
+	int values[FMT_FIELDCOUNT];
+	const parse_result r = checkfields(tstamp.data(), tstamp.size(), format, values);
+	if (r)
+		format.issimple() ? assignfields(values, zone) : assignresolved(values, 0, &zone);
+	return r;
+}
+
+constexpr timestamp timestamp::from_civil(const civiltime& c, int utcoffset)
+{
+	const long long secs = days_from_civil(c.year, c.month, c.day) * S_IN_DAY + c.hour * S_IN_HOUR + c.minute * S_IN_MINUTE + c.second - utcoffset;
+	return timestamp(t_timepoint<t_sysclock>(durcast<t_sysclock::duration>(t_sec(secs)) + durcast<t_sysclock::duration>(t_nsec(c.nanosecond))), true);
+}
 
+constexpr civiltime timestamp::to_civil(int utcoffset) const
+{
+	const auto since = time.time_since_epoch() + t_sec(utcoffset);
+	const auto secs = std::chrono::floor<t_sec>(since);
+	const long long days = floordiv(secs.count(), S_IN_DAY);
+	const int sod = int(secs.count() - days * S_IN_DAY);
+	const civildate date = civil_from_days(days);
+	return { int(date.year), date.month, date.day, sod / S_IN_HOUR, sod % S_IN_HOUR / S_IN_MINUTE, sod % S_IN_MINUTE, int(durcast<t_nsec>(since - secs).count()) };
+}
+
+//Bounds checks calendar fields indexed by fmtfield and stores them. Fields from a format that isn't simple go through assignresolved.
+inline bool timestamp::assignfields(const int* values, int utcoffset)
+{
+	//Bounds checking
+	if (values[int(fmtfield::month)] < 1 || values[int(fmtfield::month)] > 12)
+		return false;
+	if (values[int(fmtfield::day)] < 1 || values[int(fmtfield::day)] > 31)
+		return false;
+	if (values[int(fmtfield::hour)] < 0 || values[int(fmtfield::hour)] > 23)
+		return false;
+	if (values[int(fmtfield::minute)] < 0 || values[int(fmtfield::minute)] > 59)
+		return false;
+	if (values[int(fmtfield::second)] < 0 || values[int(fmtfield::second)] > 59)
+		return false;
+
+	const int ns = values[int(fmtfield::nano)] ? values[int(fmtfield::nano)] : values[int(fmtfield::milli)] * 1000000;
+	*this = from_civil({ values[int(fmtfield::year)], values[int(fmtfield::month)], values[int(fmtfield::day)],
+		values[int(fmtfield::hour)], values[int(fmtfield::minute)], values[int(fmtfield::second)], ns }, utcoffset);
+	return true;
+}
+
+//Wall clock fields indexed by fmtfield as seconds since the epoch, ignoring any offset
+inline long long fieldseconds(const int* values)
+{
+	return days_from_civil(values[int(fmtfield::year)], values[int(fmtfield::month)], values[int(fmtfield::day)]) * S_IN_DAY
+		+ values[int(fmtfield::hour)] * S_IN_HOUR + values[int(fmtfield::minute)] * S_IN_MINUTE + values[int(fmtfield::second)];
+}
+
+//Stores wall clock fields in a zone, using the offset in effect at that time rather than today's
+inline bool timestamp::assignfields(const int* values, const tzone& zone)
+{
+	return assignfields(values, zone.offsetfromlocal(fieldseconds(values)));
+}
+
+//assignfields for fields parsed with a format that isn't simple, which may need %p, %j, %z or %E folded in first.
+//An offset parsed from the string wins over utcoffset and zone; otherwise zone is used if it isn't null.
+CHRONOWRAP_NOINLINE inline bool timestamp::assignresolved(const int* values, int utcoffset, const tzone* zone)
+{
+	int resolved[FMT_FIELDCOUNT];
+	std::copy(values, values + FMT_FIELDCOUNT, resolved);
+	if (resolvefields(resolved) != fmtfield::literal)
+		return false;
+	int offset = resolved[int(fmtfield::utcoffset)];
+	if (offset == FMT_NOOFFSET)
+		offset = zone ? zone->offsetfromlocal(fieldseconds(resolved)) : utcoffset;
+	return assignfields(resolved, offset);
+}
+
+CHRONOWRAP_NOINLINE inline bool timestamp::assignresolved(const int* values)
+{
+	return assignresolved(values, 0, &tzone::local());
+}
+
+//Stores local time fields indexed by fmtfield
+inline bool timestamp::assignfields(const int* values)
+{
+	return assignfields(values, tzone::local());
+}
+
+//Breaks the stored time into calendar fields indexed by fmtfield
+inline void timestamp::civilfields(int* values, int utcoffset) const
+{
+	const civiltime c = to_civil(utcoffset);
+	values[int(fmtfield::year)] = c.year;
+	values[int(fmtfield::month)] = c.month;
+	values[int(fmtfield::day)] = c.day;
+	values[int(fmtfield::hour)] = c.hour;
+	values[int(fmtfield::minute)] = c.minute;
+	values[int(fmtfield::second)] = c.second;
+	values[int(fmtfield::milli)] = c.nanosecond / 1000000;
+	values[int(fmtfield::nano)] = c.nanosecond;
+	values[int(fmtfield::utcoffset)] = utcoffset;
+}
+
+//Breaks the stored time into wall clock fields in a zone. Returns the zone's UTC offset at that time in seconds.
+inline int timestamp::zonefields(int* values, const tzone& zone) const
+{
+	const int offset = zone.offsetat(std::chrono::floor<t_sec>(time.time_since_epoch()).count());
+	civilfields(values, offset);
+	return offset;
+}
+
+//Breaks the stored time into local time fields indexed by fmtfield. Returns the local UTC offset in seconds.
+inline int timestamp::localfields(int* values) const
+{
+	return zonefields(values, tzone::local());
+}
+
+//One op of a compile time format. Digit and literal mismatches are accumulated rather than branched on.
+template<const compiled_format& F, size_t I>
+inline bool timestamp::parseop(const char* base, const char*& s, const char* tend, int* values)
+{
+	constexpr fmtop op = F[I];
+	//Fixed width layouts read from constant offsets, so no op depends on the one before it
+	const char* const p = F.isfixedwidth() ? base + op.offset : s;
+	if constexpr (!F.isfixedwidth())
+		if (tend - p < op.minwidth)
+			return false;
+
+	if constexpr (op.field == fmtfield::literal)
+	{
+		bool bad = false;
+		for (int i = 0; i < op.width; ++i)
+			bad |= p[i] != F.literal(op)[i];
+		s = p + op.width;
+		return !bad;
+	}
+	else if constexpr (op.kind == fmtkind::digits)
+	{
+		s = p + op.width;
+		return readfixed(p, op.width, values[int(op.field)]);
+	}
+	else if constexpr (op.kind == fmtkind::fraction)
+	{
+		const field_result r = parse_fraction(p, tend, op.minwidth, op.width, values[int(op.field)]);
+		s = r.ptr;
+		return bool(r);
+	}
+	else
+	{
+		const field_result r = readfield(op, p, tend, values);
+		s = r.ptr;
+		return bool(r);
+	}
+}
+
+template<const compiled_format& F, size_t... I>
+inline bool timestamp::parseops(const char* s, const char* tend, int* values, std::index_sequence<I...>)
+{
+	const char* const base = s;
+	//Fixed width layouts were bounds checked by the caller, so evaluate every op without short circuiting
+	if constexpr (F.isfixedwidth())
+		return (parseop<F, I>(base, s, tend, values) & ...);
+	else
+		return (parseop<F, I>(base, s, tend, values) && ...);
+}
+
+template<const compiled_format& F>
+inline timestamp timestamp::parse(std::string_view tstamp)
+{
+	static_assert(F.isvalid(), "timestamp::parse: unknown specifier or format too long");
+
+	timestamp ret;
+	if (tstamp.size() < F.length())
+		return ret;
+
+	int values[FMT_FIELDCOUNT];
+	resetfields(values);
+	if (parseops<F>(tstamp.data(), tstamp.data() + tstamp.size(), values, std::make_index_sequence<F.size()>{}))
+	{
+		if constexpr (F.issimple())
+			ret.assignfields(values);
+		else
+			ret.assignresolved(values);
+	}
 	return ret;
-}
\ No newline at end of file
+}
+
+template<const compiled_format& F, size_t I>
+inline void timestamp::formatop(char* out, const int* values)
+{
+	constexpr fmtop op = F[I];
+	//Fraction fields are always written at full width, so every op lands at a fixed offset in the output
+	constexpr size_t offset = [] {
+		size_t pos = 0;
+		for (size_t n = 0; n < I; ++n)
+			pos += F[n].width;
+		return pos;
+	}();
+	char* const p = out + offset;
+
+	if constexpr (op.field == fmtfield::literal)
+	{
+		for (int i = 0; i < op.width; ++i)
+			p[i] = F.literal(op)[i];
+	}
+	else if constexpr (op.kind == fmtkind::digits || op.kind == fmtkind::fraction)
+		writedigits(p, unsigned(values[int(op.field)]), op.width);
+	else
+		writefield(op, p, values);
+}
+
+template<const compiled_format& F, size_t... I>
+inline void timestamp::formatops(char* out, const int* values, std::index_sequence<I...>)
+{
+	(formatop<F, I>(out, values), ...);
+}
+
+template<const compiled_format& F>
+inline std::string timestamp::tostdstring() const
+{
+	static_assert(F.isvalid(), "timestamp::tostdstring: unknown specifier or format too long");
+
+	int values[FMT_FIELDCOUNT];
+	localfields(values);
+	char buf[F.maxlength() + 1];
+	//%B and %E move everything after them, so those formats take the runtime path
+	if constexpr (!F.isfixedoutput())
+		return std::string(buf, format_fields(buf, values, F));
+	formatops<F>(buf, values, std::make_index_sequence<F.size()>{});
+	return std::string(buf, F.maxlength());
+}
+
+
+//Writes fields indexed by fmtfield using a compiled format
+template<class OutputIt>
+inline OutputIt format_fields(OutputIt out, const int* values, const compiled_format& format)
+{
+	for (const fmtop& op : format)
+	{
+		if (op.field == fmtfield::literal)
+		{
+			out = std::copy(format.literal(op), format.literal(op) + op.width, out);
+			continue;
+		}
+		char digits[16];
+		if (op.kind != fmtkind::digits && op.kind != fmtkind::fraction)
+		{
+			out = std::copy(digits, digits + writefield(op, digits, values), out);
+			continue;
+		}
+		writedigits(digits, unsigned(values[int(op.field)]), op.width);
+		out = std::copy(digits, digits + op.width, out);
+	}
+	return out;
+}
+
+//Uses input format to transform internal time_point into a formatted std::string. Format characters are listed in FORMAT_SPECS.
+//Returns an empty string if the format has an unknown specifier.
+inline std::string timestamp::tostdstring(const std::string& format)
+{
+	const compiled_format compiled(format);
+	char buf[compiled_format::MAX_OUTPUT];
+	return std::string(buf, format_to(buf, sizeof(buf), compiled));
+}
+
+//Writes the formatted time into out without touching the heap. Fractions are always written at full width,
+//so the output is exactly format.maxlength() characters unless there's a %B or %E. Returns the length, or 0 if cap is too small.
+inline size_t timestamp::format_to(char* out, size_t cap, const compiled_format& format) const
+{
+	if (!out || !format.isvalid() || cap < format.maxlength())
+		return 0;
+	return size_t(format_to<char*>(out, format) - out);
+}
+
+template<class OutputIt>
+inline OutputIt timestamp::format_to(OutputIt out, const compiled_format& format) const
+{
+	if (!format.isvalid())
+		return out;
+
+	int values[FMT_FIELDCOUNT];
+	localfields(values);
+	return format_fields(out, values, format);
+}
+
+inline std::string timestamp::tostdstring(const std::string& format, int utcoffset) const
+{
+	const compiled_format compiled(format);
+	char buf[compiled_format::MAX_OUTPUT];
+	return std::string(buf, format_to(buf, sizeof(buf), compiled, utcoffset));
+}
+
+inline size_t timestamp::format_to(char* out, size_t cap, const compiled_format& format, int utcoffset) const
+{
+	if (!out || !format.isvalid() || cap < format.maxlength())
+		return 0;
+	return size_t(format_to<char*>(out, format, utcoffset) - out);
+}
+
+//ISO 8601 AND RFC 3339
+
+//Reads an ISO 8601 string into c, and its offset, if it has one, into utcoffset. The fixed part is checked with no branches.
+inline bool readiso8601(std::string_view tstamp, leap_policy leap, civiltime& c, int& utcoffset, bool& hasoffset)
+{
+	const char* const s = tstamp.data();
+	const char* const end = s + tstamp.size();
+	if (tstamp.size() < 19)
+		return false;
+	bool ok = readfixed(s, 4, c.year) & readfixed(s + 5, 2, c.month) & readfixed(s + 8, 2, c.day)
+		& readfixed(s + 11, 2, c.hour) & readfixed(s + 14, 2, c.minute) & readfixed(s + 17, 2, c.second);
+	ok &= (s[4] == '-') & (s[7] == '-') & (((s[10] | 0x20) == 't') | (s[10] == ' ')) & (s[13] == ':') & (s[16] == ':');
+	ok &= (unsigned(c.month - 1) < 12) & (c.hour < 24) & (c.minute < 60) & (c.second < 61);
+	if (!ok || c.day < 1 || c.day > days_in_month(c.year, c.month))
+		return false;
+
+	const char* p = s + 19;
+	c.nanosecond = 0;
+	if (p < end && *p == '.')
+	{
+		const field_result r = parse_fraction(p + 1, end, 1, 9, c.nanosecond);
+		if (!r)
+			return false;
+		for (p = r.ptr; p < end && unsigned(*p - '0') <= 9; ++p);
+	}
+
+	hasoffset = p < end;
+	utcoffset = 0;
+	if (hasoffset)
+	{
+		if ((*p | 0x20) == 'z')
+			++p;
+		else
+		{
+			int hours, minutes;
+			if (end - p != 6 || (*p != '+' && *p != '-') || p[3] != ':' || !(readfixed(p + 1, 2, hours) & readfixed(p + 4, 2, minutes)) || hours > 23 || minutes > 59)
+				return false;
+			utcoffset = (*p == '-' ? -1 : 1) * (hours * S_IN_HOUR + minutes * S_IN_MINUTE);
+			p += 6;
+		}
+		if (p != end)
+			return false;
+	}
+
+	if (c.second == 60)
+	{
+		if (leap == leap_policy::reject)
+			return false;
+		if (leap == leap_policy::clamp)
+		{
+			c.second = 59;
+			c.nanosecond = 999999999;
+		}
+	}
+	return true;
+}
+
+inline timestamp timestamp::parse_iso8601(std::string_view tstamp, leap_policy leap)
+{
+	civiltime c;
+	int utcoffset;
+	bool hasoffset;
+	return readiso8601(tstamp, leap, c, utcoffset, hasoffset) ? from_civil(c, utcoffset) : timestamp();
+}
+
+inline timestamp timestamp::parse_iso8601(std::string_view tstamp, const tzone& zone, leap_policy leap)
+{
+	civiltime c;
+	int utcoffset;
+	bool hasoffset;
+	if (!readiso8601(tstamp, leap, c, utcoffset, hasoffset))
+		return timestamp();
+	if (!hasoffset)
+		utcoffset = zone.offsetfromlocal(days_from_civil(c.year, c.month, c.day) * S_IN_DAY + c.hour * S_IN_HOUR + c.minute * S_IN_MINUTE + c.second);
+	return from_civil(c, utcoffset);
+}
+
+inline size_t timestamp::format_rfc3339(char* out, size_t cap, int digits, int utcoffset) const
+{
+	const civiltime c = to_civil(utcoffset);
+	if (!out || cap < RFC3339_MAX || c.year < 0 || c.year > 9999 || digits > 9)
+		return 0;
+	char* p = out;
+	writedigits(p, unsigned(c.year), 4);
+	p[4] = '-';
+	writedigits(p + 5, unsigned(c.month), 2);
+	p[7] = '-';
+	writedigits(p + 8, unsigned(c.day), 2);
+	p[10] = 'T';
+	writedigits(p + 11, unsigned(c.hour), 2);
+	p[13] = ':';
+	writedigits(p + 14, unsigned(c.minute), 2);
+	p[16] = ':';
+	writedigits(p + 17, unsigned(c.second), 2);
+	p += 19;
+
+	if (digits < 0)
+	{
+		//Drop trailing zeros
+		digits = 9;
+		for (int ns = c.nanosecond; digits && ns % 10 == 0; ns /= 10)
+			--digits;
+		if (!c.nanosecond)
+			digits = 0;
+	}
+	if (digits)
+	{
+		static constexpr int powten[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+		*p++ = '.';
+		writedigits(p, unsigned(c.nanosecond / powten[9 - digits]), digits);
+		p += digits;
+	}
+
+	if (!utcoffset)
+		*p++ = 'Z';
+	else
+	{
+		const int minutes = std::abs(utcoffset) / S_IN_MINUTE;
+		*p++ = utcoffset < 0 ? '-' : '+';
+		writedigits(p, unsigned(minutes / 60), 2);
+		p[2] = ':';
+		writedigits(p + 3, unsigned(minutes % 60), 2);
+		p += 5;
+	}
+	return size_t(p - out);
+}
+
+inline std::string timestamp::format_rfc3339(int digits, int utcoffset) const
+{
+	char buf[RFC3339_MAX];
+	return std::string(buf, format_rfc3339(buf, sizeof(buf), digits, utcoffset));
+}
+
+template<class OutputIt>
+inline OutputIt timestamp::format_to(OutputIt out, const compiled_format& format, int utcoffset) const
+{
+	if (!format.isvalid())
+		return out;
+
+	int values[FMT_FIELDCOUNT];
+	civilfields(values, utcoffset);
+	return format_fields(out, values, format);
+}
+
+inline std::string timestamp::tostdstring(const std::string& format, const tzone& zone) const
+{
+	const compiled_format compiled(format);
+	char buf[compiled_format::MAX_OUTPUT];
+	return std::string(buf, format_to(buf, sizeof(buf), compiled, zone));
+}
+
+inline size_t timestamp::format_to(char* out, size_t cap, const compiled_format& format, const tzone& zone) const
+{
+	if (!out || !format.isvalid() || cap < format.maxlength())
+		return 0;
+	return size_t(format_to<char*>(out, format, zone) - out);
+}
+
+template<class OutputIt>
+inline OutputIt timestamp::format_to(OutputIt out, const compiled_format& format, const tzone& zone) const
+{
+	if (!format.isvalid())
+		return out;
+
+	int values[FMT_FIELDCOUNT];
+	zonefields(values, zone);
+	return format_fields(out, values, format);
+}
+
+
+//Formats a stream of timestamps with one format, caching the local calendar fields and UTC offset of the last minute seen.
+//Times inside the cached minute only recompute the seconds and fraction, so the zone lookup runs about once a minute for log stamps.
+//Not thread safe. Give each thread or logger its own formatter.
+class timestamp_formatter
+{
+	using t_sysclock = std::chrono::system_clock;
+
+	compiled_format format;
+	tzone zone;
+	int cached[FMT_FIELDCOUNT] = {};
+	long long minutestart = 0; //seconds since the epoch at the start of the cached minute
+	int offset = 0;            //seconds east of UTC during the cached minute
+	bool hascache = false;
+
+	void fill(const timestamp& t, int* values);
+
+public:
+	explicit timestamp_formatter(const compiled_format& f, const tzone& z = tzone::local()) : format(f), zone(z) {}
+	explicit timestamp_formatter(const std::string& f, const tzone& z = tzone::local()) : format(f), zone(z) {}
+
+	size_t format_to(char* out, size_t cap, const timestamp& t);
+	std::string tostdstring(const timestamp& t);
+
+	//UTC offset in seconds of the minute last formatted
+	int utcoffset() const { return offset; }
+	const compiled_format& getformat() const { return format; }
+};
+
+inline void timestamp_formatter::fill(const timestamp& t, int* values)
+{
+	const auto since = t.time.time_since_epoch();
+	long long sec = std::chrono::duration_cast<std::chrono::seconds>(since).count();
+	if (std::chrono::seconds(sec) > since)
+		--sec; //floor, so times before 1970 land in the right second
+	const auto frac = since - std::chrono::seconds(sec);
+
+	if (!hascache || sec < minutestart || sec >= minutestart + S_IN_MINUTE)
+	{
+		offset = t.zonefields(cached, zone);
+		minutestart = sec - cached[int(fmtfield::second)];
+		hascache = true;
+	}
+
+	std::copy(cached, cached + FMT_FIELDCOUNT, values);
+	values[int(fmtfield::second)] = int(sec - minutestart);
+	values[int(fmtfield::milli)] = int(std::chrono::duration_cast<std::chrono::milliseconds>(frac).count());
+	values[int(fmtfield::nano)] = int(std::chrono::duration_cast<std::chrono::nanoseconds>(frac).count());
+}
+
+//Same output as timestamp::format_to
+inline size_t timestamp_formatter::format_to(char* out, size_t cap, const timestamp& t)
+{
+	if (!out || !format.isvalid() || cap < format.maxlength())
+		return 0;
+
+	int values[FMT_FIELDCOUNT];
+	fill(t, values);
+	return size_t(format_fields(out, values, format) - out);
+}
+
+inline std::string timestamp_formatter::tostdstring(const timestamp& t)
+{
+	char buf[compiled_format::MAX_OUTPUT];
+	return std::string(buf, format_to(buf, sizeof(buf), t));
+}
+
+
+//COMPACT TYPES. One 64 bit nanosecond count each, for keeping large numbers of times in memory.
+//The range is about +-292 years around 1970. Convert to timestamp/timediff for parsing and formatting.
+class compact_timediff
+{
+	using t_nsec = std::chrono::nanoseconds;
+
+	template<class T, class R = std::ratio<1>>
+	using durtype = std::chrono::duration<T, R>;
+
+	std::int64_t nsec = 0;
+
+	template<class rtype, class R> constexpr rtype as() const { return std::chrono::duration_cast<durtype<rtype, R>>(t_nsec(nsec)).count(); }
+
+public:
+	constexpr compact_timediff() = default;
+	explicit constexpr compact_timediff(std::int64_t ns) : nsec(ns) {}
+	template<class R, class P> constexpr compact_timediff(std::chrono::duration<R, P> dur) : nsec(std::chrono::duration_cast<t_nsec>(dur).count()) {}
+	explicit constexpr compact_timediff(const timediff& rhs) : nsec((rhs.data().first + rhs.data().second).count()) {}
+
+	timediff totimediff() const { return timediff(t_nsec(nsec)); }
+	constexpr std::int64_t count() const { return nsec; }
+
+	template<class rtype> constexpr rtype asnanoseconds() const { return as<rtype, std::nano>(); }
+	template<class rtype> constexpr rtype asmicroseconds() const { return as<rtype, std::micro>(); }
+	template<class rtype> constexpr rtype asmilliseconds() const { return as<rtype, std::milli>(); }
+	template<class rtype> constexpr rtype asseconds() const { return as<rtype, std::ratio<1>>(); }
+	template<class rtype> constexpr rtype asminutes() const { return as<rtype, std::ratio<S_IN_MINUTE>>(); }
+	template<class rtype> constexpr rtype ashours() const { return as<rtype, std::ratio<S_IN_HOUR>>(); }
+	template<class rtype> constexpr rtype asdays() const { return as<rtype, std::ratio<S_IN_DAY>>(); }
+	template<class rtype> constexpr rtype asweeks() const { return as<rtype, std::ratio<S_IN_WEEK>>(); }
+
+	constexpr compact_timediff operator+(compact_timediff rhs) const { return compact_timediff(nsec + rhs.nsec); }
+	constexpr compact_timediff operator-(compact_timediff rhs) const { return compact_timediff(nsec - rhs.nsec); }
+	constexpr compact_timediff operator-() const { return compact_timediff(-nsec); }
+	constexpr compact_timediff operator*(std::int64_t rhs) const { return compact_timediff(nsec * rhs); }
+	constexpr compact_timediff operator/(std::int64_t rhs) const { return compact_timediff(nsec / rhs); }
+	constexpr compact_timediff& operator+=(compact_timediff rhs) { nsec += rhs.nsec; return *this; }
+	constexpr compact_timediff& operator-=(compact_timediff rhs) { nsec -= rhs.nsec; return *this; }
+
+	constexpr bool operator==(compact_timediff rhs) const { return nsec == rhs.nsec; }
+	constexpr bool operator!=(compact_timediff rhs) const { return nsec != rhs.nsec; }
+	constexpr bool operator<(compact_timediff rhs) const { return nsec < rhs.nsec; }
+	constexpr bool operator>(compact_timediff rhs) const { return nsec > rhs.nsec; }
+	constexpr bool operator<=(compact_timediff rhs) const { return nsec <= rhs.nsec; }
+	constexpr bool operator>=(compact_timediff rhs) const { return nsec >= rhs.nsec; }
+};
+
+//Invalid is stored as INVALID rather than a separate flag. Arithmetic doesn't check it, so check isvalid() first.
+class compact_timestamp
+{
+	using t_nsec = std::chrono::nanoseconds;
+	using t_sysclock = std::chrono::system_clock;
+
+	std::int64_t nsec = INVALID;
+
+	//Wraps instead of overflowing, so arithmetic on INVALID stays defined
+	static constexpr std::int64_t add(std::int64_t a, std::int64_t b) { return std::int64_t(std::uint64_t(a) + std::uint64_t(b)); }
+	static constexpr std::int64_t sub(std::int64_t a, std::int64_t b) { return std::int64_t(std::uint64_t(a) - std::uint64_t(b)); }
+
+public:
+	static constexpr std::int64_t INVALID = INT64_MIN;
+
+	constexpr compact_timestamp() = default;
+	//Nanoseconds since the epoch
+	explicit constexpr compact_timestamp(std::int64_t ns) : nsec(ns) {}
+	explicit constexpr compact_timestamp(const timestamp& t) : nsec(t.isvalid() ? std::chrono::duration_cast<t_nsec>(t.astimepoint().time_since_epoch()).count() : INVALID) {}
+
+	static compact_timestamp now() { return compact_timestamp(std::chrono::duration_cast<t_nsec>(t_sysclock::now().time_since_epoch()).count()); }
+	timestamp totimestamp() const { return isvalid() ? timestamp(t_sysclock::time_point(std::chrono::duration_cast<t_sysclock::duration>(t_nsec(nsec))), true) : timestamp(); }
+	constexpr bool isvalid() const { return nsec != INVALID; }
+	constexpr std::int64_t count() const { return nsec; }
+
+	constexpr compact_timediff operator-(compact_timestamp rhs) const { return compact_timediff(sub(nsec, rhs.nsec)); }
+	constexpr compact_timestamp operator+(compact_timediff rhs) const { return compact_timestamp(add(nsec, rhs.count())); }
+	constexpr compact_timestamp operator-(compact_timediff rhs) const { return compact_timestamp(sub(nsec, rhs.count())); }
+	constexpr compact_timestamp& operator+=(compact_timediff rhs) { return *this = *this + rhs; }
+	constexpr compact_timestamp& operator-=(compact_timediff rhs) { return *this = *this - rhs; }
+
+	constexpr bool operator==(compact_timestamp rhs) const { return nsec == rhs.nsec; }
+	constexpr bool operator!=(compact_timestamp rhs) const { return nsec != rhs.nsec; }
+	constexpr bool operator<(compact_timestamp rhs) const { return nsec < rhs.nsec; }
+	constexpr bool operator>(compact_timestamp rhs) const { return nsec > rhs.nsec; }
+	constexpr bool operator<=(compact_timestamp rhs) const { return nsec <= rhs.nsec; }
+	constexpr bool operator>=(compact_timestamp rhs) const { return nsec >= rhs.nsec; }
+};
+
+static_assert(sizeof(compact_timediff) == 8 && sizeof(compact_timestamp) == 8, "compact types must stay 8 bytes");
+
+
+//ROUNDING. Snapping times to a grid of fixed steps counted from the epoch, or to calendar boundaries.
+//Fixed steps are integer arithmetic on the tick count. Calendar units use the civil date math above plus, in a zone,
+//one offset lookup each way. Invalid times, and steps shorter than one tick of the time's clock, are returned unchanged.
+
+enum class calendar_unit { day, week, month, year };
+
+//Helpers for floor_to and friends: v rounded to a multiple of step, for step > 0. Halves round up.
+constexpr long long snapfloor(long long v, long long step) { return floordiv(v, step) * step; }
+constexpr long long snapceil(long long v, long long step) { return snapfloor(v, step) == v ? v : snapfloor(v, step) + step; }
+constexpr long long snapround(long long v, long long step) { return v - snapfloor(v, step) >= step - (v - snapfloor(v, step)) ? snapfloor(v, step) + step : snapfloor(v, step); }
+
+//Which step of width unit t falls in, counting from the epoch. t must be valid and unit positive.
+constexpr std::int64_t bucket_index(compact_timestamp t, compact_timediff unit) { return floordiv(t.count(), unit.count()); }
+
+constexpr compact_timestamp snapto(compact_timestamp t, compact_timediff unit, long long (*snap)(long long, long long))
+{
+	return t.isvalid() && unit.count() > 0 ? compact_timestamp(snap(t.count(), unit.count())) : t;
+}
+
+constexpr timestamp snapto(const timestamp& t, const timediff& unit, long long (*snap)(long long, long long))
+{
+	using t_dur = std::chrono::system_clock::duration;
+	const long long step = std::chrono::duration_cast<t_dur>(unit.data().first).count() + std::chrono::duration_cast<t_dur>(unit.data().second).count();
+	if (!t.isvalid() || step <= 0)
+		return t;
+	return timestamp(std::chrono::system_clock::time_point(t_dur(snap(t.astimepoint().time_since_epoch().count(), step))), true);
+}
+
+constexpr compact_timestamp floor_to(compact_timestamp t, compact_timediff unit) { return snapto(t, unit, snapfloor); }
+constexpr compact_timestamp ceil_to(compact_timestamp t, compact_timediff unit) { return snapto(t, unit, snapceil); }
+constexpr compact_timestamp round_to(compact_timestamp t, compact_timediff unit) { return snapto(t, unit, snapround); }
+constexpr timestamp floor_to(const timestamp& t, const timediff& unit) { return snapto(t, unit, snapfloor); }
+constexpr timestamp ceil_to(const timestamp& t, const timediff& unit) { return snapto(t, unit, snapceil); }
+constexpr timestamp round_to(const timestamp& t, const timediff& unit) { return snapto(t, unit, snapround); }
+
+//Start of the calendar unit holding a local time in seconds. Weeks start on Monday, as in ISO 8601.
+constexpr long long calendarfloor(long long localsec, calendar_unit unit)
+{
+	const long long day = floordiv(localsec, S_IN_DAY);
+	if (unit == calendar_unit::day)
+		return day * S_IN_DAY;
+	if (unit == calendar_unit::week)
+		return (day - (weekday_from_days(day) + 6) % 7) * S_IN_DAY;
+	const civildate c = civil_from_days(day);
+	return days_from_civil(c.year, unit == calendar_unit::month ? c.month : 1, 1) * S_IN_DAY;
+}
+
+//Start of the unit after the one starting at localstart
+constexpr long long calendarnext(long long localstart, calendar_unit unit)
+{
+	const civildate c = civil_from_days(floordiv(localstart, S_IN_DAY));
+	switch (unit)
+	{
+	case calendar_unit::day:
+		return localstart + S_IN_DAY;
+	case calendar_unit::week:
+		return localstart + S_IN_WEEK;
+	case calendar_unit::month:
+		return days_from_civil(c.year + (c.month == 12), c.month % 12 + 1, 1) * S_IN_DAY;
+	default:
+		return days_from_civil(c.year + 1, 1, 1) * S_IN_DAY;
+	}
+}
+
+//Start of the day, week, month or year holding t, at a fixed UTC offset (seconds east) or in a zone.
+//In a zone the start is the first instant of the local unit, so a day starting in a DST gap starts when the gap ends.
+constexpr compact_timestamp floor_to(compact_timestamp t, calendar_unit unit, int utcoffset = 0)
+{
+	return t.isvalid() ? compact_timestamp((calendarfloor(floordiv(t.count(), 1000000000) + utcoffset, unit) - utcoffset) * 1000000000) : t;
+}
+
+inline compact_timestamp floor_to(compact_timestamp t, calendar_unit unit, const tzone& zone)
+{
+	if (!t.isvalid())
+		return t;
+	const long long sec = floordiv(t.count(), 1000000000);
+	const long long start = calendarfloor(sec + zone.offsetat(sec), unit);
+	return compact_timestamp((start - zone.offsetfromlocal(start)) * 1000000000);
+}
+
+constexpr timestamp floor_to(const timestamp& t, calendar_unit unit, int utcoffset = 0)
+{
+	return t.isvalid() ? timestamp(std::chrono::system_clock::time_point(std::chrono::seconds(calendarfloor(
+		std::chrono::floor<std::chrono::seconds>(t.astimepoint().time_since_epoch()).count() + utcoffset, unit) - utcoffset)), true) : t;
+}
+
+inline timestamp floor_to(const timestamp& t, calendar_unit unit, const tzone& zone)
+{
+	if (!t.isvalid())
+		return t;
+	const long long sec = std::chrono::floor<std::chrono::seconds>(t.astimepoint().time_since_epoch()).count();
+	const long long start = calendarfloor(sec + zone.offsetat(sec), unit);
+	return timestamp(std::chrono::system_clock::time_point(std::chrono::seconds(start - zone.offsetfromlocal(start))), true);
+}
+
+//Shorthands for timestamp or compact_timestamp, with an offset or a zone
+template<class T, class Z = int> constexpr T floor_to_day(const T& t, const Z& zone = 0) { return floor_to(t, calendar_unit::day, zone); }
+template<class T, class Z = int> constexpr T floor_to_week(const T& t, const Z& zone = 0) { return floor_to(t, calendar_unit::week, zone); }
+template<class T, class Z = int> constexpr T floor_to_month(const T& t, const Z& zone = 0) { return floor_to(t, calendar_unit::month, zone); }
+template<class T, class Z = int> constexpr T floor_to_year(const T& t, const Z& zone = 0) { return floor_to(t, calendar_unit::year, zone); }
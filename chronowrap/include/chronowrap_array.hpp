@@ -0,0 +1,410 @@
+#pragma once
+
+#include "chronowrap.hpp"
+
+//Column storage for large numbers of times: one int64 nanosecond column plus a validity bitmap, the same values
+//compact_timestamp and compact_timediff hold. Invalid entries always store 0, so sums and differences never need masking.
+//Bulk operations walk the column 64 entries per bitmap word. Fully valid words take a plain loop over the values that
+//the compiler vectorizes, the rest are masked entry by entry.
+
+//Batch rounding kernels over raw nanosecond counts or compact_timestamps. INVALID entries pass through, as do entries
+//whose bit is clear in validbits when it's given, e.g. the 0s a time_column stores for invalid entries.
+//A run of times in the same step, as in a sorted series, works the step out once and then only compares against it.
+inline std::int64_t nsof(std::int64_t ns) { return ns; }
+inline std::int64_t nsof(const compact_timestamp& t) { return t.count(); }
+inline bool isskipped(std::int64_t v, size_t i, const std::uint64_t* validbits)
+{
+	return validbits ? !((validbits[i / 64] >> (i % 64)) & 1) : v == compact_timestamp::INVALID;
+}
+
+//The part of tzone snapcalendar uses, for a fixed offset without building a zone
+struct fixedoffset
+{
+	int utcoffset;
+	int offsetat(long long) const { return utcoffset; }
+	int offsetfromlocal(long long) const { return utcoffset; }
+};
+
+template<class T, class Snap>
+inline void snapall(const T* in, T* out, size_t n, std::int64_t step, Snap snap, const std::uint64_t* validbits = nullptr)
+{
+	std::int64_t lo = 0;
+	bool have = false;
+	for (size_t i = 0; i < n; ++i)
+	{
+		const std::int64_t v = nsof(in[i]);
+		if (step <= 0 || isskipped(v, i, validbits))
+		{
+			out[i] = in[i];
+			continue;
+		}
+		if (!have || std::uint64_t(v) - std::uint64_t(lo) >= std::uint64_t(step))
+		{
+			lo = snapfloor(v, step);
+			have = true;
+		}
+		out[i] = T(snap(v, lo, step));
+	}
+}
+
+template<class T, class Zone>
+inline void snapcalendar(const T* in, T* out, size_t n, calendar_unit unit, const Zone& zone, const std::uint64_t* validbits = nullptr)
+{
+	std::int64_t lo = 0, hi = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		const std::int64_t v = nsof(in[i]);
+		if (isskipped(v, i, validbits))
+		{
+			out[i] = in[i];
+			continue;
+		}
+		if (v < lo || v >= hi)
+		{
+			const long long sec = floordiv(v, 1000000000);
+			const long long start = calendarfloor(sec + zone.offsetat(sec), unit);
+			const long long next = calendarnext(start, unit);
+			lo = (start - zone.offsetfromlocal(start)) * 1000000000;
+			hi = (next - zone.offsetfromlocal(next)) * 1000000000;
+		}
+		out[i] = T(lo);
+	}
+}
+
+inline std::int64_t ceilfromfloor(std::int64_t v, std::int64_t lo, std::int64_t step) { return v == lo ? v : lo + step; }
+inline std::int64_t roundfromfloor(std::int64_t v, std::int64_t lo, std::int64_t step) { return v - lo >= step - (v - lo) ? lo + step : lo; }
+
+//Batch versions of floor_to, ceil_to and round_to. in and out may be the same array.
+inline void floor_to(const compact_timestamp* in, compact_timestamp* out, size_t n, const compact_timediff& unit)
+{
+	snapall(in, out, n, unit.count(), [](std::int64_t, std::int64_t lo, std::int64_t) { return lo; });
+}
+inline void ceil_to(const compact_timestamp* in, compact_timestamp* out, size_t n, const compact_timediff& unit) { snapall(in, out, n, unit.count(), ceilfromfloor); }
+inline void round_to(const compact_timestamp* in, compact_timestamp* out, size_t n, const compact_timediff& unit) { snapall(in, out, n, unit.count(), roundfromfloor); }
+inline void floor_to(const compact_timestamp* in, compact_timestamp* out, size_t n, calendar_unit unit, const tzone& zone) { snapcalendar(in, out, n, unit, zone); }
+inline void floor_to(const compact_timestamp* in, compact_timestamp* out, size_t n, calendar_unit unit, int utcoffset = 0) { snapcalendar(in, out, n, unit, fixedoffset{ utcoffset }); }
+
+class time_column
+{
+protected:
+	static const std::uint64_t ALLVALID = ~std::uint64_t(0);
+
+	std::vector<std::int64_t> values;
+	std::vector<std::uint64_t> validbits;
+
+	void pushraw(std::int64_t value, bool valid)
+	{
+		if (values.size() % 64 == 0)
+			validbits.push_back(0);
+		validbits.back() |= std::uint64_t(valid) << (values.size() % 64);
+		values.push_back(valid ? value : 0);
+	}
+	void setraw(size_t i, std::int64_t value, bool valid)
+	{
+		const std::uint64_t bit = std::uint64_t(1) << (i % 64);
+		validbits[i / 64] = valid ? validbits[i / 64] | bit : validbits[i / 64] & ~bit;
+		values[i] = valid ? value : 0;
+	}
+	void resizeraw(size_t count)
+	{
+		values.resize(count, 0);
+		validbits.resize((count + 63) / 64, 0);
+	}
+	//All ones for valid entries, 0 otherwise
+	static std::int64_t entrymask(std::uint64_t word, size_t bit) { return -std::int64_t((word >> bit) & 1); }
+	static int popcount(std::uint64_t w)
+	{
+		w = w - ((w >> 1) & 0x5555555555555555ULL);
+		w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+		w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+		return int((w * 0x0101010101010101ULL) >> 56);
+	}
+
+	//Smallest and largest valid value. Returns false if there are none.
+	bool minmax(std::int64_t& lo, std::int64_t& hi) const;
+	//out[i] = a[i] - b[i] where bits are set, 0 elsewhere
+	static void blend(std::int64_t* out, const std::int64_t* a, const std::int64_t* b, size_t begin, size_t end, std::uint64_t bits);
+	//Pairwise a - b into out, valid where both are
+	static void subtract(const time_column& a, const time_column& b, time_column& out);
+	//Adds delta to every valid entry
+	void addall(std::int64_t delta);
+
+public:
+	size_t size() const { return values.size(); }
+	bool empty() const { return values.empty(); }
+	void reserve(size_t count) { values.reserve(count); validbits.reserve((count + 63) / 64); }
+	void clear() { values.clear(); validbits.clear(); }
+
+	bool isvalid(size_t i) const { return (validbits[i / 64] >> (i % 64)) & 1; }
+	size_t validcount() const;
+
+	//Raw columns. Bit i % 64 of validity()[i / 64] is set if entry i is valid.
+	const std::int64_t* data() const { return values.data(); }
+	const std::uint64_t* validity() const { return validbits.data(); }
+};
+
+class timediff_array : public time_column
+{
+	friend class timestamp_array;
+
+	template<class rtype, class R> std::vector<rtype> as() const
+	{
+		std::vector<rtype> ret(values.size());
+		for (size_t i = 0; i < values.size(); ++i)
+			ret[i] = std::chrono::duration_cast<std::chrono::duration<rtype, R>>(std::chrono::nanoseconds(values[i])).count();
+		return ret;
+	}
+
+public:
+	timediff_array() = default;
+	explicit timediff_array(size_t count) { resizeraw(count); }
+
+	void push_back(const compact_timediff& t) { pushraw(t.count(), true); }
+	void push_back(const timediff& t) { push_back(compact_timediff(t)); }
+	void push_invalid() { pushraw(0, false); }
+	void set(size_t i, const compact_timediff& t) { setraw(i, t.count(), true); }
+	void setinvalid(size_t i) { setraw(i, 0, false); }
+	//0 for invalid entries
+	compact_timediff operator[](size_t i) const { return compact_timediff(values[i]); }
+
+	//Invalid entries count as 0
+	compact_timediff sum() const;
+	//Over valid entries. 0 if there are none.
+	compact_timediff min() const;
+	compact_timediff max() const;
+
+	timediff_array& operator+=(const compact_timediff& rhs) { addall(rhs.count()); return *this; }
+	timediff_array& operator-=(const compact_timediff& rhs) { addall(-rhs.count()); return *this; }
+
+	//Whole column unit conversions, same rounding as timediff. Invalid entries convert to 0.
+	template<class rtype> std::vector<rtype> asnanoseconds() const { return as<rtype, std::nano>(); }
+	template<class rtype> std::vector<rtype> asmicroseconds() const { return as<rtype, std::micro>(); }
+	template<class rtype> std::vector<rtype> asmilliseconds() const { return as<rtype, std::milli>(); }
+	template<class rtype> std::vector<rtype> asseconds() const { return as<rtype, std::ratio<1>>(); }
+	template<class rtype> std::vector<rtype> asminutes() const { return as<rtype, std::ratio<S_IN_MINUTE>>(); }
+	template<class rtype> std::vector<rtype> ashours() const { return as<rtype, std::ratio<S_IN_HOUR>>(); }
+	template<class rtype> std::vector<rtype> asdays() const { return as<rtype, std::ratio<S_IN_DAY>>(); }
+	template<class rtype> std::vector<rtype> asweeks() const { return as<rtype, std::ratio<S_IN_WEEK>>(); }
+};
+
+class timestamp_array : public time_column
+{
+public:
+	timestamp_array() = default;
+	//count invalid entries
+	explicit timestamp_array(size_t count) { resizeraw(count); }
+
+	void push_back(const compact_timestamp& t) { pushraw(t.count(), t.isvalid()); }
+	void push_back(const timestamp& t) { push_back(compact_timestamp(t)); }
+	void set(size_t i, const compact_timestamp& t) { setraw(i, t.count(), t.isvalid()); }
+	void set(size_t i, const timestamp& t) { set(i, compact_timestamp(t)); }
+	compact_timestamp operator[](size_t i) const { return isvalid(i) ? compact_timestamp(values[i]) : compact_timestamp(); }
+
+	//Over valid entries. Invalid if there are none.
+	compact_timestamp min() const;
+	compact_timestamp max() const;
+
+	//Shifts every valid entry. Invalid entries stay invalid.
+	timestamp_array& operator+=(const compact_timediff& rhs) { addall(rhs.count()); return *this; }
+	timestamp_array& operator-=(const compact_timediff& rhs) { addall(-rhs.count()); return *this; }
+	timestamp_array& operator+=(const timediff& rhs) { return *this += compact_timediff(rhs); }
+	timestamp_array& operator-=(const timediff& rhs) { return *this -= compact_timediff(rhs); }
+
+	//Elementwise this[i] - rhs[i]. The arrays must be the same size. Valid where both entries are.
+	timediff_array operator-(const timestamp_array& rhs) const;
+	//this[i + 1] - this[i], one shorter than the array. Valid where both entries are.
+	timediff_array deltas() const;
+	//Same as above, reusing out's storage so repeated calls don't allocate
+	void difference(const timestamp_array& rhs, timediff_array& out) const { subtract(*this, rhs, out); }
+	void deltas(timediff_array& out) const;
+
+	//Rounds every valid entry in place, as the scalar floor_to, ceil_to and round_to do. Fastest on sorted columns.
+	void floor_to(const compact_timediff& unit);
+	void ceil_to(const compact_timediff& unit);
+	void round_to(const compact_timediff& unit);
+	void floor_to(calendar_unit unit, const tzone& zone);
+	void floor_to(calendar_unit unit, int utcoffset = 0);
+};
+
+inline size_t time_column::validcount() const
+{
+	size_t count = 0;
+	for (std::uint64_t w : validbits)
+		count += popcount(w);
+	return count;
+}
+
+inline bool time_column::minmax(std::int64_t& lo, std::int64_t& hi) const
+{
+	lo = INT64_MAX;
+	hi = INT64_MIN;
+	bool any = false;
+	const std::int64_t* v = values.data();
+	for (size_t word = 0; word < validbits.size();)
+	{
+		const std::uint64_t bits = validbits[word];
+		const size_t base = word * 64;
+		if (bits == ALLVALID)
+		{
+			//Reduce the whole run of valid words in one loop, so there's one horizontal step per run rather than per word
+			size_t last = word + 1;
+			while (last < validbits.size() && validbits[last] == ALLVALID)
+				++last;
+			for (size_t i = base; i < last * 64; ++i)
+				lo = std::min(lo, v[i]);
+			for (size_t i = base; i < last * 64; ++i)
+				hi = std::max(hi, v[i]);
+			any = true;
+			word = last;
+			continue;
+		}
+		for (size_t bit = 0; bit < 64 && (bits >> bit); ++bit)
+			if ((bits >> bit) & 1)
+			{
+				lo = std::min(lo, v[base + bit]);
+				hi = std::max(hi, v[base + bit]);
+				any = true;
+			}
+		++word;
+	}
+	return any;
+}
+
+inline void time_column::subtract(const time_column& a, const time_column& b, time_column& out)
+{
+	assert(a.size() == b.size());
+	out.resizeraw(a.size());
+	const std::int64_t* va = a.values.data();
+	const std::int64_t* vb = b.values.data();
+	std::int64_t* vo = out.values.data();
+	for (size_t word = 0; word < out.validbits.size(); ++word)
+	{
+		const std::uint64_t bits = a.validbits[word] & b.validbits[word];
+		const size_t base = word * 64;
+		out.validbits[word] = bits;
+		if (bits == ALLVALID)
+			for (size_t i = base; i < base + 64; ++i)
+				vo[i] = std::int64_t(std::uint64_t(va[i]) - std::uint64_t(vb[i]));
+		else
+			blend(vo, va, vb, base, std::min(out.values.size(), base + 64), bits);
+	}
+}
+
+inline void time_column::blend(std::int64_t* out, const std::int64_t* a, const std::int64_t* b, size_t begin, size_t end, std::uint64_t bits)
+{
+	for (size_t i = begin; i < end; ++i)
+		out[i] = std::int64_t(std::uint64_t(a[i]) - std::uint64_t(b[i])) & entrymask(bits, i % 64);
+}
+
+inline void time_column::addall(std::int64_t delta)
+{
+	std::int64_t* v = values.data();
+	for (size_t word = 0; word < validbits.size(); ++word)
+	{
+		const std::uint64_t bits = validbits[word];
+		const size_t base = word * 64;
+		if (bits == ALLVALID)
+			for (size_t i = base; i < base + 64; ++i)
+				v[i] += delta;
+		else
+			for (size_t i = base, end = std::min(values.size(), base + 64); i < end; ++i)
+				v[i] += delta & entrymask(bits, i % 64);
+	}
+}
+
+inline compact_timediff timediff_array::sum() const
+{
+	//Invalid entries hold 0, so no masking
+	const std::int64_t* v = values.data();
+	std::int64_t total = 0;
+	for (size_t i = 0; i < values.size(); ++i)
+		total += v[i];
+	return compact_timediff(total);
+}
+
+inline compact_timediff timediff_array::min() const
+{
+	std::int64_t lo, hi;
+	return compact_timediff(minmax(lo, hi) ? lo : 0);
+}
+
+inline compact_timediff timediff_array::max() const
+{
+	std::int64_t lo, hi;
+	return compact_timediff(minmax(lo, hi) ? hi : 0);
+}
+
+inline compact_timestamp timestamp_array::min() const
+{
+	std::int64_t lo, hi;
+	return minmax(lo, hi) ? compact_timestamp(lo) : compact_timestamp();
+}
+
+inline compact_timestamp timestamp_array::max() const
+{
+	std::int64_t lo, hi;
+	return minmax(lo, hi) ? compact_timestamp(hi) : compact_timestamp();
+}
+
+inline timediff_array timestamp_array::operator-(const timestamp_array& rhs) const
+{
+	timediff_array ret;
+	subtract(*this, rhs, ret);
+	return ret;
+}
+
+inline timediff_array timestamp_array::deltas() const
+{
+	timediff_array ret;
+	deltas(ret);
+	return ret;
+}
+
+inline void timestamp_array::deltas(timediff_array& ret) const
+{
+	const size_t count = values.empty() ? 0 : values.size() - 1;
+	ret.resizeraw(count);
+	const std::int64_t* v = values.data();
+	std::int64_t* out = ret.values.data();
+	//Entry i needs bits i and i + 1, so AND each word with itself shifted down one, pulling in the next word's low bit
+	for (size_t word = 0; word < ret.validbits.size(); ++word)
+	{
+		const std::uint64_t next = word + 1 < validbits.size() ? validbits[word + 1] : 0;
+		std::uint64_t bits = validbits[word] & ((validbits[word] >> 1) | (next << 63));
+		if (word + 1 == ret.validbits.size() && count % 64)
+			bits &= (std::uint64_t(1) << (count % 64)) - 1;
+		const size_t base = word * 64;
+		ret.validbits[word] = bits;
+		if (bits == ALLVALID)
+			for (size_t i = base; i < base + 64; ++i)
+				out[i] = std::int64_t(std::uint64_t(v[i + 1]) - std::uint64_t(v[i]));
+		else
+			blend(out, v + 1, v, base, std::min(count, base + 64), bits);
+	}
+}
+
+//Invalid entries are skipped by their bits, so they keep their 0 and don't reset the kernels' cached step
+inline void timestamp_array::floor_to(const compact_timediff& unit)
+{
+	snapall(values.data(), values.data(), values.size(), unit.count(), [](std::int64_t, std::int64_t lo, std::int64_t) { return lo; }, validbits.data());
+}
+
+inline void timestamp_array::ceil_to(const compact_timediff& unit)
+{
+	snapall(values.data(), values.data(), values.size(), unit.count(), ceilfromfloor, validbits.data());
+}
+
+inline void timestamp_array::round_to(const compact_timediff& unit)
+{
+	snapall(values.data(), values.data(), values.size(), unit.count(), roundfromfloor, validbits.data());
+}
+
+inline void timestamp_array::floor_to(calendar_unit unit, const tzone& zone)
+{
+	snapcalendar(values.data(), values.data(), values.size(), unit, zone, validbits.data());
+}
+
+inline void timestamp_array::floor_to(calendar_unit unit, int utcoffset)
+{
+	snapcalendar(values.data(), values.data(), values.size(), unit, fixedoffset{ utcoffset }, validbits.data());
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "chronowrap.hpp"
+
+#include <condition_variable>
+#include <thread>
+
+#if defined(__linux__)
+#include <time.h>
+#endif
+
+//A clock for callers that only need "now" to about a millisecond, like TTLs and log stamps.
+//A background thread writes the time into a cache line of its own every period, so reading it is one relaxed load.
+//Staleness is best-effort: now() trails the source by the time since the last tick, about maxstaleness() when the OS
+//runs the ticker on time, but with no hard bound if it doesn't. maxlag() reports the worst gap between ticks seen so far,
+//so the staleness observed up to the last tick is at most maxlag() plus the source's resolution. Stopped clocks return invalid times.
+class coarse_clock
+{
+	using t_nsec = std::chrono::nanoseconds;
+	using t_sysclock = std::chrono::system_clock;
+
+public:
+	enum class source
+	{
+		system,         //system_clock::now()
+		realtime_coarse //CLOCK_REALTIME_COARSE on Linux, the kernel's tick time. Falls back to system elsewhere.
+	};
+
+private:
+	alignas(64) std::atomic<std::int64_t> current{ compact_timestamp::INVALID };
+	alignas(64) t_nsec period;
+	source src;
+	std::atomic<std::int64_t> worstlag{ 0 };
+	std::thread ticker;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	std::int64_t read() const;
+	void run();
+
+public:
+	explicit coarse_clock(t_nsec tickperiod = std::chrono::milliseconds(1), source from = source::system) : period(tickperiod), src(from) {}
+	coarse_clock(const coarse_clock&) = delete;
+	coarse_clock& operator=(const coarse_clock&) = delete;
+	~coarse_clock() { stop(); }
+
+	//The first tick is taken before start() returns, so now() is valid straight away
+	void start();
+	void stop();
+	bool isrunning() const { return ticker.joinable(); }
+
+	compact_timestamp nowcompact() const { return compact_timestamp(current.load(std::memory_order_relaxed)); }
+	timestamp now() const { return nowcompact().totimestamp(); }
+
+	//Tick period plus the source's own resolution: the staleness to expect while ticks are on time, not a guarantee
+	t_nsec maxstaleness() const;
+	//Largest gap between two ticks seen so far, in source time
+	t_nsec maxlag() const { return t_nsec(worstlag.load(std::memory_order_relaxed)); }
+};
+
+inline std::int64_t coarse_clock::read() const
+{
+#if defined(__linux__) && defined(CLOCK_REALTIME_COARSE)
+	if (src == source::realtime_coarse)
+	{
+		timespec ts;
+		clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+		return std::int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+#endif
+	return std::chrono::duration_cast<t_nsec>(t_sysclock::now().time_since_epoch()).count();
+}
+
+inline coarse_clock::t_nsec coarse_clock::maxstaleness() const
+{
+#if defined(__linux__) && defined(CLOCK_REALTIME_COARSE)
+	if (src == source::realtime_coarse)
+	{
+		timespec res;
+		clock_getres(CLOCK_REALTIME_COARSE, &res);
+		return period + t_nsec(std::int64_t(res.tv_sec) * 1000000000 + res.tv_nsec);
+	}
+#endif
+	return period + std::chrono::duration_cast<t_nsec>(t_sysclock::duration(1));
+}
+
+inline void coarse_clock::start()
+{
+	if (isrunning())
+		return;
+	stopping = false;
+	current.store(read(), std::memory_order_relaxed);
+	ticker = std::thread(&coarse_clock::run, this);
+}
+
+inline void coarse_clock::stop()
+{
+	if (!isrunning())
+		return;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	ticker.join();
+	current.store(compact_timestamp::INVALID, std::memory_order_relaxed);
+}
+
+inline void coarse_clock::run()
+{
+	//Deadlines are absolute so a late wake up doesn't push back every tick after it
+	auto next = std::chrono::steady_clock::now();
+	std::int64_t previous = current.load(std::memory_order_relaxed);
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;)
+	{
+		next += period;
+		if (wake.wait_until(guard, next, [this] { return stopping; }))
+			return;
+
+		//Measured between the values published, so it bounds how far behind a reader can have been
+		const std::int64_t value = read();
+		current.store(value, std::memory_order_relaxed);
+		if (value - previous > worstlag.load(std::memory_order_relaxed))
+			worstlag.store(value - previous, std::memory_order_relaxed);
+		previous = value;
+		const auto ticked = std::chrono::steady_clock::now();
+		//Overslept by more than a period: skip the missed ticks rather than firing them back to back
+		if (ticked - next > period)
+			next = ticked;
+	}
+}
@@ -0,0 +1,336 @@
+#pragma once
+
+#include "chronowrap_simd.hpp"
+
+//Recognizes which of the common timestamp layouts a string is in, so feeds that mix them can be parsed without knowing
+//the format up front:
+//	iso8601        2018-07-14T22:14:35.243     'T', 't' or ' ' between date and time, optional fraction, in the parser's zone
+//	rfc3339        2018-07-14T22:14:35.243Z    iso8601 ending in Z or a +hh:mm offset
+//	rfc2822        Sat, 14 Jul 2018 22:14:35 +0000
+//	syslog         Jul 14 22:14:35             in the parser's zone, in a year the caller supplies
+//	epoch_seconds  1531606475
+//	epoch_millis   1531606475243
+//Detection classifies the first 32 bytes at once into digit and letter masks, so picking a layout costs a couple of
+//mask compares and a few byte checks, not a parse attempt per layout.
+//
+//	auto_parser parser;
+//	timestamp t;
+//	if (parser.parse(line, t)) ...
+//	if (parser.detectcount() > 1) //the feed changed layout at least once
+
+enum class time_layout : unsigned char { unknown, iso8601, rfc3339, rfc2822, syslog, epoch_seconds, epoch_millis };
+
+inline const char* layoutname(time_layout layout)
+{
+	static const char* const names[] = { "unknown", "iso8601", "rfc3339", "rfc2822", "syslog", "epoch_seconds", "epoch_millis" };
+	return names[int(layout)];
+}
+
+struct detected_format
+{
+	time_layout layout = time_layout::unknown;
+	const compiled_format* format = nullptr; //the date and time part, for iso8601 and rfc3339
+	bool fraction = false;                   //format ends in a fraction
+	explicit operator bool() const { return layout != time_layout::unknown; }
+};
+
+//Picks the layout of sample, or unknown. Only looks at the shape, so the sample can still fail to parse.
+inline detected_format detect_format(std::string_view sample);
+
+//Parses a string in a detected layout. zone applies to the layouts without an offset, and year to syslog.
+inline bool parse_detected(std::string_view tstamp, const detected_format& format, timestamp& out, const tzone& zone, int year);
+
+//Per stream parser that remembers the last layout that worked. Strings are parsed in that layout first, and
+//detected again only when it fails, so a steady feed pays for detection once. Not thread safe, use one per stream.
+class auto_parser
+{
+	detected_format current;
+	tzone zone;
+	int year;
+	std::uint64_t detections = 0;
+	std::uint64_t failures = 0;
+
+public:
+	//syslogyear 0 uses the current UTC year
+	explicit auto_parser(const tzone& z = tzone::local(), int syslogyear = 0);
+
+	bool parse(std::string_view tstamp, timestamp& out);
+
+	//The layout in use, for monitoring drift
+	const detected_format& format() const { return current; }
+	//Times a new layout was picked, including the first. More than one means the stream changed layout.
+	std::uint64_t detectcount() const { return detections; }
+	//Strings that didn't parse in any layout
+	std::uint64_t failcount() const { return failures; }
+	void reset()
+	{
+		current = detected_format();
+		detections = 0;
+		failures = 0;
+	}
+};
+
+//Date and time parts of the ISO 8601 layouts. Inline, so every translation unit shares one of each.
+inline constexpr compiled_format ISO_T("%Y-%M-%dT%H:%m:%s");
+inline constexpr compiled_format ISO_T_FRACTION("%Y-%M-%dT%H:%m:%s.%f");
+inline constexpr compiled_format ISO_LOWER_T("%Y-%M-%dt%H:%m:%s");
+inline constexpr compiled_format ISO_LOWER_T_FRACTION("%Y-%M-%dt%H:%m:%s.%f");
+inline constexpr compiled_format ISO_SPACE("%Y-%M-%d %H:%m:%s");
+inline constexpr compiled_format ISO_SPACE_FRACTION("%Y-%M-%d %H:%m:%s.%f");
+
+//Bit i set if byte i is a digit, or a letter
+struct byte_classes
+{
+	std::uint32_t digits;
+	std::uint32_t letters;
+};
+
+//Classifies 32 bytes, which must all be readable
+inline byte_classes classifybytes(const char* p)
+{
+	byte_classes ret;
+#ifdef CHRONOWRAP_X86
+	//SSE2 is part of every x86-64 target, so this needs no dispatch
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i lower = _mm_set1_epi8(0x20);
+	const __m128i a = _mm_set1_epi8('a');
+	const __m128i z = _mm_set1_epi8(25);
+	std::uint32_t masks[2][2];
+	for (int half = 0; half < 2; ++half)
+	{
+		const __m128i bytes = _mm_loadu_si128((const __m128i*)(p + half * 16));
+		//Unsigned x - lo <= hi - lo, as min(x - lo, hi - lo) == x - lo
+		const __m128i d = _mm_sub_epi8(bytes, zero);
+		const __m128i l = _mm_sub_epi8(_mm_or_si128(bytes, lower), a);
+		masks[half][0] = std::uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, nine), d)));
+		masks[half][1] = std::uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(l, z), l)));
+	}
+	ret.digits = masks[0][0] | masks[1][0] << 16;
+	ret.letters = masks[0][1] | masks[1][1] << 16;
+#else
+	ret.digits = 0;
+	ret.letters = 0;
+	for (int i = 0; i < 32; ++i)
+	{
+		ret.digits |= std::uint32_t(unsigned(p[i] - '0') <= 9) << i;
+		ret.letters |= std::uint32_t(unsigned((p[i] | 0x20) - 'a') <= 25) << i;
+	}
+#endif
+	return ret;
+}
+
+//Bits first through last
+constexpr std::uint32_t bitrange(int first, int last) { return (last >= 31 ? ~0u : (1u << (last + 1)) - 1) & ~((1u << first) - 1); }
+constexpr std::uint32_t bitsof(std::initializer_list<int> bits)
+{
+	std::uint32_t ret = 0;
+	for (int b : bits)
+		ret |= 1u << b;
+	return ret;
+}
+
+inline detected_format detect_format(std::string_view sample)
+{
+	//Never read past the caller's string
+	char b[32] = {};
+	const size_t len = sample.size();
+	memcpy(b, sample.data(), std::min<size_t>(len, sizeof(b)));
+	const byte_classes c = classifybytes(b);
+	auto has = [](std::uint32_t mask, std::uint32_t bits) { return (mask & bits) == bits; };
+
+	detected_format ret;
+	if (!len)
+		return ret;
+
+	//All digits
+	if (len <= 14 && c.digits == bitrange(0, int(len) - 1))
+	{
+		ret.layout = len <= 11 ? time_layout::epoch_seconds : time_layout::epoch_millis;
+		return ret;
+	}
+
+	//YYYY-MM-DD?HH:MM:SS
+	static constexpr std::uint32_t ISO_DIGITS = bitsof({ 0, 1, 2, 3, 5, 6, 8, 9, 11, 12, 14, 15, 17, 18 });
+	if (len >= 19 && has(c.digits, ISO_DIGITS) && b[4] == '-' && b[7] == '-' && (b[10] == 'T' || b[10] == 't' || b[10] == ' ') && b[13] == ':' && b[16] == ':')
+	{
+		const bool fraction = len >= 21 && b[19] == '.';
+		const char last = sample[len - 1];
+		const bool offset = last == 'Z' || last == 'z' || (len >= 25 && (sample[len - 6] == '+' || sample[len - 6] == '-') && sample[len - 3] == ':');
+		ret.layout = offset ? time_layout::rfc3339 : time_layout::iso8601;
+		ret.fraction = fraction;
+		if (b[10] == 'T')
+			ret.format = fraction ? &ISO_T_FRACTION : &ISO_T;
+		else if (b[10] == 't')
+			ret.format = fraction ? &ISO_LOWER_T_FRACTION : &ISO_LOWER_T;
+		else
+			ret.format = fraction ? &ISO_SPACE_FRACTION : &ISO_SPACE;
+		return ret;
+	}
+
+	//Mmm dD HH:MM:SS, the day space padded
+	static constexpr std::uint32_t SYSLOG_DIGITS = bitsof({ 5, 7, 8, 10, 11, 13, 14 });
+	if (len >= 15 && has(c.letters, bitrange(0, 2)) && has(c.digits, SYSLOG_DIGITS) && b[3] == ' ' && (b[4] == ' ' || (c.digits & 1u << 4))
+		&& b[6] == ' ' && b[9] == ':' && b[12] == ':')
+	{
+		ret.layout = time_layout::syslog;
+		return ret;
+	}
+
+	//[Www, ]D[D] Mmm YYYY HH:MM
+	size_t day = has(c.letters, bitrange(0, 2)) && b[3] == ',' && b[4] == ' ' ? 5 : 0;
+	if (day + 2 < 32 && (c.digits & 1u << day))
+	{
+		const size_t month = day + ((c.digits & 1u << (day + 1)) ? 3 : 2);
+		if (month + 3 < 32 && b[month - 1] == ' ' && has(c.letters, bitrange(int(month), int(month) + 2)) && b[month + 3] == ' ')
+			ret.layout = time_layout::rfc2822;
+	}
+	return ret;
+}
+
+//Z or [+-]hh:mm at the end of an rfc3339 string, removed from s
+inline bool rfc3339offset(std::string_view& s, int& utcoffset)
+{
+	if (!s.empty() && (s.back() == 'Z' || s.back() == 'z'))
+	{
+		utcoffset = 0;
+		s.remove_suffix(1);
+		return true;
+	}
+	if (s.size() < 6 || s[s.size() - 3] != ':')
+		return false;
+	const char* p = s.data() + s.size() - 6;
+	int hours, minutes;
+	if ((*p != '+' && *p != '-') || !parse_bounded(p + 1, p + 3, 2, 2, 0, 23, hours) || !parse_bounded(p + 4, p + 6, 2, 2, 0, 59, minutes))
+		return false;
+	utcoffset = (*p == '-' ? -1 : 1) * (hours * S_IN_HOUR + minutes * S_IN_MINUTE);
+	s.remove_suffix(6);
+	return true;
+}
+
+inline bool parse_detected(std::string_view tstamp, const detected_format& format, timestamp& out, const tzone& zone, int year)
+{
+	const char* s = tstamp.data();
+	const char* const end = s + tstamp.size();
+	switch (format.layout)
+	{
+	case time_layout::iso8601:
+	case time_layout::rfc3339:
+	{
+		if (!format.format)
+			return false;
+		int utcoffset = 0;
+		if (format.layout == time_layout::rfc3339 && !rfc3339offset(tstamp, utcoffset))
+			return false;
+		//The compiled formats stop at the end of the fraction, so check nothing follows it
+		int ignored;
+		if (format.fraction ? tstamp.size() < 21 || tstamp[19] != '.' || parse_digits(tstamp.data() + 20, tstamp.data() + tstamp.size(), 1, 9, ignored).ptr != tstamp.data() + tstamp.size()
+			: tstamp.size() != 19)
+			return false;
+		return format.layout == time_layout::rfc3339 ? out.fromstring(tstamp, *format.format, utcoffset) : out.fromstring(tstamp, *format.format, zone);
+	}
+	case time_layout::epoch_seconds:
+	case time_layout::epoch_millis:
+	{
+		//The same lengths detect_format sorts them by, so a cached layout doesn't misread the other's strings
+		const int digits = int(end - s);
+		if (format.layout == time_layout::epoch_seconds ? digits < 1 || digits > 11 : digits < 12 || digits > 14)
+			return false;
+		int high = 0, low;
+		//Split so each half fits an int: everything but the last 7 digits, then the last 7
+		if ((digits > 7 && !parse_fixed(s, end - 7, digits - 7, high)) || !parse_fixed(end - std::min(digits, 7), end, std::min(digits, 7), low))
+			return false;
+		const std::int64_t value = std::int64_t(high) * 10000000 + low;
+		out = compact_timestamp(value * (format.layout == time_layout::epoch_seconds ? 1000000000 : 1000000)).totimestamp();
+		return true;
+	}
+	case time_layout::syslog:
+	{
+		civiltime c = { year, 0, 0, 0, 0, 0, 0 };
+		field_result r = parse_monthabbr(s, end, c.month);
+		if (!r || end - r.ptr != 12 || *r.ptr != ' ')
+			return false;
+		s = r.ptr + 1;
+		//Space padded day
+		if (!(*s == ' ' ? parse_bounded(s + 1, end, 1, 1, 1, 9, c.day) : parse_bounded(s, end, 2, 2, 1, 31, c.day)) || c.day > days_in_month(c.year, c.month))
+			return false;
+		s += 2;
+		if (*s != ' ' || !parse_bounded(s + 1, end, 2, 2, 0, 23, c.hour) || s[3] != ':' || !parse_bounded(s + 4, end, 2, 2, 0, 59, c.minute)
+			|| s[6] != ':' || !parse_bounded(s + 7, end, 2, 2, 0, 59, c.second))
+			return false;
+		const long long localsec = days_from_civil(c.year, c.month, c.day) * S_IN_DAY + c.hour * S_IN_HOUR + c.minute * S_IN_MINUTE + c.second;
+		out = timestamp::from_civil(c, zone.offsetfromlocal(localsec));
+		return true;
+	}
+	case time_layout::rfc2822:
+	{
+		civiltime c = { 0, 0, 0, 0, 0, 0, 0 };
+		//The weekday is redundant, so it's skipped rather than checked
+		if (end - s > 5 && s[3] == ',')
+			s += 5;
+		field_result r = parse_bounded(s, end, 1, 2, 1, 31, c.day);
+		if (!r || r.ptr == end || *r.ptr != ' ')
+			return false;
+		r = parse_monthabbr(r.ptr + 1, end, c.month);
+		if (!r || r.ptr == end || *r.ptr != ' ')
+			return false;
+		r = parse_fixed(r.ptr + 1, end, 4, c.year);
+		if (!r || end - r.ptr < 6 || *r.ptr != ' ' || c.day > days_in_month(c.year, c.month))
+			return false;
+		s = r.ptr + 1;
+		if (!parse_bounded(s, end, 2, 2, 0, 23, c.hour) || s[2] != ':' || !parse_bounded(s + 3, end, 2, 2, 0, 59, c.minute))
+			return false;
+		s += 5;
+		//Seconds are optional
+		if (s < end && *s == ':')
+		{
+			if (!parse_bounded(s + 1, end, 2, 2, 0, 60, c.second))
+				return false;
+			//A leap second is held as the last one of the minute
+			c.second = std::min(c.second, 59);
+			s += 3;
+		}
+		if (s == end || *s++ != ' ')
+			return false;
+		int utcoffset = 0;
+		const std::string_view zonename(s, size_t(end - s));
+		if (zonename.size() == 5 && (*s == '+' || *s == '-'))
+		{
+			int hours, minutes;
+			if (!parse_bounded(s + 1, end, 2, 2, 0, 99, hours) || !parse_bounded(s + 3, end, 2, 2, 0, 59, minutes))
+				return false;
+			utcoffset = (*s == '-' ? -1 : 1) * (hours * S_IN_HOUR + minutes * S_IN_MINUTE);
+		}
+		else if (zonename != "GMT" && zonename != "UT" && zonename != "UTC" && zonename != "Z")
+			return false;
+		out = timestamp::from_civil(c, utcoffset);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+inline auto_parser::auto_parser(const tzone& z, int syslogyear) : zone(z), year(syslogyear)
+{
+	if (!year)
+		year = int(timestamp::now().to_civil().year);
+}
+
+inline bool auto_parser::parse(std::string_view tstamp, timestamp& out)
+{
+	if (current && parse_detected(tstamp, current, out, zone, year))
+		return true;
+	const detected_format found = detect_format(tstamp);
+	if (!found || !parse_detected(tstamp, found, out, zone, year))
+	{
+		++failures;
+		return false;
+	}
+	if (found.layout != current.layout || found.format != current.format || found.fraction != current.fraction)
+	{
+		current = found;
+		++detections;
+	}
+	return true;
+}
@@ -0,0 +1,298 @@
+#pragma once
+
+#include "chronowrap.hpp"
+
+#include <thread>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//Fixed memory log-linear histogram of durations, in the style of HdrHistogram.
+//Values below 2^PRECISION ns get a bucket each. Above that every power of two is split into 2^PRECISION buckets,
+//so a recorded value is off by less than 1 part in 2^PRECISION (0.8% at the default 7) all the way up to 2^63 ns.
+//Recording is one relaxed fetch_add on the bucket plus one on the running sum, so it is wait-free from any thread.
+//For heavily contended counters use sharded_histogram, which gives each thread its own copy and merges on read.
+template<int PRECISION = 7>
+class latency_histogram
+{
+	static_assert(PRECISION >= 1 && PRECISION <= 16, "latency_histogram: PRECISION must be 1 to 16");
+
+public:
+	static const int SUBBUCKETS = 1 << PRECISION;
+	static const int BUCKETS = (65 - PRECISION) * SUBBUCKETS;
+
+private:
+	std::unique_ptr<std::atomic<std::uint64_t>[]> counts;
+	alignas(64) std::atomic<std::uint64_t> total{ 0 };
+
+	//v must not be 0
+	static int highbit(std::uint64_t v)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanReverse64(&index, v);
+		return int(index);
+#elif defined(_MSC_VER)
+		unsigned long index;
+		if (_BitScanReverse(&index, (unsigned long)(v >> 32)))
+			return int(index) + 32;
+		_BitScanReverse(&index, (unsigned long)v);
+		return int(index);
+#else
+		return 63 - __builtin_clzll(v);
+#endif
+	}
+
+public:
+	latency_histogram() : counts(new std::atomic<std::uint64_t>[BUCKETS]) { reset(); }
+	latency_histogram(const latency_histogram& rhs) : latency_histogram() { merge(rhs); }
+	latency_histogram& operator=(const latency_histogram& rhs)
+	{
+		if (this != &rhs)
+		{
+			reset();
+			merge(rhs);
+		}
+		return *this;
+	}
+
+	static int bucketof(std::uint64_t ns);
+	//Smallest and largest values that land in a bucket
+	static std::uint64_t bucketlow(int bucket);
+	static std::uint64_t buckethigh(int bucket);
+
+	//Negative durations are recorded as 0
+	void recordns(std::int64_t ns, std::uint64_t times = 1)
+	{
+		const std::uint64_t v = ns < 0 ? 0 : std::uint64_t(ns);
+		counts[bucketof(v)].fetch_add(times, std::memory_order_relaxed);
+		total.fetch_add(v * times, std::memory_order_relaxed);
+	}
+	void record(const compact_timediff& t) { recordns(t.count()); }
+	void record(const timediff& t) { recordns((t.data().first + t.data().second).count()); }
+
+	//Adds rhs's counts into this one. Safe while either side is being recorded into.
+	void merge(const latency_histogram& rhs);
+	void reset();
+
+	std::uint64_t count() const;
+	std::uint64_t bucketcount(int bucket) const { return counts[bucket].load(std::memory_order_relaxed); }
+	//Exact, from the running sum. Zero if empty.
+	timediff mean() const;
+	//Bucket precision. Zero if empty.
+	timediff min() const;
+	timediff max() const;
+	//Smallest value at or above p percent of the recorded values, reported as the top of its bucket so it never
+	//under-reports. p is clamped to 0 to 100. Zero if empty.
+	timediff percentile(double p) const;
+
+	//Compact binary form: a header, then the non-empty buckets as varint gaps and counts
+	std::string serialize() const;
+	//Replaces this histogram's contents. Returns false, leaving it empty, if the data is damaged or from another PRECISION.
+	bool deserialize(std::string_view data);
+};
+
+//One latency_histogram per thread slot, so concurrent recorders don't fight over the same cache lines.
+//Threads are spread over the slots round robin on their first record.
+template<int PRECISION = 7>
+class sharded_histogram
+{
+	std::vector<latency_histogram<PRECISION>> shards;
+
+	static size_t threadslot()
+	{
+		static std::atomic<size_t> next{ 0 };
+		thread_local const size_t slot = next.fetch_add(1, std::memory_order_relaxed);
+		return slot;
+	}
+
+public:
+	//0 uses one shard per hardware thread
+	explicit sharded_histogram(size_t count = 0) : shards(count ? count : std::max<size_t>(1, std::thread::hardware_concurrency())) {}
+
+	size_t shardcount() const { return shards.size(); }
+	latency_histogram<PRECISION>& shard() { return shards[threadslot() % shards.size()]; }
+
+	void recordns(std::int64_t ns) { shard().recordns(ns); }
+	void record(const compact_timediff& t) { shard().record(t); }
+	void record(const timediff& t) { shard().record(t); }
+
+	//All shards merged into one
+	latency_histogram<PRECISION> snapshot() const
+	{
+		latency_histogram<PRECISION> ret;
+		for (const auto& s : shards)
+			ret.merge(s);
+		return ret;
+	}
+	void reset()
+	{
+		for (auto& s : shards)
+			s.reset();
+	}
+};
+
+template<int PRECISION>
+inline int latency_histogram<PRECISION>::bucketof(std::uint64_t ns)
+{
+	if (ns < std::uint64_t(SUBBUCKETS))
+		return int(ns);
+	const int shift = highbit(ns) - PRECISION;
+	return (shift + 1) * SUBBUCKETS + int((ns >> shift) - SUBBUCKETS);
+}
+
+template<int PRECISION>
+inline std::uint64_t latency_histogram<PRECISION>::bucketlow(int bucket)
+{
+	if (bucket < SUBBUCKETS)
+		return std::uint64_t(bucket);
+	const int shift = bucket / SUBBUCKETS - 1;
+	return (std::uint64_t(SUBBUCKETS) + std::uint64_t(bucket % SUBBUCKETS)) << shift;
+}
+
+template<int PRECISION>
+inline std::uint64_t latency_histogram<PRECISION>::buckethigh(int bucket)
+{
+	if (bucket < SUBBUCKETS)
+		return std::uint64_t(bucket);
+	const int shift = bucket / SUBBUCKETS - 1;
+	return bucketlow(bucket) + ((std::uint64_t(1) << shift) - 1);
+}
+
+template<int PRECISION>
+inline void latency_histogram<PRECISION>::merge(const latency_histogram& rhs)
+{
+	for (int i = 0; i < BUCKETS; ++i)
+		if (const std::uint64_t c = rhs.counts[i].load(std::memory_order_relaxed))
+			counts[i].fetch_add(c, std::memory_order_relaxed);
+	total.fetch_add(rhs.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+template<int PRECISION>
+inline void latency_histogram<PRECISION>::reset()
+{
+	for (int i = 0; i < BUCKETS; ++i)
+		counts[i].store(0, std::memory_order_relaxed);
+	total.store(0, std::memory_order_relaxed);
+}
+
+template<int PRECISION>
+inline std::uint64_t latency_histogram<PRECISION>::count() const
+{
+	std::uint64_t ret = 0;
+	for (int i = 0; i < BUCKETS; ++i)
+		ret += counts[i].load(std::memory_order_relaxed);
+	return ret;
+}
+
+template<int PRECISION>
+inline timediff latency_histogram<PRECISION>::mean() const
+{
+	const std::uint64_t n = count();
+	return timediff(std::chrono::nanoseconds(n ? std::int64_t(total.load(std::memory_order_relaxed) / n) : 0));
+}
+
+template<int PRECISION>
+inline timediff latency_histogram<PRECISION>::min() const
+{
+	for (int i = 0; i < BUCKETS; ++i)
+		if (counts[i].load(std::memory_order_relaxed))
+			return timediff(std::chrono::nanoseconds(std::int64_t(bucketlow(i))));
+	return timediff(std::chrono::nanoseconds(0));
+}
+
+template<int PRECISION>
+inline timediff latency_histogram<PRECISION>::max() const
+{
+	for (int i = BUCKETS - 1; i >= 0; --i)
+		if (counts[i].load(std::memory_order_relaxed))
+			return timediff(std::chrono::nanoseconds(std::int64_t(std::min<std::uint64_t>(buckethigh(i), INT64_MAX))));
+	return timediff(std::chrono::nanoseconds(0));
+}
+
+template<int PRECISION>
+inline timediff latency_histogram<PRECISION>::percentile(double p) const
+{
+	const std::uint64_t n = count();
+	if (!n)
+		return timediff(std::chrono::nanoseconds(0));
+	p = std::max(0.0, std::min(100.0, p));
+	//Rank of the value wanted, 1 based
+	const std::uint64_t rank = std::max<std::uint64_t>(1, std::uint64_t(p / 100.0 * double(n) + 0.5));
+	std::uint64_t seen = 0;
+	for (int i = 0; i < BUCKETS; ++i)
+	{
+		seen += counts[i].load(std::memory_order_relaxed);
+		if (seen >= rank)
+			return timediff(std::chrono::nanoseconds(std::int64_t(std::min<std::uint64_t>(buckethigh(i), INT64_MAX))));
+	}
+	return max();
+}
+
+template<int PRECISION>
+inline std::string latency_histogram<PRECISION>::serialize() const
+{
+	auto varint = [](std::string& out, std::uint64_t v) {
+		while (v >= 0x80)
+		{
+			out += char((v & 0x7F) | 0x80);
+			v >>= 7;
+		}
+		out += char(v);
+	};
+
+	std::string ret = "CWH1";
+	ret += char(PRECISION);
+	varint(ret, total.load(std::memory_order_relaxed));
+	int previous = -1;
+	for (int i = 0; i < BUCKETS; ++i)
+	{
+		const std::uint64_t c = counts[i].load(std::memory_order_relaxed);
+		if (!c)
+			continue;
+		varint(ret, std::uint64_t(i - previous));
+		varint(ret, c);
+		previous = i;
+	}
+	return ret;
+}
+
+template<int PRECISION>
+inline bool latency_histogram<PRECISION>::deserialize(std::string_view data)
+{
+	reset();
+	const unsigned char* s = reinterpret_cast<const unsigned char*>(data.data());
+	const unsigned char* const end = s + data.size();
+	auto varint = [&](std::uint64_t& v) {
+		v = 0;
+		for (int shift = 0; s < end && shift < 64; shift += 7)
+		{
+			const unsigned char b = *s++;
+			v |= std::uint64_t(b & 0x7F) << shift;
+			if (!(b & 0x80))
+				return true;
+		}
+		return false;
+	};
+
+	if (data.size() < 5 || data.substr(0, 4) != "CWH1" || data[4] != char(PRECISION))
+		return false;
+	s += 5;
+	std::uint64_t sum;
+	if (!varint(sum))
+		return false;
+	long long bucket = -1;
+	while (s < end)
+	{
+		std::uint64_t gap, c;
+		if (!varint(gap) || !varint(c) || gap == 0 || gap > std::uint64_t(BUCKETS) || (bucket += (long long)gap) >= BUCKETS)
+		{
+			reset();
+			return false;
+		}
+		counts[bucket].store(c, std::memory_order_relaxed);
+	}
+	total.store(sum, std::memory_order_relaxed);
+	return true;
+}
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "chronowrap_simd.hpp"
+
+#include <cstdio>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHRONOWRAP_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//Pulls the leading timestamp out of every line of a log without copying the lines anywhere.
+//Files are memory mapped where the platform allows it, otherwise read in large chunks. Line ends are
+//found 16 bytes at a time and each line's prefix goes through simd_parser, so fixed width formats use the vector kernel.
+
+struct log_line
+{
+	timestamp time;        //invalid if the line doesn't start with a timestamp in the reader's format
+	size_t offset = 0;     //of the line's first byte from the start of the file or buffer
+	std::string_view text; //without the line ending. Only valid during the callback.
+};
+
+//Index of the lowest set bit. mask must not be 0.
+inline int lowestbit(unsigned mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return int(index);
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+//First '\n' in [s, end), or end if there isn't one
+inline const char* findnewline(const char* s, const char* end)
+{
+#ifdef CHRONOWRAP_X86
+	//SSE2 is part of every x86-64 target, so this needs no dispatch
+	const __m128i newline = _mm_set1_epi8('\n');
+	for (; end - s >= 16; s += 16)
+	{
+		const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)s), newline));
+		if (mask)
+			return s + lowestbit(unsigned(mask));
+	}
+#endif
+	const void* found = memchr(s, '\n', size_t(end - s));
+	return found ? static_cast<const char*>(found) : end;
+}
+
+//Read only view of a whole file. Empty, or not open, where the platform has no mmap.
+class mapped_file
+{
+	const char* bytes = nullptr;
+	size_t len = 0;
+	int fd = -1; //held when the file opened but couldn't be mapped, e.g. a pipe
+	bool opened = false;
+
+public:
+	explicit mapped_file(const std::string& path);
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+	~mapped_file();
+
+	bool isopen() const { return opened; }
+	//Descriptor of a file that opened but couldn't be mapped, or -1. The caller takes it over and must close it.
+	int release()
+	{
+		const int ret = fd;
+		fd = -1;
+		return ret;
+	}
+	const char* data() const { return bytes; }
+	size_t size() const { return len; }
+};
+
+class log_reader
+{
+	simd_parser parser;
+
+	//Hands complete lines in [data, data + len) to cb. The trailing piece after the last newline is only
+	//treated as a line if final is set. Returns the number of bytes consumed.
+	template<class Callback> size_t scanlines(const char* data, size_t len, size_t base, bool final, Callback& cb, size_t& lines) const;
+
+public:
+	//Read size for files that can't be mapped
+	static const size_t CHUNK = size_t(1) << 22;
+
+	explicit log_reader(const compiled_format& format) : parser(format) {}
+
+	const compiled_format& getformat() const { return parser.getformat(); }
+
+	//Calls cb(const log_line&) for every line in the buffer, including a last one without a newline. Returns the line count.
+	template<class Callback> size_t scan(const char* data, size_t len, Callback&& cb) const;
+	template<class Callback> size_t scan(std::string_view data, Callback&& cb) const { return scan(data.data(), data.size(), cb); }
+	//Same for a file. Returns false if it can't be opened or a read fails part way.
+	template<class Callback> bool scanfile(const std::string& path, Callback&& cb, size_t* lines = nullptr) const;
+};
+
+inline mapped_file::mapped_file(const std::string& path)
+{
+#ifdef CHRONOWRAP_MMAP
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+	struct stat info;
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+	{
+		len = size_t(info.st_size);
+		opened = true;
+		if (len)
+		{
+			void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED)
+				opened = false, len = 0;
+			else
+			{
+				madvise(p, len, MADV_SEQUENTIAL);
+				bytes = static_cast<const char*>(p);
+			}
+		}
+	}
+	//Anything that isn't mapped keeps its descriptor, so it's read without being opened a second time.
+	//A pipe's writer would see no reader in between.
+	if (opened)
+	{
+		::close(fd);
+		fd = -1;
+	}
+#else
+	(void)path;
+#endif
+}
+
+inline mapped_file::~mapped_file()
+{
+#ifdef CHRONOWRAP_MMAP
+	if (bytes)
+		munmap(const_cast<char*>(bytes), len);
+	if (fd >= 0)
+		::close(fd);
+#endif
+}
+
+template<class Callback>
+inline size_t log_reader::scanlines(const char* data, size_t len, size_t base, bool final, Callback& cb, size_t& lines) const
+{
+	const char* s = data;
+	const char* const end = data + len;
+	log_line line;
+	while (s < end)
+	{
+		const char* newline = findnewline(s, end);
+		if (newline == end && !final)
+			break;
+
+		const char* lineend = newline;
+		if (lineend > s && lineend[-1] == '\r')
+			--lineend;
+		line.offset = base + size_t(s - data);
+		line.text = std::string_view(s, size_t(lineend - s));
+		if (!parser.parse(line.text, line.time))
+			line.time = timestamp();
+		cb(static_cast<const log_line&>(line));
+		++lines;
+		s = newline + (newline < end);
+	}
+	return size_t(s - data);
+}
+
+template<class Callback>
+inline size_t log_reader::scan(const char* data, size_t len, Callback&& cb) const
+{
+	size_t lines = 0;
+	scanlines(data, len, 0, true, cb, lines);
+	return lines;
+}
+
+template<class Callback>
+inline bool log_reader::scanfile(const std::string& path, Callback&& cb, size_t* lines) const
+{
+	size_t count = 0;
+	mapped_file mapped(path);
+	if (mapped.isopen())
+	{
+		scanlines(mapped.data(), mapped.size(), 0, true, cb, count);
+		if (lines)
+			*lines = count;
+		return true;
+	}
+
+	//No mmap: read whole chunks, carrying the partial last line over to the front of the buffer
+	FILE* file = nullptr;
+#ifdef CHRONOWRAP_MMAP
+	const int fd = mapped.release();
+	if (fd >= 0 && !(file = fdopen(fd, "rb")))
+		::close(fd);
+#elif defined(_MSC_VER)
+	fopen_s(&file, path.c_str(), "rb");
+#else
+	file = fopen(path.c_str(), "rb");
+#endif
+	if (!file)
+		return false;
+	setvbuf(file, nullptr, _IONBF, 0);
+
+	std::vector<char> buf(CHUNK);
+	size_t held = 0;
+	size_t base = 0;
+	bool ok = true;
+	for (;;)
+	{
+		//A line longer than the buffer grows it
+		if (buf.size() - held < CHUNK / 2)
+			buf.resize(buf.size() * 2);
+		const size_t got = fread(buf.data() + held, 1, buf.size() - held, file);
+		if (got == 0 && ferror(file))
+		{
+			ok = false;
+			break;
+		}
+		const bool final = got == 0;
+		held += got;
+		const size_t used = scanlines(buf.data(), held, base, final, cb, count);
+		if (final)
+			break;
+		memmove(buf.data(), buf.data() + used, held - used);
+		held -= used;
+		base += used;
+	}
+	fclose(file);
+	if (lines)
+		*lines = count;
+	return ok;
+}
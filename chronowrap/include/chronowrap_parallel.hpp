@@ -0,0 +1,168 @@
+#pragma once
+
+#include "chronowrap_simd.hpp"
+
+#include <condition_variable>
+#include <thread>
+
+//Spreading batch work over cores. An executor is anything with parallel_for(count, fn), which calls fn(i) once for
+//every i in [0, count) and returns when all of them are done. thread_pool runs the calls on its workers and the
+//calling thread; inline_executor runs them in order on the calling thread.
+//fn must not throw.
+
+struct inline_executor
+{
+	size_t concurrency() const { return 1; }
+	template<class F> void parallel_for(size_t count, F&& fn)
+	{
+		for (size_t i = 0; i < count; ++i)
+			fn(i);
+	}
+};
+
+//Fixed set of worker threads. One parallel_for runs at a time; others wait their turn.
+//Tasks are handed out one at a time from a shared counter, so uneven tasks still balance.
+class thread_pool
+{
+	std::vector<std::thread> workers;
+	std::mutex submit;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	//The current job, type erased without allocating
+	void (*job)(void*, size_t) = nullptr;
+	void* context = nullptr;
+	size_t tasks = 0;
+	alignas(64) std::atomic<size_t> next{ 0 };
+	size_t busy = 0;
+	std::uint64_t generation = 0;
+	bool stopping = false;
+
+	void work()
+	{
+		for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < tasks;)
+			job(context, i);
+	}
+	void run();
+
+public:
+	//threads includes the caller, so 1 runs everything on the calling thread. 0 uses one per hardware thread.
+	explicit thread_pool(size_t threads = 0);
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+	~thread_pool();
+
+	size_t concurrency() const { return workers.size() + 1; }
+	template<class F> void parallel_for(size_t count, F&& fn);
+};
+
+//Strings per task: a multiple of 64 so each task owns whole error bitmap words, and small enough that a task's
+//strings, views and results stay in a core's L2
+const size_t PARSE_CHUNK = 2048;
+
+//Parses count strings into out, PARSE_CHUNK at a time across the executor's threads. Entries that fail to parse are left
+//as invalid timestamps and, if errors isn't null, flagged in it: bit i % 64 of errors[i / 64] is set if string i failed.
+//errors needs (count + 63) / 64 words. Returns the number parsed.
+//Strings without an offset are wall clock time in zone. The zone is resolved once and shared read only by the workers;
+//the overload without one uses tzone::local().
+template<class Executor>
+size_t parse_batch(const std::string_view* in, timestamp* out, size_t count, const compiled_format& format, const tzone& zone, Executor& executor, std::uint64_t* errors);
+template<class Executor>
+inline size_t parse_batch(const std::string_view* in, timestamp* out, size_t count, const compiled_format& format, Executor& executor, std::uint64_t* errors)
+{
+	return parse_batch(in, out, count, format, tzone::local(), executor, errors);
+}
+
+inline thread_pool::thread_pool(size_t threads)
+{
+	if (!threads)
+		threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+	for (size_t i = 1; i < threads; ++i)
+		workers.emplace_back(&thread_pool::run, this);
+}
+
+inline thread_pool::~thread_pool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& t : workers)
+		t.join();
+}
+
+inline void thread_pool::run()
+{
+	std::uint64_t seen = 0;
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;)
+	{
+		wake.wait(guard, [&] { return stopping || generation != seen; });
+		if (stopping)
+			return;
+		seen = generation;
+		guard.unlock();
+		work();
+		guard.lock();
+		if (--busy == 0)
+			done.notify_one();
+	}
+}
+
+template<class F>
+inline void thread_pool::parallel_for(size_t count, F&& fn)
+{
+	using t_fn = typename std::remove_reference<F>::type;
+	if (workers.empty() || count <= 1)
+	{
+		for (size_t i = 0; i < count; ++i)
+			fn(i);
+		return;
+	}
+
+	std::lock_guard<std::mutex> one(submit);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		job = [](void* c, size_t i) { (*static_cast<t_fn*>(c))(i); };
+		context = const_cast<void*>(static_cast<const void*>(&fn));
+		tasks = count;
+		next.store(0, std::memory_order_relaxed);
+		busy = workers.size();
+		++generation;
+	}
+	wake.notify_all();
+	work();
+	//Workers may still be finishing their last task
+	std::unique_lock<std::mutex> guard(lock);
+	done.wait(guard, [this] { return busy == 0; });
+}
+
+template<class Executor>
+inline size_t parse_batch(const std::string_view* in, timestamp* out, size_t count, const compiled_format& format, const tzone& zone, Executor& executor, std::uint64_t* errors)
+{
+	const simd_parser parser(format);
+	std::atomic<size_t> parsed{ 0 };
+	executor.parallel_for((count + PARSE_CHUNK - 1) / PARSE_CHUNK, [&](size_t chunk) {
+		const size_t begin = chunk * PARSE_CHUNK;
+		const size_t end = std::min(count, begin + PARSE_CHUNK);
+		size_t ok = 0;
+		for (size_t word = begin / 64; word * 64 < end; ++word)
+		{
+			std::uint64_t failed = 0;
+			for (size_t i = word * 64; i < std::min(end, word * 64 + 64); ++i)
+			{
+				const bool good = parser.parse(in[i], out[i], zone);
+				if (!good)
+					out[i] = timestamp();
+				failed |= std::uint64_t(!good) << (i % 64);
+				ok += good;
+			}
+			if (errors)
+				errors[word] = failed;
+		}
+		parsed.fetch_add(ok, std::memory_order_relaxed);
+	});
+	return parsed.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "chronowrap_coarseclock.hpp"
+#include "chronowrap_tscclock.hpp"
+
+//Lock-free rate limiting. Both limiters keep their whole state in one 64-bit atomic time in ns, so a decision is a
+//clock read, a load and, only when it is granted, a compare exchange. Refusals never write, so a limiter that is
+//turning most callers away stays in every core's cache.
+//Clock is anything with nowcompact(), normally a shared tsc_clock or a coarse_clock, which must outlive the limiter.
+//A coarse_clock must already be started when the limiter is made. An invalid now, as a stopped coarse_clock returns,
+//is refused: acquires fail, available() is 0 and waits are INT64_MAX ns.
+//A coarse_clock moves a tick at a time, so give limiters using one a burst of at least a tick's worth of requests,
+//or the rate is capped at one burst per tick.
+//The overloads taking now let callers that already have the time skip the clock read.
+//
+//	static tsc_clock clock;
+//	static token_bucket<> bucket(clock, milliseconds<int>(10), 50); //100 a second, bursts of 50
+//	if (!bucket.tryacquire()) return busy;
+
+//Holds up to capacity tokens, refilled one every interval. Requests take whole numbers of tokens.
+template<class Clock = tsc_clock>
+class token_bucket
+{
+	//The time the bucket was, or will be, empty. Tokens now are (now - empty) / interval, capped at capacity.
+	alignas(64) std::atomic<std::int64_t> empty;
+	const Clock& clock;
+	std::int64_t interval;
+	std::uint64_t cap;
+	std::int64_t full;  //capacity * interval, the refill time from empty
+
+	//Refills forgotten while the bucket sat full don't count. now must be valid.
+	std::int64_t base(std::int64_t e, std::int64_t now) const { return std::max(e, now - full); }
+	//An invalid now leaves the bucket full once the clock is valid again
+	std::int64_t emptyat(compact_timestamp now, bool tofull) const { return tofull && now.isvalid() ? now.count() - full : now.count(); }
+
+public:
+	using clock_type = Clock;
+
+	token_bucket(const Clock& c, timediff refill, std::uint64_t capacity, bool startfull = true) : clock(c),
+		interval(std::max<std::int64_t>(1, refill.asnanoseconds<std::int64_t>())), cap(std::max<std::uint64_t>(1, capacity))
+	{
+		assert(cap <= std::uint64_t(INT64_MAX / interval));
+		full = std::int64_t(cap) * interval;
+		empty.store(emptyat(clock.nowcompact(), startfull), std::memory_order_relaxed);
+	}
+	token_bucket(const token_bucket&) = delete;
+	token_bucket& operator=(const token_bucket&) = delete;
+
+	//All n tokens or none. Requests over the capacity always fail.
+	bool tryacquire(std::uint64_t n = 1) { return tryacquire(clock.nowcompact(), n); }
+	bool tryacquire(compact_timestamp now, std::uint64_t n = 1);
+	//As many as are available up to n. Returns the number taken.
+	std::uint64_t acquireupto(std::uint64_t n) { return acquireupto(clock.nowcompact(), n); }
+	std::uint64_t acquireupto(compact_timestamp now, std::uint64_t n);
+
+	std::uint64_t available() const { return available(clock.nowcompact()); }
+	std::uint64_t available(compact_timestamp now) const;
+	//How long until n tokens are available, 0 if they are now. INT64_MAX ns if n is over the capacity.
+	compact_timediff timeuntil(std::uint64_t n = 1) const { return timeuntil(clock.nowcompact(), n); }
+	compact_timediff timeuntil(compact_timestamp now, std::uint64_t n = 1) const;
+
+	std::uint64_t capacity() const { return cap; }
+	compact_timediff refillinterval() const { return compact_timediff(interval); }
+	//Fills or empties the bucket
+	void reset(bool tofull = true)
+	{
+		empty.store(emptyat(clock.nowcompact(), tofull), std::memory_order_relaxed);
+	}
+};
+
+//Generic cell rate algorithm: requests are spaced interval apart on average, and up to burst may arrive at once.
+//The state is the theoretical arrival time, when the next request would be on schedule. Same admission as a
+//token_bucket of capacity burst, but it answers with how long to wait instead of a token count.
+template<class Clock = tsc_clock>
+class gcra_limiter
+{
+	alignas(64) std::atomic<std::int64_t> tat;
+	const Clock& clock;
+	std::int64_t interval;
+	std::uint64_t burst;
+	std::int64_t tolerance;  //burst * interval, how far ahead of now the arrival time may run
+
+public:
+	using clock_type = Clock;
+
+	gcra_limiter(const Clock& c, timediff emission, std::uint64_t maxburst = 1) : clock(c),
+		interval(std::max<std::int64_t>(1, emission.asnanoseconds<std::int64_t>())), burst(std::max<std::uint64_t>(1, maxburst))
+	{
+		assert(burst <= std::uint64_t(INT64_MAX / interval));
+		tolerance = std::int64_t(burst) * interval;
+		tat.store(clock.nowcompact().count(), std::memory_order_relaxed);
+	}
+	gcra_limiter(const gcra_limiter&) = delete;
+	gcra_limiter& operator=(const gcra_limiter&) = delete;
+
+	//Admits a request costing n, or refuses it and, if retry is given, sets it to how long until it would be admitted.
+	//Requests over the burst, or at an invalid now, are always refused, with a retry of INT64_MAX ns.
+	bool allow(std::uint64_t n = 1, compact_timediff* retry = nullptr) { return allow(clock.nowcompact(), n, retry); }
+	bool allow(compact_timestamp now, std::uint64_t n = 1, compact_timediff* retry = nullptr);
+
+	std::uint64_t maxburst() const { return burst; }
+	compact_timediff emissioninterval() const { return compact_timediff(interval); }
+	void reset() { tat.store(clock.nowcompact().count(), std::memory_order_relaxed); }
+};
+
+template<class Clock>
+inline bool token_bucket<Clock>::tryacquire(compact_timestamp now, std::uint64_t n)
+{
+	if (n > cap || !now.isvalid())
+		return false;
+	const std::int64_t t = now.count();
+	const std::int64_t cost = std::int64_t(n) * interval;
+	std::int64_t e = empty.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		const std::int64_t next = base(e, t) + cost;
+		if (next > t)
+			return false;
+		if (empty.compare_exchange_weak(e, next, std::memory_order_relaxed))
+			return true;
+	}
+}
+
+template<class Clock>
+inline std::uint64_t token_bucket<Clock>::acquireupto(compact_timestamp now, std::uint64_t n)
+{
+	if (!now.isvalid())
+		return 0;
+	const std::int64_t t = now.count();
+	std::int64_t e = empty.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		const std::int64_t b = base(e, t);
+		//Drained past now, e.g. by a later caller or a stale now: nothing to take
+		const std::uint64_t take = b > t ? 0 : std::min(n, std::uint64_t((t - b) / interval));
+		if (!take)
+			return 0;
+		if (empty.compare_exchange_weak(e, b + std::int64_t(take) * interval, std::memory_order_relaxed))
+			return take;
+	}
+}
+
+template<class Clock>
+inline std::uint64_t token_bucket<Clock>::available(compact_timestamp now) const
+{
+	if (!now.isvalid())
+		return 0;
+	const std::int64_t t = now.count();
+	const std::int64_t b = base(empty.load(std::memory_order_relaxed), t);
+	return b > t ? 0 : std::uint64_t((t - b) / interval);
+}
+
+template<class Clock>
+inline compact_timediff token_bucket<Clock>::timeuntil(compact_timestamp now, std::uint64_t n) const
+{
+	if (n > cap || !now.isvalid())
+		return compact_timediff(INT64_MAX);
+	const std::int64_t t = now.count();
+	const std::int64_t ready = base(empty.load(std::memory_order_relaxed), t) + std::int64_t(n) * interval;
+	return compact_timediff(ready > t ? ready - t : 0);
+}
+
+template<class Clock>
+inline bool gcra_limiter<Clock>::allow(compact_timestamp now, std::uint64_t n, compact_timediff* retry)
+{
+	if (n > burst || !now.isvalid())
+	{
+		if (retry)
+			*retry = compact_timediff(INT64_MAX);
+		return false;
+	}
+	const std::int64_t t = now.count();
+	const std::int64_t cost = std::int64_t(n) * interval;
+	std::int64_t current = tat.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		const std::int64_t next = std::max(current, t) + cost;
+		//Admitted while the new arrival time stays within the tolerance of now
+		if (next - t > tolerance)
+		{
+			if (retry)
+				*retry = compact_timediff(next - t - tolerance);
+			return false;
+		}
+		if (tat.compare_exchange_weak(current, next, std::memory_order_relaxed))
+		{
+			if (retry)
+				*retry = compact_timediff(0);
+			return true;
+		}
+	}
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include "chronowrap.hpp"
+
+//Vectorized parsing for fixed width formats up to 32 bytes long, e.g. "%Y/%M/%d %H:%m:%s.%x".
+//The kernel is picked once at runtime (AVX2, SSE4.2 or scalar). Anything the kernel can't handle,
+//like a short fraction or a non x86 build, goes through the scalar compiled_format path instead.
+//Names, %e, %j, %p and %z aren't vectorized: the kernel lets their bytes through and readfield reads them afterwards.
+//Formats that set a field twice, or have two fractions, would share gather lanes, so they stay on the scalar path too.
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CHRONOWRAP_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CHRONOWRAP_TARGET(x)
+#else
+#include <immintrin.h>
+#define CHRONOWRAP_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+enum class simdlevel { scalar = 0, sse42, avx2 };
+
+//Highest instruction set the kernels can use on this machine. Checked once.
+inline simdlevel cpusimdlevel()
+{
+#ifdef CHRONOWRAP_X86
+	static const simdlevel level = [] {
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		const int maxleaf = info[0];
+		__cpuid(info, 1);
+		const bool sse42 = (info[2] & (1 << 20)) != 0;
+		//AVX also needs the OS to save the ymm registers
+		const bool osavx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+		bool avx2 = false;
+		if (osavx && maxleaf >= 7)
+		{
+			__cpuidex(info, 7, 0);
+			avx2 = (info[1] & (1 << 5)) != 0;
+		}
+#else
+		__builtin_cpu_init();
+		const bool sse42 = __builtin_cpu_supports("sse4.2");
+		const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+		if (avx2 && sse42)
+			return simdlevel::avx2;
+		if (sse42)
+			return simdlevel::sse42;
+		return simdlevel::scalar;
+	}();
+	return level;
+#else
+	return simdlevel::scalar;
+#endif
+}
+
+//Byte tables that let one subtract, one max and one compare validate a whole timestamp,
+//and two shuffle pairs gather the date/time and fraction digits into canonical order.
+class simd_parser
+{
+public:
+	static const size_t WIDTH = 32;
+
+private:
+	compiled_format format;
+	simdlevel level = simdlevel::scalar;
+
+	//Per byte: what to subtract ('0' for digits, the literal itself for literals) and the largest allowed result
+	alignas(32) unsigned char sub[WIDTH] = {};
+	alignas(32) unsigned char limit[WIDTH] = {};
+	//Shuffle controls for YYYYMMDDHHmmss and a 16 digit, zero led fraction in nanoseconds, split by source half
+	alignas(16) unsigned char datelo[16] = {};
+	alignas(16) unsigned char datehi[16] = {};
+	alignas(16) unsigned char fraclo[16] = {};
+	alignas(16) unsigned char frachi[16] = {};
+	//Ops read by readfield after the kernel
+	fmtop scalarops[compiled_format::MAX_OPS] = {};
+	size_t scalarcount = 0;
+
+	void setgather(unsigned char* lo, unsigned char* hi, int dest, int src) const
+	{
+		if (src < 16)
+			lo[dest] = (unsigned char)src;
+		else
+			hi[dest] = (unsigned char)(src - 16);
+	}
+
+	bool kernel(const char* src, int* values) const;
+
+public:
+	explicit simd_parser(const compiled_format& f, simdlevel maxlevel = simdlevel::avx2);
+
+	//The level parse() will actually use. scalar means every call goes through timestamp::fromstring.
+	simdlevel activelevel() const { return level; }
+	const compiled_format& getformat() const { return format; }
+
+	//Strings without an offset are wall clock time in zone, or in tzone::local()
+	bool parse(std::string_view tstamp, timestamp& out, const tzone& zone) const;
+	bool parse(std::string_view tstamp, timestamp& out) const { return parse(tstamp, out, tzone::local()); }
+};
+
+inline simd_parser::simd_parser(const compiled_format& f, simdlevel maxlevel) : format(f)
+{
+	if (!format.isvalid() || !format.isfixedwidth() || format.maxlength() > WIDTH)
+		return;
+
+	std::fill(std::begin(limit), std::end(limit), (unsigned char)0xFF);
+	std::fill(std::begin(datelo), std::end(datelo), (unsigned char)0x80);
+	std::fill(std::begin(datehi), std::end(datehi), (unsigned char)0x80);
+	std::fill(std::begin(fraclo), std::end(fraclo), (unsigned char)0x80);
+	std::fill(std::begin(frachi), std::end(frachi), (unsigned char)0x80);
+
+	//Where each field's digits go in the date/time register
+	static constexpr int datepos[] = { 0, 4, 6, 8, 10, 12 };
+	std::uint32_t seen = 0;
+	bool hasfraction = false;
+	for (const fmtop& op : format)
+	{
+		const bool fraction = op.kind == fmtkind::fraction || op.kind == fmtkind::scaled;
+		if (op.field != fmtfield::literal)
+		{
+			if ((seen & (1u << int(op.field))) || (fraction && hasfraction))
+				return;
+			seen |= 1u << int(op.field);
+			hasfraction |= fraction;
+		}
+		const bool vectorized = op.kind == fmtkind::literal || fraction || op.kind == fmtkind::hour12
+			|| (op.kind == fmtkind::digits && op.field <= fmtfield::second);
+		if (!vectorized)
+		{
+			//sub 0 and limit 0xFF pass any byte
+			scalarops[scalarcount++] = op;
+			continue;
+		}
+		for (int i = 0; i < op.width; ++i)
+		{
+			const int pos = op.offset + i;
+			if (op.field == fmtfield::literal)
+			{
+				sub[pos] = (unsigned char)format.literal(op)[i];
+				limit[pos] = 0;
+				continue;
+			}
+			sub[pos] = '0';
+			limit[pos] = 9;
+			if (fraction)
+				setgather(fraclo, frachi, 7 + i, pos); //fraction digits start at the 10^8 place, whatever the width
+			else
+				setgather(datelo, datehi, datepos[int(op.field)] + i, pos);
+		}
+	}
+
+	const simdlevel cpu = cpusimdlevel();
+	level = cpu < maxlevel ? cpu : maxlevel;
+}
+
+#ifdef CHRONOWRAP_X86
+//Gathers the digits (already offset by '0') from both source halves and converts them to field values
+CHRONOWRAP_TARGET("sse4.2")
+inline void simdfields(__m128i lo, __m128i hi, const unsigned char* datelo, const unsigned char* datehi, const unsigned char* fraclo, const unsigned char* frachi, int* values)
+{
+	const __m128i date = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_load_si128((const __m128i*)datelo)), _mm_shuffle_epi8(hi, _mm_load_si128((const __m128i*)datehi)));
+	const __m128i frac = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_load_si128((const __m128i*)fraclo)), _mm_shuffle_epi8(hi, _mm_load_si128((const __m128i*)frachi)));
+
+	//Pairs of digits to 2 digit values: YY YY MM DD HH mm ss 00
+	const __m128i tens = _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1);
+	alignas(16) short pairs[8];
+	_mm_store_si128((__m128i*)pairs, _mm_maddubs_epi16(date, tens));
+
+	//16 digit fraction: 2 digits -> 4 digits -> 8 digits
+	const __m128i f2 = _mm_maddubs_epi16(frac, tens);
+	const __m128i f4 = _mm_madd_epi16(f2, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+	const __m128i f8 = _mm_madd_epi16(_mm_packus_epi32(f4, f4), _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+
+	values[int(fmtfield::year)] = pairs[0] * 100 + pairs[1];
+	values[int(fmtfield::month)] = pairs[2];
+	values[int(fmtfield::day)] = pairs[3];
+	values[int(fmtfield::hour)] = pairs[4];
+	values[int(fmtfield::minute)] = pairs[5];
+	values[int(fmtfield::second)] = pairs[6];
+	values[int(fmtfield::milli)] = 0;
+	values[int(fmtfield::nano)] = _mm_cvtsi128_si32(f8) * 100000000 + _mm_extract_epi32(f8, 1);
+}
+
+CHRONOWRAP_TARGET("sse4.2")
+inline bool simdkernel_sse42(const char* src, const unsigned char* sub, const unsigned char* limit,
+	const unsigned char* datelo, const unsigned char* datehi, const unsigned char* fraclo, const unsigned char* frachi, int* values)
+{
+	const __m128i lo = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)src), _mm_load_si128((const __m128i*)sub));
+	const __m128i hi = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(src + 16)), _mm_load_si128((const __m128i*)(sub + 16)));
+	const __m128i limlo = _mm_load_si128((const __m128i*)limit);
+	const __m128i limhi = _mm_load_si128((const __m128i*)(limit + 16));
+	const __m128i ok = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(lo, limlo), limlo), _mm_cmpeq_epi8(_mm_max_epu8(hi, limhi), limhi));
+	if (_mm_movemask_epi8(ok) != 0xFFFF)
+		return false;
+
+	simdfields(lo, hi, datelo, datehi, fraclo, frachi, values);
+	return true;
+}
+
+CHRONOWRAP_TARGET("avx2")
+inline bool simdkernel_avx2(const char* src, const unsigned char* sub, const unsigned char* limit,
+	const unsigned char* datelo, const unsigned char* datehi, const unsigned char* fraclo, const unsigned char* frachi, int* values)
+{
+	//Whole timestamp validated in one register
+	const __m256i digits = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i*)src), _mm256_load_si256((const __m256i*)sub));
+	const __m256i lim = _mm256_load_si256((const __m256i*)limit);
+	if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(digits, lim), lim)) != -1)
+		return false;
+
+	//pshufb doesn't cross 128 bit lanes, so the gather is done on the two halves
+	simdfields(_mm256_castsi256_si128(digits), _mm256_extracti128_si256(digits, 1), datelo, datehi, fraclo, frachi, values);
+	return true;
+}
+#endif
+
+inline bool simd_parser::kernel(const char* src, int* values) const
+{
+#ifdef CHRONOWRAP_X86
+	if (level == simdlevel::avx2)
+		return simdkernel_avx2(src, sub, limit, datelo, datehi, fraclo, frachi, values);
+	if (level == simdlevel::sse42)
+		return simdkernel_sse42(src, sub, limit, datelo, datehi, fraclo, frachi, values);
+#endif
+	return false;
+}
+
+inline bool simd_parser::parse(std::string_view tstamp, timestamp& out, const tzone& zone) const
+{
+	if (level != simdlevel::scalar && tstamp.size() >= format.maxlength())
+	{
+		int values[FMT_FIELDCOUNT];
+		resetfields(values);
+		bool ok;
+		if (tstamp.size() >= WIDTH)
+			ok = kernel(tstamp.data(), values);
+		else
+		{
+			//Never load past the end of the caller's string
+			char buf[WIDTH] = {};
+			memcpy(buf, tstamp.data(), tstamp.size());
+			ok = kernel(buf, values);
+		}
+		const char* const tend = tstamp.data() + tstamp.size();
+		for (size_t i = 0; ok && i < scalarcount; ++i)
+			ok = bool(readfield(scalarops[i], tstamp.data() + scalarops[i].offset, tend, values));
+		if (ok)
+			return format.issimple() ? out.assignfields(values, zone) : out.assignresolved(values, 0, &zone);
+	}
+	return out.fromstring(tstamp, format, zone);
+}
+
+//Parses count strings into out. Entries that fail to parse are left as invalid timestamps. Returns the number parsed.
+inline size_t parse_batch(const std::string_view* in, timestamp* out, size_t count, const compiled_format& format)
+{
+	const simd_parser parser(format);
+	size_t parsed = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		out[i] = timestamp();
+		parsed += parser.parse(in[i], out[i]);
+	}
+	return parsed;
+}
+
+//As above, also counting the failures in stats by field and reason. Only failures are parsed again to find out why,
+//so a clean batch costs the same as without stats.
+inline size_t parse_batch(const std::string_view* in, timestamp* out, size_t count, const compiled_format& format, parse_stats& stats)
+{
+	const simd_parser parser(format);
+	const std::uint64_t before = stats.parsed;
+	for (size_t i = 0; i < count; ++i)
+	{
+		out[i] = timestamp();
+		if (parser.parse(in[i], out[i]))
+			++stats.parsed;
+		else
+			stats.add(i, out[i].tryparse(in[i], format));
+	}
+	return size_t(stats.parsed - before);
+}
@@ -0,0 +1,427 @@
+#pragma once
+
+#include "chronowrap.hpp"
+
+#include <thread>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//Hierarchical timing wheel for large numbers of timeouts.
+//Timers are intrusive: derive from timer_node and the wheel links the node itself, so arming never allocates.
+//A node must be cancelled before it is destroyed, and armed nodes must outlive their wheel.
+//Scheduling and cancelling are O(1). LEVELS wheels of 64 slots each cover 64^LEVELS ticks ahead of the current time
+//(over two years at the default 1ms tick); anything further out waits on an overflow list.
+//Deadlines are rounded up to a whole tick, so timers never fire early and fire at most one tick plus the gap between
+//advance() calls late. A timer_wheel is not thread safe; sharded_timer_wheel puts one behind a lock per core.
+//
+//	struct request_timeout : timer_node { int id; };
+//	wheel.schedule(timeout, timestamp::now() + seconds<int>(30));
+//	wheel.advance(compact_timestamp::now(), [](timer_node& n) { retry(static_cast<request_timeout&>(n).id); });
+
+class timer_node
+{
+	timer_node* next = nullptr;
+	timer_node* prev = nullptr;
+	std::int64_t due = 0;  //in ticks
+	std::uint32_t shard = 0;
+
+	friend class timer_wheel;
+	friend class sharded_timer_wheel;
+
+public:
+	timer_node() = default;
+	//Links belong to the wheel, so copies start out unarmed
+	timer_node(const timer_node&) {}
+	timer_node& operator=(const timer_node&) { return *this; }
+
+	bool isarmed() const { return prev != nullptr; }
+};
+
+class timer_wheel
+{
+public:
+	static const int SLOTBITS = 6;
+	static const int SLOTS = 1 << SLOTBITS;
+	static const int LEVELS = 6;
+
+private:
+	using t_nsec = std::chrono::nanoseconds;
+
+	//Slot lists are circular with the sentinel in the array, so unlinking needs no head pointer
+	timer_node slots[LEVELS][SLOTS];
+	timer_node overflow;
+	timer_node ready;                     //already due when scheduled
+	timer_node firing;                    //the list expire() is working through
+	std::uint64_t occupied[LEVELS] = {};  //bit per non-empty slot
+	std::int64_t tick;                    //ns per tick
+	std::int64_t current;                 //every tick up to and including this one has been processed
+	size_t armed = 0;
+
+	static int lowestbit(std::uint64_t mask)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanForward64(&index, mask);
+		return int(index);
+#elif defined(_MSC_VER)
+		unsigned long index;
+		if (_BitScanForward(&index, (unsigned long)mask))
+			return int(index);
+		_BitScanForward(&index, (unsigned long)(mask >> 32));
+		return int(index) + 32;
+#else
+		return __builtin_ctzll(mask);
+#endif
+	}
+
+	static void linkbefore(timer_node& head, timer_node& node)
+	{
+		node.prev = head.prev;
+		node.next = &head;
+		head.prev->next = &node;
+		head.prev = &node;
+	}
+	static bool isempty(const timer_node& head) { return head.next == &head; }
+
+	std::int64_t toticks(std::int64_t ns) const;
+	void place(timer_node& node);
+	void unlink(timer_node& node);
+	void cascade(int level, int slot);
+	std::int64_t nextevent() const;
+	template<class Callback> size_t expire(timer_node& head, Callback& cb);
+
+public:
+	//The wheel starts at the given time. Deadlines before it fire on the next advance().
+	explicit timer_wheel(const compact_timestamp& start = compact_timestamp::now(), t_nsec resolution = std::chrono::milliseconds(1));
+	explicit timer_wheel(const timestamp& start, t_nsec resolution = std::chrono::milliseconds(1)) : timer_wheel(compact_timestamp(start), resolution) {}
+	timer_wheel(const timer_wheel&) = delete;
+	timer_wheel& operator=(const timer_wheel&) = delete;
+	//Armed nodes are left unarmed
+	~timer_wheel() { clear(); }
+
+	//Arms node to fire at deadline, moving it if it is already armed on this wheel
+	void schedule(timer_node& node, const compact_timestamp& deadline);
+	void schedule(timer_node& node, const timestamp& deadline) { schedule(node, compact_timestamp(deadline)); }
+	//Returns false if the node wasn't armed
+	bool cancel(timer_node& node);
+	//Disarms every timer without firing it
+	void clear();
+
+	//Moves the wheel forward to now and calls cb(timer_node&) for every timer due by then, earliest tick first.
+	//Nodes are disarmed before their callback, which may schedule or cancel any timer, including the one firing.
+	//Returns the number fired.
+	template<class Callback> size_t advance(const compact_timestamp& now, Callback&& cb);
+	template<class Callback> size_t advance(const timestamp& now, Callback&& cb) { return advance(compact_timestamp(now), cb); }
+
+	size_t size() const { return armed; }
+	bool empty() const { return armed == 0; }
+	t_nsec resolution() const { return t_nsec(tick); }
+	//The last tick processed
+	compact_timestamp currenttime() const { return compact_timestamp(current * tick); }
+};
+
+//One timer_wheel per shard, each behind its own mutex. Threads schedule onto a shard picked round robin on first use,
+//so with a shard per core, and each core advancing its own shard, the locks are almost never contended.
+//A node remembers its shard, so it can be cancelled from any thread.
+class sharded_timer_wheel
+{
+	struct shard_t
+	{
+		alignas(64) std::mutex lock;
+		timer_wheel wheel;
+		shard_t(const compact_timestamp& start, std::chrono::nanoseconds resolution) : wheel(start, resolution) {}
+	};
+	std::vector<std::unique_ptr<shard_t>> shards;
+
+	static size_t threadslot()
+	{
+		static std::atomic<size_t> next{ 0 };
+		thread_local const size_t slot = next.fetch_add(1, std::memory_order_relaxed);
+		return slot;
+	}
+
+public:
+	//0 uses one shard per hardware thread
+	explicit sharded_timer_wheel(size_t count = 0, const compact_timestamp& start = compact_timestamp::now(), std::chrono::nanoseconds resolution = std::chrono::milliseconds(1))
+	{
+		count = count ? count : std::max<size_t>(1, std::thread::hardware_concurrency());
+		for (size_t i = 0; i < count; ++i)
+			shards.emplace_back(new shard_t(start, resolution));
+	}
+
+	size_t shardcount() const { return shards.size(); }
+	//The shard this thread schedules onto
+	size_t threadshard() const { return threadslot() % shards.size(); }
+
+	//An armed node is moved to this thread's shard
+	void schedule(timer_node& node, const compact_timestamp& deadline)
+	{
+		const size_t i = threadshard();
+		if (node.isarmed() && node.shard != i)
+			cancel(node);
+		std::lock_guard<std::mutex> guard(shards[i]->lock);
+		shards[i]->wheel.schedule(node, deadline);
+		node.shard = std::uint32_t(i);
+	}
+	void schedule(timer_node& node, const timestamp& deadline) { schedule(node, compact_timestamp(deadline)); }
+	bool cancel(timer_node& node)
+	{
+		shard_t& s = *shards[node.shard];
+		std::lock_guard<std::mutex> guard(s.lock);
+		return s.wheel.cancel(node);
+	}
+
+	//Advances one shard. Callbacks run with that shard's lock held, so they must not schedule or cancel on it;
+	//collect the fired nodes and re-arm them afterwards instead.
+	template<class Callback> size_t advance(size_t shard, const compact_timestamp& now, Callback&& cb)
+	{
+		std::lock_guard<std::mutex> guard(shards[shard]->lock);
+		return shards[shard]->wheel.advance(now, cb);
+	}
+	//Advances every shard in turn
+	template<class Callback> size_t advance(const compact_timestamp& now, Callback&& cb)
+	{
+		size_t fired = 0;
+		for (size_t i = 0; i < shards.size(); ++i)
+			fired += advance(i, now, cb);
+		return fired;
+	}
+
+	size_t size()
+	{
+		size_t ret = 0;
+		for (auto& s : shards)
+		{
+			std::lock_guard<std::mutex> guard(s->lock);
+			ret += s->wheel.size();
+		}
+		return ret;
+	}
+};
+
+inline timer_wheel::timer_wheel(const compact_timestamp& start, t_nsec resolution) : tick(std::max<std::int64_t>(1, resolution.count()))
+{
+	for (auto& level : slots)
+		for (auto& head : level)
+			head.next = head.prev = &head;
+	overflow.next = overflow.prev = &overflow;
+	ready.next = ready.prev = &ready;
+	firing.next = firing.prev = &firing;
+	//Floor, so start itself is the current tick even before the epoch
+	const std::int64_t ns = start.isvalid() ? start.count() : 0;
+	current = ns / tick - (ns % tick < 0);
+}
+
+inline std::int64_t timer_wheel::toticks(std::int64_t ns) const
+{
+	//Rounded up: a timer due part way through a tick fires at its end
+	return ns / tick + (ns % tick > 0);
+}
+
+inline void timer_wheel::place(timer_node& node)
+{
+	//Due no earlier than the current tick. Due on it exactly only while cascading, just before the slot is expired.
+	const std::int64_t due = node.due;
+	const std::uint64_t delta = std::uint64_t(due - current);
+	for (int level = 0; level < LEVELS; ++level)
+	{
+		if (delta < (std::uint64_t(1) << (SLOTBITS * (level + 1))))
+		{
+			const int slot = int((due >> (SLOTBITS * level)) & (SLOTS - 1));
+			linkbefore(slots[level][slot], node);
+			occupied[level] |= std::uint64_t(1) << slot;
+			return;
+		}
+	}
+	linkbefore(overflow, node);
+}
+
+inline void timer_wheel::unlink(timer_node& node)
+{
+	timer_node* const prev = node.prev;
+	timer_node* const next = node.next;
+	prev->next = next;
+	next->prev = prev;
+	node.next = node.prev = nullptr;
+	//Only a sentinel is left: clear its slot's bit
+	if (prev == next && prev != &overflow && prev != &ready && prev != &firing)
+	{
+		const size_t index = size_t(prev - &slots[0][0]);
+		occupied[index / SLOTS] &= ~(std::uint64_t(1) << (index % SLOTS));
+	}
+}
+
+inline void timer_wheel::schedule(timer_node& node, const compact_timestamp& deadline)
+{
+	if (node.isarmed())
+		unlink(node);
+	else
+		++armed;
+	node.due = deadline.isvalid() ? toticks(deadline.count()) : current;
+	if (node.due <= current)
+		linkbefore(ready, node);
+	else
+		place(node);
+}
+
+inline bool timer_wheel::cancel(timer_node& node)
+{
+	if (!node.isarmed())
+		return false;
+	unlink(node);
+	--armed;
+	return true;
+}
+
+inline void timer_wheel::clear()
+{
+	auto drop = [](timer_node& head) {
+		for (timer_node* n = head.next; n != &head;)
+		{
+			timer_node* const next = n->next;
+			n->next = n->prev = nullptr;
+			n = next;
+		}
+		head.next = head.prev = &head;
+	};
+	for (int level = 0; level < LEVELS; ++level)
+	{
+		for (std::uint64_t bits = occupied[level]; bits; bits &= bits - 1)
+			drop(slots[level][lowestbit(bits)]);
+		occupied[level] = 0;
+	}
+	drop(overflow);
+	drop(ready);
+	drop(firing);
+	armed = 0;
+}
+
+//Re-places every timer in one slot relative to the current tick. They all land on lower levels.
+inline void timer_wheel::cascade(int level, int slot)
+{
+	timer_node& head = slots[level][slot];
+	if (isempty(head))
+		return;
+	timer_node* n = head.next;
+	head.prev->next = nullptr;
+	head.next = head.prev = &head;
+	occupied[level] &= ~(std::uint64_t(1) << slot);
+	while (n)
+	{
+		timer_node* const next = n->next;
+		place(*n);
+		n = next;
+	}
+}
+
+//The first tick after the current one with a slot to expire or cascade. Empty ticks in between are skipped.
+inline std::int64_t timer_wheel::nextevent() const
+{
+	//Slots hold the next 64 steps of their level in circular order, starting just after the current step
+	auto distance = [](std::uint64_t mask, int index) -> std::int64_t {
+		const std::uint64_t later = index == SLOTS - 1 ? 0 : mask & (~std::uint64_t(0) << (index + 1));
+		return later ? lowestbit(later) - index : lowestbit(mask) + SLOTS - index;
+	};
+
+	//Anything left in level 0's window comes before every cascade
+	const int index = int(current & (SLOTS - 1));
+	if (const std::uint64_t later = index == SLOTS - 1 ? 0 : occupied[0] & (~std::uint64_t(0) << (index + 1)))
+		return current + (lowestbit(later) - index);
+
+	std::int64_t next = INT64_MAX;
+	if (occupied[0])
+		next = current + distance(occupied[0], index);
+	for (int level = 1; level < LEVELS; ++level)
+	{
+		if (!occupied[level])
+			continue;
+		const int shift = SLOTBITS * level;
+		const std::int64_t step = current >> shift;
+		next = std::min(next, (step + distance(occupied[level], int(step & (SLOTS - 1)))) << shift);
+	}
+	if (!isempty(overflow))
+	{
+		const int shift = SLOTBITS * LEVELS;
+		next = std::min(next, ((current >> shift) + 1) << shift);
+	}
+	return next;
+}
+
+template<class Callback>
+inline size_t timer_wheel::expire(timer_node& head, Callback& cb)
+{
+	if (isempty(head))
+		return 0;
+	//Move the whole list onto firing first, so callbacks re-arming onto head aren't fired again in this pass.
+	//Nodes come off firing one at a time, so a callback cancelling or moving one still waiting unlinks it from there.
+	firing.next = head.next;
+	firing.prev = head.prev;
+	firing.next->prev = &firing;
+	firing.prev->next = &firing;
+	head.next = head.prev = &head;
+	size_t fired = 0;
+	while (!isempty(firing))
+	{
+		timer_node& n = *firing.next;
+		unlink(n);
+		--armed;
+		++fired;
+		cb(n);
+	}
+	return fired;
+}
+
+template<class Callback>
+inline size_t timer_wheel::advance(const compact_timestamp& now, Callback&& cb)
+{
+	if (!now.isvalid())
+		return 0;
+	const std::int64_t target = now.count() / tick - (now.count() % tick < 0);
+	size_t fired = expire(ready, cb);
+	while (current < target)
+	{
+		if (!armed)
+		{
+			current = target;
+			break;
+		}
+		const std::int64_t next = nextevent();
+		if (next > target)
+		{
+			current = target;
+			break;
+		}
+		current = next;
+
+		//Crossed into a new window: bring the next slot of each level above down, as far up as the wrap goes
+		if (!(current & (SLOTS - 1)))
+		{
+			int level = 1;
+			for (; level < LEVELS; ++level)
+			{
+				const int slot = int((current >> (SLOTBITS * level)) & (SLOTS - 1));
+				cascade(level, slot);
+				if (slot)
+					break;
+			}
+			if (level == LEVELS && !isempty(overflow))
+			{
+				timer_node* n = overflow.next;
+				overflow.prev->next = nullptr;
+				overflow.next = overflow.prev = &overflow;
+				while (n)
+				{
+					timer_node* const following = n->next;
+					place(*n);
+					n = following;
+				}
+			}
+		}
+		const int slot = int(current & (SLOTS - 1));
+		occupied[0] &= ~(std::uint64_t(1) << slot);
+		fired += expire(slots[0][slot], cb);
+	}
+	return fired;
+}
@@ -0,0 +1,354 @@
+#pragma once
+
+#include "chronowrap_tscclock.hpp"
+
+#include <cstdio>
+
+//In-process tracing. CHRONO_SCOPE("name") times the rest of the enclosing scope and queues the event on a per-thread
+//lock-free ring. A drain thread empties the rings in batches and writes them out as Chrome trace JSON (chrome://tracing,
+//Perfetto), a compact binary stream, or text lines using the timestamp formatter.
+//Define CHRONOWRAP_TRACE to turn the macros on. Without it they expand to nothing at all.
+//Names must be string literals, or otherwise outlive the trace session, since only the pointer is queued.
+//
+//	CHRONO_TRACE_START("trace.json", trace_format::chrome_json);
+//	{ CHRONO_SCOPE("parse"); ... }
+//	CHRONO_TRACE_STOP();
+
+enum class trace_format { chrome_json, binary, text };
+
+struct trace_event
+{
+	const char* name;
+	std::int64_t start; //ns since the epoch
+	std::int64_t end;
+	std::uint32_t thread;
+};
+
+//Single producer (the owning thread), single consumer (the drain thread). Full rings drop events and count them.
+class trace_ring
+{
+public:
+	static const size_t CAPACITY = size_t(1) << 12;
+
+private:
+	alignas(64) std::atomic<size_t> head{ 0 };
+	alignas(64) std::atomic<size_t> tail{ 0 };
+	alignas(64) trace_event events[CAPACITY];
+
+public:
+	const std::uint32_t thread;
+	std::atomic<std::uint64_t> dropped{ 0 };
+	std::atomic<bool> orphaned{ false }; //the owning thread has exited
+
+	explicit trace_ring(std::uint32_t tid) : thread(tid) {}
+
+	void push(const trace_event& e)
+	{
+		const size_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == CAPACITY)
+		{
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		events[h % CAPACITY] = e;
+		head.store(h + 1, std::memory_order_release);
+	}
+
+	//Moves everything queued so far onto out. Returns false if the ring was empty.
+	bool drain(std::vector<trace_event>& out)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		const size_t h = head.load(std::memory_order_acquire);
+		if (t == h)
+			return false;
+		for (; t != h; ++t)
+			out.push_back(events[t % CAPACITY]);
+		tail.store(h, std::memory_order_release);
+		return true;
+	}
+};
+
+//Process wide session. Rings are registered once per thread, the only time recording takes a lock.
+//That lock, ringlock, only guards the ring list, so a thread registering never waits on the drain thread's file writes.
+class trace_session
+{
+	std::mutex lock;
+	std::condition_variable wake;
+	std::mutex ringlock;
+	std::vector<std::shared_ptr<trace_ring>> rings;
+	std::uint32_t nextthread = 1;
+	std::unique_ptr<tsc_clock> clock;
+
+	FILE* file = nullptr;
+	trace_format format = trace_format::chrome_json;
+	std::thread drainer;
+	std::chrono::milliseconds period{ 100 };
+	bool stopping = false;
+	bool firstevent = true;
+	std::uint64_t lostevents = 0;
+	std::map<const char*, std::uint32_t> names; //binary format name ids
+	std::int64_t lastbinary = 0;
+
+	trace_session() = default;
+
+	trace_ring& threadring();
+	void run();
+	void drainall();
+	void write(const std::vector<trace_event>& batch);
+
+public:
+	//Read by every scope before touching the session, so a stopped session costs one load.
+	//Set with release once the clock exists, so a scope that sees it set can use the clock.
+	static inline std::atomic<bool> enabled{ false };
+
+	static trace_session& instance()
+	{
+		static trace_session session;
+		return session;
+	}
+	trace_session(const trace_session&) = delete;
+	trace_session& operator=(const trace_session&) = delete;
+	~trace_session() { stop(); }
+
+	//Opens path and starts the drain thread. Returns false if a session is already running or the file can't be opened.
+	bool start(const std::string& path, trace_format fmt, std::chrono::milliseconds drainperiod = std::chrono::milliseconds(100));
+	//Writes out everything queued, finishes the file and closes it
+	void stop();
+	bool isrunning() const { return enabled.load(std::memory_order_acquire); }
+	//Events lost to full rings in the last session
+	std::uint64_t dropped() const { return lostevents; }
+
+	std::int64_t now() const { return clock->nowns(); }
+	void record(const char* name, std::int64_t start, std::int64_t end)
+	{
+		trace_ring& ring = threadring();
+		ring.push({ name, start, end, ring.thread });
+	}
+};
+
+//Times its own lifetime. Sessions started part way through a scope don't record it.
+class trace_scope
+{
+	const char* name;
+	std::int64_t start = 0;
+
+public:
+	explicit trace_scope(const char* n) : name(n)
+	{
+		if (trace_session::enabled.load(std::memory_order_acquire))
+			start = trace_session::instance().now();
+	}
+	trace_scope(const trace_scope&) = delete;
+	trace_scope& operator=(const trace_scope&) = delete;
+	~trace_scope()
+	{
+		if (start && trace_session::enabled.load(std::memory_order_acquire))
+		{
+			trace_session& session = trace_session::instance();
+			session.record(name, start, session.now());
+		}
+	}
+};
+
+#define CHRONOWRAP_CONCAT2(a, b) a##b
+#define CHRONOWRAP_CONCAT(a, b) CHRONOWRAP_CONCAT2(a, b)
+
+#ifdef CHRONOWRAP_TRACE
+#define CHRONO_SCOPE(name) trace_scope CHRONOWRAP_CONCAT(chrono_scope_, __LINE__)(name)
+#define CHRONO_TRACE_START(path, format) trace_session::instance().start(path, format)
+#define CHRONO_TRACE_STOP() trace_session::instance().stop()
+#else
+#define CHRONO_SCOPE(name) ((void)0)
+#define CHRONO_TRACE_START(path, format) false
+#define CHRONO_TRACE_STOP() ((void)0)
+#endif
+
+inline trace_ring& trace_session::threadring()
+{
+	//Hands the ring back to the drain thread when this thread exits
+	struct owner
+	{
+		std::shared_ptr<trace_ring> ring;
+		~owner()
+		{
+			if (ring)
+				ring->orphaned.store(true, std::memory_order_release);
+		}
+	};
+	thread_local owner mine;
+	if (!mine.ring)
+	{
+		std::lock_guard<std::mutex> guard(ringlock);
+		mine.ring = std::make_shared<trace_ring>(nextthread++);
+		rings.push_back(mine.ring);
+	}
+	return *mine.ring;
+}
+
+inline bool trace_session::start(const std::string& path, trace_format fmt, std::chrono::milliseconds drainperiod)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (file)
+		return false;
+#ifdef _MSC_VER
+	fopen_s(&file, path.c_str(), fmt == trace_format::text ? "w" : "wb");
+#else
+	file = fopen(path.c_str(), fmt == trace_format::text ? "w" : "wb");
+#endif
+	if (!file)
+		return false;
+	if (!clock)
+		clock.reset(new tsc_clock());
+
+	//Anything left over from an earlier session belongs to it, not this one
+	std::vector<trace_event> stale;
+	{
+		std::lock_guard<std::mutex> rguard(ringlock);
+		for (auto& ring : rings)
+		{
+			ring->drain(stale);
+			ring->dropped.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	format = fmt;
+	period = drainperiod;
+	stopping = false;
+	firstevent = true;
+	lostevents = 0;
+	names.clear();
+	lastbinary = 0;
+	if (format == trace_format::chrome_json)
+		fputs("{\"traceEvents\":[\n", file);
+	else if (format == trace_format::binary)
+		fwrite("CWT1", 1, 4, file);
+	enabled.store(true, std::memory_order_release);
+	drainer = std::thread(&trace_session::run, this);
+	return true;
+}
+
+inline void trace_session::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!file)
+			return;
+		enabled.store(false, std::memory_order_release);
+		stopping = true;
+	}
+	wake.notify_all();
+	drainer.join();
+
+	std::lock_guard<std::mutex> guard(lock);
+	drainall();
+	if (format == trace_format::chrome_json)
+		fputs("\n]}\n", file);
+	fclose(file);
+	file = nullptr;
+}
+
+inline void trace_session::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (!wake.wait_for(guard, period, [this] { return stopping; }))
+		drainall();
+}
+
+//Called with the lock held. The ring list is swapped out under ringlock, and the rings drained and written without it.
+inline void trace_session::drainall()
+{
+	std::vector<std::shared_ptr<trace_ring>> current;
+	{
+		std::lock_guard<std::mutex> guard(ringlock);
+		current.swap(rings);
+	}
+	std::vector<trace_event> batch;
+	for (auto it = current.begin(); it != current.end();)
+	{
+		trace_ring& ring = **it;
+		//Check before draining, so an event pushed just before the thread exited isn't lost
+		const bool orphaned = ring.orphaned.load(std::memory_order_acquire);
+		ring.drain(batch);
+		lostevents += ring.dropped.exchange(0, std::memory_order_relaxed);
+		it = orphaned ? current.erase(it) : it + 1;
+	}
+	{
+		//Threads that registered meanwhile went onto the emptied list
+		std::lock_guard<std::mutex> guard(ringlock);
+		current.insert(current.end(), rings.begin(), rings.end());
+		rings.swap(current);
+	}
+	if (!batch.empty())
+		write(batch);
+}
+
+inline void trace_session::write(const std::vector<trace_event>& batch)
+{
+	if (format == trace_format::chrome_json)
+	{
+		//Complete events, times in microseconds
+		for (const trace_event& e : batch)
+		{
+			fputs(firstevent ? "" : ",\n", file);
+			firstevent = false;
+			fputs("{\"name\":\"", file);
+			for (const char* c = e.name; *c; ++c)
+			{
+				if (*c == '"' || *c == '\\')
+					fputc('\\', file);
+				if ((unsigned char)*c >= 0x20)
+					fputc(*c, file);
+			}
+			const std::int64_t dur = e.end - e.start;
+			fprintf(file, "\",\"ph\":\"X\",\"ts\":%lld.%03d,\"dur\":%lld.%03d,\"pid\":1,\"tid\":%u}",
+				(long long)(e.start / 1000), int(e.start % 1000), (long long)(dur / 1000), int(dur % 1000), unsigned(e.thread));
+		}
+	}
+	else if (format == trace_format::text)
+	{
+		static constexpr compiled_format TEXTFORMAT("%Y-%M-%d %H:%m:%s.%f");
+		timestamp_formatter formatter(TEXTFORMAT);
+		char stamp[compiled_format::MAX_OUTPUT];
+		for (const trace_event& e : batch)
+		{
+			const size_t len = formatter.format_to(stamp, sizeof(stamp), compact_timestamp(e.start).totimestamp());
+			const double micros = compact_timediff(e.end - e.start).asnanoseconds<double>() / 1000.0;
+			fprintf(file, "%.*s %4u %-24s %12.3fus\n", int(len), stamp, unsigned(e.thread), e.name, micros);
+		}
+	}
+	else
+	{
+		//Records: 'N' id name-length name, defining a name the first time it's seen, then
+		//'E' id thread start-delta(zigzag) duration, all varints
+		std::string out;
+		auto varint = [&](std::uint64_t v) {
+			while (v >= 0x80)
+			{
+				out += char((v & 0x7F) | 0x80);
+				v >>= 7;
+			}
+			out += char(v);
+		};
+		for (const trace_event& e : batch)
+		{
+			auto found = names.find(e.name);
+			if (found == names.end())
+			{
+				found = names.emplace(e.name, std::uint32_t(names.size())).first;
+				const size_t len = strlen(e.name);
+				out += 'N';
+				varint(found->second);
+				varint(len);
+				out.append(e.name, len);
+			}
+			const std::int64_t delta = e.start - lastbinary;
+			lastbinary = e.start;
+			out += 'E';
+			varint(found->second);
+			varint(e.thread);
+			varint((std::uint64_t(delta) << 1) ^ std::uint64_t(delta >> 63));
+			varint(std::uint64_t(e.end - e.start));
+		}
+		fwrite(out.data(), 1, out.size(), file);
+	}
+}
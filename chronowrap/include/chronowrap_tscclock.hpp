@@ -0,0 +1,220 @@
+#pragma once
+
+#include "chronowrap_simd.hpp"
+
+#include <condition_variable>
+#include <thread>
+
+//A system_clock that reads the invariant TSC instead of calling into the OS.
+//The counter is calibrated against system_clock when the clock is created and re-synced by a background thread.
+//Each re-sync measures the counter rate over the last period and slews towards system_clock over the next one,
+//so NTP adjustments are followed without the clock jumping. Offsets over MAXSLEW, like a manual clock change, are stepped.
+//Machines without an invariant TSC (and non x86 builds) get system_clock::now() from every call.
+
+//Raw cycle counter, 0 where there isn't one
+inline std::uint64_t readtsc()
+{
+#if defined(CHRONOWRAP_X86) && defined(_MSC_VER)
+	return __rdtsc();
+#elif defined(CHRONOWRAP_X86)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+//True if the TSC runs at a constant rate through frequency and power state changes
+inline bool hasinvarianttsc()
+{
+#ifdef CHRONOWRAP_X86
+	static const bool invariant = [] {
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0x80000000);
+		if (unsigned(info[0]) < 0x80000007u)
+			return false;
+		__cpuid(info, 0x80000007);
+		return (info[3] & (1 << 8)) != 0;
+#else
+		unsigned a, b, c, d;
+		__asm__ volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0x80000000u), "c"(0));
+		if (a < 0x80000007u)
+			return false;
+		__asm__ volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(0x80000007u), "c"(0));
+		return (d & (1u << 8)) != 0;
+#endif
+	}();
+	return invariant;
+#else
+	return false;
+#endif
+}
+
+class tsc_clock
+{
+	using t_nsec = std::chrono::nanoseconds;
+	using t_sysclock = std::chrono::system_clock;
+
+	//Nanoseconds per tick in fixed point
+	static const int SHIFT = 24;
+
+	//One counter reading matched to a system_clock reading
+	struct sample
+	{
+		std::uint64_t tsc;
+		std::int64_t ns;
+	};
+
+	//ns = basens + (tsc - basetsc) * mult >> SHIFT. Published under a sequence lock so readers never block.
+	alignas(64) std::atomic<std::uint32_t> seq{ 0 };
+	std::atomic<std::uint64_t> basetsc{ 0 };
+	std::atomic<std::int64_t> basens{ 0 };
+	std::atomic<std::uint64_t> mult{ 0 };
+
+	alignas(64) bool active = false;
+	t_nsec period;
+	sample last = {};
+	double nspertick = 0;
+	std::thread syncthread;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	static std::int64_t systemns() { return std::chrono::duration_cast<t_nsec>(t_sysclock::now().time_since_epoch()).count(); }
+	static sample takesample();
+	std::int64_t predict(std::uint64_t tsc) const;
+	void publish(std::uint64_t tsc, std::int64_t ns, double rate);
+	void resync();
+	void run();
+
+public:
+	//Largest offset from system_clock corrected by slewing rather than stepping
+	static constexpr t_nsec MAXSLEW = std::chrono::milliseconds(1);
+
+	explicit tsc_clock(t_nsec resyncperiod = std::chrono::seconds(1));
+	tsc_clock(const tsc_clock&) = delete;
+	tsc_clock& operator=(const tsc_clock&) = delete;
+	~tsc_clock();
+
+	//False if the machine has no invariant TSC, in which case now() is system_clock::now()
+	bool isactive() const { return active; }
+
+	//Nanoseconds since the system_clock epoch
+	std::int64_t nowns() const;
+	timestamp now() const { return timestamp(t_sysclock::time_point(std::chrono::duration_cast<t_sysclock::duration>(t_nsec(nowns()))), true); }
+	compact_timestamp nowcompact() const { return compact_timestamp(nowns()); }
+};
+
+//Reads the counter either side of system_clock and keeps the tightest bracket out of a few tries
+inline tsc_clock::sample tsc_clock::takesample()
+{
+	sample best = {};
+	std::uint64_t bestspan = ~std::uint64_t(0);
+	for (int i = 0; i < 7; ++i)
+	{
+		const std::uint64_t before = readtsc();
+		const std::int64_t ns = systemns();
+		const std::uint64_t after = readtsc();
+		if (after - before < bestspan)
+		{
+			bestspan = after - before;
+			best = { before + (after - before) / 2, ns };
+		}
+	}
+	return best;
+}
+
+inline tsc_clock::tsc_clock(t_nsec resyncperiod) : period(resyncperiod)
+{
+	if (!hasinvarianttsc())
+		return;
+
+	//Initial rate over a short window. The first re-sync replaces it with one measured over a whole period.
+	const sample first = takesample();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	last = takesample();
+	if (last.ns <= first.ns || last.tsc <= first.tsc)
+		return;
+	nspertick = double(last.ns - first.ns) / double(last.tsc - first.tsc);
+	publish(last.tsc, last.ns, nspertick);
+	active = true;
+	syncthread = std::thread(&tsc_clock::run, this);
+}
+
+inline tsc_clock::~tsc_clock()
+{
+	if (!syncthread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	syncthread.join();
+}
+
+inline std::int64_t tsc_clock::predict(std::uint64_t tsc) const
+{
+	//Split so the product can't overflow however late a re-sync is
+	const std::uint64_t ticks = tsc - basetsc.load(std::memory_order_relaxed);
+	const std::uint64_t m = mult.load(std::memory_order_relaxed);
+	return basens.load(std::memory_order_relaxed) + std::int64_t(((ticks >> 32) * m << (32 - SHIFT)) + (((ticks & 0xFFFFFFFFu) * m) >> SHIFT));
+}
+
+inline void tsc_clock::publish(std::uint64_t tsc, std::int64_t ns, double rate)
+{
+	const std::uint32_t s = seq.load(std::memory_order_relaxed);
+	seq.store(s + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	basetsc.store(tsc, std::memory_order_relaxed);
+	basens.store(ns, std::memory_order_relaxed);
+	mult.store(std::uint64_t(rate * double(1 << SHIFT) + 0.5), std::memory_order_relaxed);
+	seq.store(s + 2, std::memory_order_release);
+}
+
+inline void tsc_clock::resync()
+{
+	const sample now = takesample();
+	if (now.tsc <= last.tsc || now.ns <= last.ns)
+	{
+		//system_clock went backwards: start again from here
+		publish(now.tsc, now.ns, nspertick);
+		last = now;
+		return;
+	}
+
+	nspertick = double(now.ns - last.ns) / double(now.tsc - last.tsc);
+	last = now;
+
+	//Only the re-sync thread writes, so the current mapping can be read without the sequence check
+	const std::int64_t predicted = predict(now.tsc);
+	const std::int64_t error = now.ns - predicted;
+	if (error > MAXSLEW.count() || error < -MAXSLEW.count())
+	{
+		publish(now.tsc, now.ns, nspertick);
+		return;
+	}
+	//Continue from the current prediction and absorb the error over the next period
+	publish(now.tsc, predicted, nspertick * (1.0 + double(error) / double(period.count())));
+}
+
+inline void tsc_clock::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (!wake.wait_for(guard, period, [this] { return stopping; }))
+		resync();
+}
+
+inline std::int64_t tsc_clock::nowns() const
+{
+	if (!active)
+		return systemns();
+	for (;;)
+	{
+		const std::uint32_t s = seq.load(std::memory_order_acquire);
+		const std::int64_t ns = predict(readtsc());
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (!(s & 1) && seq.load(std::memory_order_relaxed) == s)
+			return ns;
+	}
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "chronowrap.hpp"
+
+#include <thread>
+
+//Rolling counts and sums over the last BUCKETS buckets of a fixed width, e.g. 60 one second buckets for a per minute rate.
+//Events land in the bucket for their time rounded down to the width, in a ring of BUCKETS slots. A slot still holding an
+//older bucket is cleared by the first event for the new one, so nothing needs a timer or a sweep.
+//Adding is lock free: two relaxed fetch_adds once the bucket is current. Queries read every slot, O(BUCKETS).
+//The whole state is 24 bytes a bucket plus the width, so small windows fit in a few cache lines of per key state.
+//Events more than a window older than the newest one seen in their slot are dropped. An add racing the reuse
+//of its slot a whole window later can land in the newer bucket, which only matters if events arrive that late.
+template<size_t BUCKETS = 8>
+class sliding_window
+{
+	static_assert(BUCKETS >= 1, "sliding_window: needs at least one bucket");
+
+	//Bucket numbers that can't come from a time
+	static const std::int64_t RESETTING = INT64_MIN;
+	static const std::int64_t UNUSED = INT64_MIN + 1;
+
+	struct bucket
+	{
+		std::atomic<std::int64_t> index{ UNUSED };
+		std::atomic<std::uint64_t> count{ 0 };
+		std::atomic<std::int64_t> sum{ 0 };
+	};
+
+	alignas(64) bucket buckets[BUCKETS];
+	std::int64_t width;
+
+	std::int64_t bucketof(std::int64_t ns) const { return ns / width - (ns % width < 0); }
+	static size_t slotof(std::int64_t index) { return size_t(std::uint64_t(index) % BUCKETS); }
+
+	//Count and sum over the buckets in (last - span, last]
+	void total(std::int64_t last, size_t span, std::uint64_t& count, std::int64_t& sum) const;
+
+public:
+	explicit sliding_window(timediff bucketwidth = seconds<int>(1)) : width(std::max<std::int64_t>(1, bucketwidth.asnanoseconds<std::int64_t>())) {}
+	sliding_window(const sliding_window&) = delete;
+	sliding_window& operator=(const sliding_window&) = delete;
+
+	void add(const compact_timestamp& t, std::int64_t value = 1);
+	void add(const timestamp& t, std::int64_t value = 1) { add(compact_timestamp(t), value); }
+
+	//Over the whole window ending in now's bucket, or its last span buckets
+	std::uint64_t count(const compact_timestamp& now, size_t span = BUCKETS) const;
+	std::int64_t sum(const compact_timestamp& now, size_t span = BUCKETS) const;
+	//Sum divided by count, 0 if empty
+	double mean(const compact_timestamp& now, size_t span = BUCKETS) const;
+	//Events per second. The current bucket is only counted for the part of it that has elapsed.
+	double rate(const compact_timestamp& now, size_t span = BUCKETS) const;
+	std::uint64_t count(const timestamp& now, size_t span = BUCKETS) const { return count(compact_timestamp(now), span); }
+	std::int64_t sum(const timestamp& now, size_t span = BUCKETS) const { return sum(compact_timestamp(now), span); }
+	double mean(const timestamp& now, size_t span = BUCKETS) const { return mean(compact_timestamp(now), span); }
+	double rate(const timestamp& now, size_t span = BUCKETS) const { return rate(compact_timestamp(now), span); }
+
+	void reset();
+
+	compact_timediff bucketwidth() const { return compact_timediff(width); }
+	compact_timediff window() const { return compact_timediff(width * std::int64_t(BUCKETS)); }
+};
+
+template<size_t BUCKETS>
+inline void sliding_window<BUCKETS>::add(const compact_timestamp& t, std::int64_t value)
+{
+	if (!t.isvalid())
+		return;
+	const std::int64_t index = bucketof(t.count());
+	bucket& b = buckets[slotof(index)];
+	std::int64_t current = b.index.load(std::memory_order_acquire);
+	for (;;)
+	{
+		if (current == index)
+		{
+			b.count.fetch_add(1, std::memory_order_relaxed);
+			b.sum.fetch_add(value, std::memory_order_relaxed);
+			return;
+		}
+		if (current == RESETTING)
+		{
+			std::this_thread::yield();
+			current = b.index.load(std::memory_order_acquire);
+			continue;
+		}
+		if (current > index)
+			return;
+		//The slot holds an older bucket: take it over, clear it, then open it to adds
+		if (b.index.compare_exchange_weak(current, RESETTING, std::memory_order_acquire))
+		{
+			b.count.store(0, std::memory_order_relaxed);
+			b.sum.store(0, std::memory_order_relaxed);
+			b.index.store(index, std::memory_order_release);
+			current = index;
+		}
+	}
+}
+
+template<size_t BUCKETS>
+inline void sliding_window<BUCKETS>::total(std::int64_t last, size_t span, std::uint64_t& count, std::int64_t& sum) const
+{
+	count = 0;
+	sum = 0;
+	span = std::min(span, BUCKETS);
+	for (const bucket& b : buckets)
+	{
+		const std::int64_t index = b.index.load(std::memory_order_acquire);
+		if (index == RESETTING || index == UNUSED || index > last || index <= last - std::int64_t(span))
+			continue;
+		const std::uint64_t c = b.count.load(std::memory_order_relaxed);
+		const std::int64_t s = b.sum.load(std::memory_order_relaxed);
+		//Reused while being read: it now belongs to a later bucket
+		if (b.index.load(std::memory_order_acquire) != index)
+			continue;
+		count += c;
+		sum += s;
+	}
+}
+
+template<size_t BUCKETS>
+inline std::uint64_t sliding_window<BUCKETS>::count(const compact_timestamp& now, size_t span) const
+{
+	std::uint64_t c;
+	std::int64_t s;
+	total(bucketof(now.count()), span, c, s);
+	return c;
+}
+
+template<size_t BUCKETS>
+inline std::int64_t sliding_window<BUCKETS>::sum(const compact_timestamp& now, size_t span) const
+{
+	std::uint64_t c;
+	std::int64_t s;
+	total(bucketof(now.count()), span, c, s);
+	return s;
+}
+
+template<size_t BUCKETS>
+inline double sliding_window<BUCKETS>::mean(const compact_timestamp& now, size_t span) const
+{
+	std::uint64_t c;
+	std::int64_t s;
+	total(bucketof(now.count()), span, c, s);
+	return c ? double(s) / double(c) : 0.0;
+}
+
+template<size_t BUCKETS>
+inline double sliding_window<BUCKETS>::rate(const compact_timestamp& now, size_t span) const
+{
+	const std::int64_t last = bucketof(now.count());
+	span = std::max<size_t>(1, std::min(span, BUCKETS));
+	std::uint64_t c;
+	std::int64_t s;
+	total(last, span, c, s);
+	//Whole buckets before now's, plus however far into it now is
+	const std::int64_t covered = std::int64_t(span - 1) * width + (now.count() - last * width) + 1;
+	return double(c) * 1e9 / double(covered);
+}
+
+template<size_t BUCKETS>
+inline void sliding_window<BUCKETS>::reset()
+{
+	for (bucket& b : buckets)
+	{
+		b.index.store(RESETTING, std::memory_order_relaxed);
+		b.count.store(0, std::memory_order_relaxed);
+		b.sum.store(0, std::memory_order_relaxed);
+		b.index.store(UNUSED, std::memory_order_release);
+	}
+}
@@ -3,12 +3,1110 @@
 //Just tests basic functionality of chronowrap
 */
 
+#include "chronowrap_array.hpp"
+#include "chronowrap_coarseclock.hpp"
+#include "chronowrap_detect.hpp"
+#include "chronowrap_histogram.hpp"
+#include "chronowrap_logreader.hpp"
+#include "chronowrap_parallel.hpp"
+#include "chronowrap_ratelimit.hpp"
+#include "chronowrap_simd.hpp"
+#include "chronowrap_timerwheel.hpp"
+#include "chronowrap_trace.hpp"
+#include "chronowrap_tscclock.hpp"
+#include "chronowrap_window.hpp"
+
+#include <cstdio>
+#include <sstream>
+
 
 const char CHRONOFORMAT[] = "%Y/%M/%d %H:%m:%s.%x";
 //const char TIMECLASSFORMAT[] = "YYYY/MM/DD HH:mm:ss.xxx";
 const char TIMESTAMP[] = "2018/07/14 22:14:35.243";
 
+//tsc_clock should stay within a millisecond of system_clock while it re-syncs. Returns the number of failures.
+int testtscclock()
+{
+	const tsc_clock clock(std::chrono::milliseconds(100));
+	if (!clock.isactive())
+	{
+		printf("tsc_clock: no invariant TSC, using system_clock\n");
+		return 0;
+	}
+
+	long long worst = 0;
+	for (int i = 0; i < 100; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		const long long sys = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		const long long diff = clock.nowns() - sys;
+		worst = std::max(worst, diff < 0 ? -diff : diff);
+	}
+	printf("tsc_clock: worst offset from system_clock %lld ns over 1s\n", worst);
+	return worst > 1000000;
+}
+
+//coarse_clock should trail system_clock by no more than its worst tick gap plus the source resolution, and be invalid when stopped
+int testcoarseclock()
+{
+	coarse_clock clock(std::chrono::milliseconds(1));
+	clock.start();
+	long long worst = 0;
+	for (int i = 0; i < 200; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(700));
+		//Source first, so a preemption before the load can only make the cached value fresher
+		const long long source = compact_timestamp::now().count();
+		worst = std::max(worst, source - clock.nowcompact().count());
+	}
+	//Let a tick land after the last sample, so every sample falls inside a gap maxlag has seen
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	const long long resolution = clock.maxstaleness().count() - 1000000;
+	const long long lag = clock.maxlag().count();
+	clock.stop();
+	printf("coarse_clock: worst %lld ns behind, worst tick gap %lld ns\n", worst, lag);
+	return (worst > lag + resolution) + clock.now().isvalid();
+}
+
+//Limiters driven with explicit times, so the expected decisions are exact. Returns the number of failures.
+int testratelimit()
+{
+	struct fixed_clock
+	{
+		compact_timestamp at{ 1000000000000 };
+		compact_timestamp nowcompact() const { return at; }
+	} clock;
+	const compact_timestamp t0 = clock.at;
+	const compact_timediff ms = std::chrono::milliseconds(1);
+	int failures = 0;
+
+	//10 tokens, one back every ms
+	token_bucket<fixed_clock> bucket(clock, milliseconds<int>(1), 10);
+	failures += !bucket.tryacquire(t0, 4);
+	failures += bucket.acquireupto(t0, 10) != 6;
+	failures += bucket.tryacquire(t0);
+	failures += bucket.timeuntil(t0, 3).count() != 3 * ms.count();
+	failures += bucket.available(t0 + ms * 3) != 3;
+	failures += bucket.tryacquire(t0 + ms * 100, 11);
+	failures += bucket.available(t0 + ms * 100) != 10;
+	//Drained as of 5ms: an earlier now gets nothing rather than a wrapped count
+	failures += bucket.acquireupto(t0 + ms * 105, 10) != 10;
+	failures += bucket.acquireupto(t0 + ms * 102, 100) != 0;
+	failures += bucket.tryacquire(t0 + ms * 102);
+
+	//One every ms, bursts of 3
+	gcra_limiter<fixed_clock> limiter(clock, milliseconds<int>(1), 3);
+	compact_timediff retry;
+	int admitted = 0;
+	for (int i = 0; i < 5; ++i)
+		admitted += limiter.allow(t0, 1, &retry);
+	failures += admitted != 3;
+	failures += retry.count() != ms.count();
+	failures += !limiter.allow(t0 + ms, 1);
+	failures += limiter.allow(t0 + ms, 2, &retry);
+	failures += retry.count() != 2 * ms.count();
+
+	//A stopped coarse_clock reads invalid: everything is refused, and nothing wraps
+	coarse_clock stopped;
+	stopped.start();
+	stopped.stop();
+	token_bucket<coarse_clock> idle(stopped, milliseconds<int>(1), 10);
+	gcra_limiter<coarse_clock> idlelimiter(stopped, milliseconds<int>(1), 3);
+	failures += idle.tryacquire();
+	failures += idle.acquireupto(10) != 0;
+	failures += idle.available() != 0;
+	failures += idle.timeuntil().count() != INT64_MAX;
+	failures += idlelimiter.allow(1, &retry);
+	failures += retry.count() != INT64_MAX;
+	failures += bucket.tryacquire(compact_timestamp()) || bucket.acquireupto(compact_timestamp(), 10) != 0;
+	//Made while the clock was stopped, then full once a valid time comes
+	failures += idle.available(t0) != 10 || !idlelimiter.allow(t0, 3);
+
+	printf("rate limiters: %d failures\n", failures);
+	return failures;
+}
+
+//Callbacks that cancel or move timers due on the same tick, and timers cascading down from the upper levels.
+//Returns the number of failures.
+int testtimerwheel()
+{
+	struct tagged : timer_node { int id = 0; std::int64_t firedat = -1; };
+	const compact_timestamp t0(1000000000000);
+	const compact_timediff ms = std::chrono::milliseconds(1);
+	int failures = 0;
+
+	{
+		//a cancels c, the last timer pending on the tick
+		timer_wheel wheel(t0);
+		tagged a, b, c;
+		wheel.schedule(a, t0 + ms);
+		wheel.schedule(b, t0 + ms);
+		wheel.schedule(c, t0 + ms);
+		int fired = 0;
+		const size_t count = wheel.advance(t0 + ms, [&](timer_node& n) {
+			++fired;
+			if (&n == &a)
+				wheel.cancel(c);
+			failures += &n == &c;
+		});
+		failures += count != 2 || fired != 2 || c.isarmed() || !wheel.empty();
+	}
+	{
+		//a moves b, still pending, a tick later, and re-arms itself for the same tick
+		timer_wheel wheel(t0);
+		tagged a, b, c;
+		wheel.schedule(a, t0 + ms);
+		wheel.schedule(b, t0 + ms);
+		wheel.schedule(c, t0 + ms);
+		int rearmed = 0;
+		failures += wheel.advance(t0 + ms, [&](timer_node& n) {
+			if (&n == &a && !rearmed++)
+			{
+				wheel.schedule(b, t0 + ms * 2);
+				wheel.schedule(a, t0 + ms);
+			}
+			failures += &n == &b;
+		}) != 2;
+		failures += !a.isarmed() || !b.isarmed() || c.isarmed() || wheel.size() != 2;
+		failures += wheel.advance(t0 + ms * 2, [](timer_node&) {}) != 2 || !wheel.empty();
+	}
+	{
+		//Level 0, level 1, level 2 and the overflow list, fired in order on their own ticks
+		timer_wheel wheel(t0);
+		const std::int64_t ticks[] = { 3, 70, 5000, (std::int64_t(1) << (timer_wheel::SLOTBITS * timer_wheel::LEVELS)) + 5 };
+		tagged timers[4];
+		for (int i = 0; i < 4; ++i)
+		{
+			timers[i].id = i;
+			wheel.schedule(timers[i], t0 + ms * ticks[i]);
+		}
+		int next = 0;
+		auto record = [&](timer_node& n) {
+			tagged& t = static_cast<tagged&>(n);
+			t.firedat = (wheel.currenttime() - t0).count() / ms.count();
+			failures += t.id != next++;
+		};
+		failures += wheel.advance(t0 + ms * 4999, record) != 2;
+		failures += wheel.advance(t0 + ms * 5000, record) != 1;
+		failures += wheel.advance(t0 + ms * ticks[3], record) != 1 || !wheel.empty();
+		for (int i = 0; i < 4; ++i)
+			failures += timers[i].firedat != ticks[i];
+	}
+
+	printf("timer wheel: %d failures\n", failures);
+	return failures;
+}
+
+//Scopes on two threads, written out as Chrome JSON and then as text by a second session. Returns the number of failures.
+int testtrace()
+{
+	const char* const path = "chronowrap_testtrace.out";
+	trace_session& session = trace_session::instance();
+	int failures = 0;
+	auto readback = [&] {
+		std::ifstream in(path, std::ios::binary);
+		std::stringstream ss;
+		ss << in.rdbuf();
+		return ss.str();
+	};
+	auto count = [](const std::string& s, const char* what) {
+		int n = 0;
+		for (size_t at = s.find(what); at != std::string::npos; at = s.find(what, at + 1))
+			++n;
+		return n;
+	};
+
+	{ trace_scope before("before"); }
+	failures += !session.start(path, trace_format::chrome_json, std::chrono::milliseconds(1));
+	failures += session.start(path, trace_format::chrome_json) || !session.isrunning();
+	{
+		trace_scope outer("outer");
+		{ trace_scope inner("in\"ner"); }
+		std::thread([] { trace_scope other("other"); }).join();
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	{ trace_scope late("late"); }
+	session.stop();
+	failures += session.isrunning() || session.dropped() != 0;
+	const std::string json = readback();
+	failures += json.compare(0, 16, "{\"traceEvents\":[") != 0 || json.size() < 4 || json.compare(json.size() - 4, 4, "\n]}\n") != 0;
+	failures += count(json, "\"ph\":\"X\"") != 4 || count(json, "\"name\":\"outer\"") != 1 || count(json, "\"name\":\"in\\\"ner\"") != 1;
+	failures += count(json, "\"name\":\"other\"") != 1 || count(json, "\"name\":\"late\"") != 1 || count(json, "before") != 0;
+
+	//Nothing from the first session carries over
+	failures += !session.start(path, trace_format::text);
+	{ trace_scope line("line"); }
+	session.stop();
+	const std::string text = readback();
+	failures += count(text, "\n") != 1 || count(text, " line ") != 1 || text.back() != '\n' || text.find("us\n") == std::string::npos;
+	remove(path);
+
+	printf("trace: %d failures\n", failures);
+	return failures;
+}
+
+//A clock the test moves by hand
+struct manual_clock
+{
+	using duration = std::chrono::nanoseconds;
+	using rep = duration::rep;
+	using period = duration::period;
+	using time_point = std::chrono::time_point<manual_clock>;
+	static constexpr bool is_steady = true;
+	static inline rep ticks = 0;
+	static time_point now() { return time_point(duration(ticks)); }
+};
+
+//Stopwatch totals, laps and pauses on a hand driven clock, and monotonic_timestamp on both clocks. Returns the number of failures.
+int teststopwatch()
+{
+	auto ns = [](const timediff& t) { return compact_timediff(t).count(); };
+	int failures = 0;
+
+	stopwatch<manual_clock> watch;
+	manual_clock::ticks += 5;
+	failures += !watch.isrunning() || ns(watch.elapsed()) != 5 || ns(watch.lap()) != 5;
+	manual_clock::ticks += 3;
+	failures += ns(watch.stop()) != 8 || watch.isrunning();
+	//Stopped time doesn't count
+	manual_clock::ticks += 100;
+	failures += ns(watch.split()) != 8;
+	watch.start();
+	watch.start();
+	manual_clock::ticks += 2;
+	failures += ns(watch.split()) != 10 || ns(watch.lap()) != 5 || ns(watch.lap()) != 0;
+	watch.reset();
+	manual_clock::ticks += 7;
+	failures += watch.isrunning() || ns(watch.elapsed()) != 0;
+	watch.restart();
+	manual_clock::ticks += 4;
+	failures += ns(watch.elapsed()) != 4 || ns(stopwatch<manual_clock>(false).elapsed()) != 0;
+
+	const monotonic_timestamp<manual_clock> a = monotonic_timestamp<manual_clock>::now();
+	const monotonic_timestamp<manual_clock> b = a + nanoseconds<int>(250);
+	failures += ns(b - a) != 250 || ns(a - b) != -250 || b - nanoseconds<int>(250) != a || !(a < b) || !(b >= a) || a == b;
+
+	//The real clock never goes backwards
+	monotonic_timestamp<> last = monotonic_timestamp<>::now();
+	for (int i = 0; i < 10000; ++i)
+	{
+		const monotonic_timestamp<> now = monotonic_timestamp<>::now();
+		failures += now < last;
+		last = now;
+	}
+
+	printf("stopwatch: %d failures\n", failures);
+	return failures;
+}
+
+//Percentiles exact below 2^PRECISION ns and within a bucket above, merging, and the serialized form. Returns the number of failures.
+int testhistogram()
+{
+	auto ns = [](const timediff& t) { return compact_timediff(t).count(); };
+	int failures = 0;
+
+	//Under 128ns every value has its own bucket, so these are exact
+	latency_histogram<> small;
+	for (int i = 1; i <= 100; ++i)
+		small.recordns(i);
+	failures += small.count() != 100 || ns(small.mean()) != 50 || ns(small.min()) != 1 || ns(small.max()) != 100;
+	failures += ns(small.percentile(0)) != 1 || ns(small.percentile(50)) != 50 || ns(small.percentile(99)) != 99 || ns(small.percentile(150)) != 100;
+
+	//Larger values are reported at the top of their bucket: never under, and less than 1 part in 128 over
+	latency_histogram<> large;
+	for (int i = 1; i <= 100; ++i)
+		large.record(compact_timediff(std::chrono::milliseconds(i)));
+	for (int p = 1; p <= 100; ++p)
+	{
+		const long long want = p * 1000000LL;
+		failures += ns(large.percentile(p)) < want || ns(large.percentile(p)) >= want + want / 128;
+	}
+
+	//Merged, the two halves stay in their own buckets and the mean is still exact
+	latency_histogram<> merged = small;
+	merged.merge(large);
+	failures += merged.count() != 200 || ns(merged.percentile(50)) != 100 || ns(merged.percentile(51)) < 1000000;
+	failures += ns(merged.mean()) != (5050 + 5050LL * 1000000) / 200;
+	sharded_histogram<> sharded(3);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 3; ++i)
+		threads.emplace_back([&] { for (int n = 1; n <= 1000; ++n) sharded.recordns(n * 1000); });
+	for (std::thread& t : threads)
+		t.join();
+	failures += sharded.snapshot().count() != 3000 || ns(sharded.snapshot().mean()) != 500500;
+	latency_histogram<> negative;
+	negative.recordns(-5);
+	failures += negative.bucketcount(0) != 1 || ns(negative.max()) != 0;
+
+	//Round trips bucket for bucket. Damaged data or another PRECISION leaves the target empty.
+	const std::string data = merged.serialize();
+	latency_histogram<> back;
+	failures += !back.deserialize(data) || back.count() != merged.count() || ns(back.mean()) != ns(merged.mean());
+	for (int i = 0; i < latency_histogram<>::BUCKETS; ++i)
+		failures += back.bucketcount(i) != merged.bucketcount(i);
+	failures += back.deserialize(data.substr(0, data.size() - 1)) || back.count() != 0;
+	failures += back.deserialize("CWH1") || back.deserialize(std::string(data).replace(0, 1, "X"));
+	latency_histogram<5> coarse;
+	failures += coarse.deserialize(data) || !coarse.deserialize(coarse.serialize()) || coarse.count() != 0;
+
+	printf("histogram: %d failures\n", failures);
+	return failures;
+}
+
+//Buckets come and go as the window moves. Returns the number of failures.
+int testslidingwindow()
+{
+	const compact_timestamp t0(1000000000000);
+	const compact_timediff s = std::chrono::seconds(1);
+	sliding_window<4> window(seconds<int>(1));
+	int failures = 0;
+
+	for (int i = 0; i < 6; ++i)
+		window.add(t0 + s * i, i);
+	//Buckets 2 to 5 are still in the window
+	failures += window.count(t0 + s * 5) != 4;
+	failures += window.sum(t0 + s * 5) != 2 + 3 + 4 + 5;
+	failures += window.sum(t0 + s * 5, 2) != 4 + 5;
+	//Too old for its slot, dropped
+	window.add(t0, 100);
+	failures += window.sum(t0 + s * 5) != 14;
+	//Two buckets later only 4 and 5 are left
+	failures += window.count(t0 + s * 7) != 2;
+	window.add(t0 + s * 7);
+	failures += window.count(t0 + s * 7) != 3;
+	failures += window.count(t0 + s * 20) != 0;
+
+	printf("sliding window: %d failures\n", failures);
+	return failures;
+}
+
+//Fixed steps and calendar units, including a zone's DST change. Returns the number of failures.
+int testrounding()
+{
+	int failures = 0;
+	const compact_timediff quarter = std::chrono::minutes(15);
+	//2021-03-14 06:55:30 UTC, 01:55:30 EST, a few minutes before New York springs forward
+	const compact_timestamp t(1615704930LL * 1000000000);
+	failures += floor_to(t, quarter).count() != 1615704300LL * 1000000000;
+	failures += ceil_to(t, quarter).count() != 1615705200LL * 1000000000;
+	failures += round_to(t, quarter).count() != 1615705200LL * 1000000000;
+	failures += floor_to(t, compact_timediff(0)) != t;
+	failures += floor_to_month(t).count() != 1614556800LL * 1000000000;
+	failures += floor_to_year(t).count() != 1609459200LL * 1000000000;
+	//Monday 2021-03-08
+	failures += floor_to_week(t).count() != 1615161600LL * 1000000000;
+
+	tzone ny;
+	if (tzone::locate("America/New_York", ny))
+	{
+		//Local midnight was still EST, 05:00 UTC
+		failures += floor_to_day(t, ny).count() != 1615698000LL * 1000000000;
+		//The next day starts at EDT midnight, 04:00 UTC
+		failures += floor_to_day(t + compact_timediff(std::chrono::hours(24)), ny).count() != 1615780800LL * 1000000000;
+	}
+
+	//Whole columns round valid entries like the scalar calls and leave invalid ones invalid, holding 0
+	timestamp_array column;
+	for (int i = 0; i < 100; ++i)
+	{
+		if (i % 7 == 3)
+			column.push_back(compact_timestamp());
+		else
+			column.push_back(t + compact_timediff(std::chrono::minutes(i)));
+	}
+	timestamp_array floored = column, rounded = column, days = column;
+	floored.floor_to(quarter);
+	rounded.round_to(quarter);
+	days.floor_to(calendar_unit::day, -5 * 3600);
+	for (size_t i = 0; i < column.size(); ++i)
+	{
+		if (!column.isvalid(i))
+		{
+			failures += floored.isvalid(i) || rounded.isvalid(i) || days.isvalid(i) || floored.data()[i] != 0 || days.data()[i] != 0;
+			continue;
+		}
+		failures += floored[i] != floor_to(column[i], quarter) || rounded[i] != round_to(column[i], quarter);
+		failures += days[i] != floor_to(column[i], calendar_unit::day, -5 * 3600);
+	}
+
+	printf("rounding: %d failures\n", failures);
+	return failures;
+}
+
+//A compiled_format reads the same values as the format string, but also checks the literals and the fields' widths.
+//Returns the number of failures.
+int testcompiledformat()
+{
+	int failures = 0;
+	const compiled_format format(CHRONOFORMAT);
+	failures += !format.isvalid() || !format.isfixedwidth() || !format.issimple() || format.length() != 21 || format.maxlength() != 23;
+	failures += compiled_format("%Y %Q").isvalid() || compiled_format("%x %Y").isfixedwidth() || compiled_format("%b %Y").issimple();
+
+	//Anything the compiled path accepts, the string path reads the same way
+	for (const char* s : { TIMESTAMP, "2018/07/14 22:14:35.2", "2018/02/30 22:14:35.243", "1969/12/31 23:59:59.999" })
+	{
+		timestamp viastring, viacompiled;
+		failures += !viastring.fromstring(s, CHRONOFORMAT) || !viacompiled.fromstring(s, format);
+		failures += compact_timestamp(viastring) != compact_timestamp(viacompiled);
+	}
+	timestamp t;
+	for (const char* s : { "2018/07/14 22:14:35", "2018/07/14 22:14:35.", "2018/07/14-22:14:35.243", "2018/7/14 22:14:35.243",
+		"2018/07/14 22:60:35.243", "2018/07/14 22:14:35.x", "" })
+		failures += t.fromstring(s, format);
+	//Text after the last field is left for the caller, as in a log line
+	failures += !t.fromstring("2018/07/14 22:14:35.24x", format, 0) || t.tostdstring(CHRONOFORMAT, 0) != "2018/07/14 22:14:35.240";
+	failures += !t.fromstring(TIMESTAMP, format, 0) || t.tostdstring(CHRONOFORMAT, 0) != TIMESTAMP;
+	failures += t.fromstring(TIMESTAMP, compiled_format("%Y/%M/%d %H:%m:%Q"));
+
+	printf("compiled format: %d failures\n", failures);
+	return failures;
+}
+
+//Built and checked by the compiler. Static storage so it can be used as a template argument.
+constexpr compiled_format LOGFORMAT("%Y/%M/%d %H:%m:%s.%x");
+static_assert(LOGFORMAT.isvalid() && LOGFORMAT.isfixedwidth() && LOGFORMAT.length() == 21, "LOGFORMAT is compiled at compile time");
+
+//parse<> and tostdstring<> agree with the runtime compiled path. Returns the number of failures.
+int testcompiletimeformat()
+{
+	int failures = 0;
+	for (const char* s : { TIMESTAMP, "2018/07/14 22:14:35.2", "1969/12/31 23:59:59.999", "2018/07/14 22:14:35", "2018/07/14 22:1x:35.243",
+		"2018-07-14 22:14:35.243", "2018/07/14 24:14:35.243", "2018/07/14 22:14:35." })
+	{
+		timestamp runtime;
+		const bool ok = runtime.fromstring(s, LOGFORMAT);
+		const timestamp t = timestamp::parse<LOGFORMAT>(s);
+		failures += t.isvalid() != ok || (ok && compact_timestamp(t) != compact_timestamp(runtime));
+	}
+
+	//Every millisecond of a second round trips through the unrolled formatter
+	const compact_timestamp base(timestamp::parse<LOGFORMAT>(TIMESTAMP));
+	failures += timestamp::parse<LOGFORMAT>(TIMESTAMP).tostdstring<LOGFORMAT>() != TIMESTAMP;
+	for (int ms = 0; ms < 1000; ++ms)
+	{
+		timestamp t = (base + compact_timediff(std::chrono::milliseconds(ms))).totimestamp();
+		failures += t.tostdstring<LOGFORMAT>() != t.tostdstring(CHRONOFORMAT) || compact_timestamp(timestamp::parse<LOGFORMAT>(t.tostdstring<LOGFORMAT>())) != compact_timestamp(t);
+	}
+
+	printf("compile time format: %d failures\n", failures);
+	return failures;
+}
+
+//The minute cache must never show: same text as tostdstring across minutes, a DST change, steps backwards and times
+//before 1970. Returns the number of failures.
+int testformatter()
+{
+	int failures = 0;
+	tzone eastern;
+	failures += !tzone::fromposix("EST5EDT,M3.2.0,M11.1.0", eastern);
+	timestamp_formatter formatter(compiled_format("%Y/%M/%d %H:%m:%s.%x %z"), eastern);
+	//2021-03-14 06:50:00 UTC, ten minutes before New York springs forward
+	const compact_timestamp t0(1615704600LL * 1000000000);
+	const std::int64_t steps[] = { 7300000000LL, 59999000000LL, 1000000LL, -61000000000LL, 3600000000000LL, -1615704600000000000LL - 1000000 };
+	compact_timestamp t = t0;
+	for (int i = 0; i < 600; ++i)
+	{
+		t += compact_timediff(steps[i % std::size(steps)] / (i % 7 == 6 ? 1 : 100));
+		const timestamp ts = t.totimestamp();
+		failures += formatter.tostdstring(ts) != ts.tostdstring("%Y/%M/%d %H:%m:%s.%x %z", eastern);
+		failures += formatter.utcoffset() != eastern.offsetat(floordiv(t.count(), 1000000000));
+	}
+	failures += formatter.tostdstring(t0.totimestamp()) != "2021/03/14 01:50:00.000 -0500";
+	failures += formatter.tostdstring((t0 + compact_timediff(std::chrono::minutes(10))).totimestamp()) != "2021/03/14 03:00:00.000 -0400";
+	char small[8];
+	failures += formatter.format_to(small, sizeof(small), t0.totimestamp()) != 0;
+
+	printf("formatter: %d failures\n", failures);
+	return failures;
+}
+
+static_assert(days_from_civil(1970, 1, 1) == 0 && days_from_civil(2000, 3, 1) == 11017 && civil_from_days(-1).year == 1969,
+	"the civil date engine runs at compile time");
+
+//Day counts against a calendar walked one day at a time, either side of 1970. Returns the number of failures.
+int testcivil()
+{
+	int failures = 0;
+	//0001-01-01 to 9999-12-31
+	long long y = 1, m = 1, d = 1;
+	for (long long days = days_from_civil(1, 1, 1); days <= days_from_civil(9999, 12, 31); ++days)
+	{
+		const civildate date = civil_from_days(days);
+		failures += days_from_civil(y, int(m), int(d)) != days || date.year != y || date.month != m || date.day != d;
+		if (++d > days_in_month(y, int(m)))
+		{
+			d = 1;
+			if (++m > 12)
+				m = 1, ++y;
+		}
+	}
+	failures += weekday_from_days(days_from_civil(2018, 7, 14)) != 6 || weekday_from_days(-1) != 3;
+	failures += days_in_month(1900, 2) != 28 || days_in_month(2000, 2) != 29 || days_in_month(2018, 9) != 30 || days_in_month(2018, 12) != 31;
+
+	//Out of range fields roll over, and times before 1970 break down into the right second
+	timestamp t = timestamp::from_civil({ 2018, 2, 30, 22, 14, 35, 243000000 }, 3600);
+	failures += compact_timestamp(t).count() != 1520025275243000000LL;
+	civiltime c = t.to_civil(3600);
+	failures += c.year != 2018 || c.month != 3 || c.day != 2 || c.hour != 22 || c.minute != 14 || c.second != 35 || c.nanosecond != 243000000;
+	c = compact_timestamp(-1).totimestamp().to_civil();
+	failures += c.year != 1969 || c.month != 12 || c.day != 31 || c.hour != 23 || c.minute != 59 || c.second != 59 || c.nanosecond != 999999999;
+	tm fields = {};
+	fields.tm_year = 2018 - 1900;
+	fields.tm_mon = 6;
+	fields.tm_mday = 14;
+	fields.tm_hour = 22;
+	failures += time_to_epoch(&fields, -2) != 1531598400;
+
+	printf("civil dates: %d failures\n", failures);
+	return failures;
+}
+
+//POSIX rules, fixed offsets and TZif files. Wall clock times in a gap or an overlap resolve as documented. Returns the number of failures.
+int testtzone()
+{
+	int failures = 0;
+	const long long spring = 1615705200; //2021-03-14 07:00 UTC, New York springs forward
+	const long long fall = 1636264800;   //2021-11-07 06:00 UTC, and falls back
+	tzone eastern;
+	failures += !tzone::fromposix("EST5EDT,M3.2.0,M11.1.0", eastern) || eastern.name() != "EST5EDT,M3.2.0,M11.1.0";
+	failures += eastern.offsetat(spring - 1) != -5 * 3600 || eastern.offsetat(spring) != -4 * 3600;
+	failures += eastern.offsetat(fall - 1) != -4 * 3600 || eastern.offsetat(fall) != -5 * 3600;
+	//The rule carries on to the horizon: 2150-07-01 and 1900-01-01
+	failures += eastern.offsetat(5695920000) != -4 * 3600 || eastern.offsetat(-2208988800) != -5 * 3600;
+	//02:30 on spring day never happened, so it takes the offset from before and moves forward. 01:30 on fall day
+	//happened twice, the earlier one in daylight time.
+	failures += eastern.offsetfromlocal(spring - 5 * 3600 - 1800) != -5 * 3600 || eastern.offsetfromlocal(fall - 4 * 3600 - 1800) != -4 * 3600;
+	failures += eastern.offsetfromlocal(spring - 5 * 3600 - 3600 - 1) != -5 * 3600 || eastern.offsetfromlocal(fall - 4 * 3600) != -5 * 3600;
+
+	tzone zone;
+	failures += !tzone::fromposix("<+0530>-5:30", zone) || zone.offsetat(0) != 5 * 3600 + 1800 || zone.offsetfromlocal(0) != 5 * 3600 + 1800;
+	failures += tzone::fromposix("EST5EDT,M3.2.0", zone) || tzone::fromposix("", zone) || tzone::fromposix("EST5 ", zone);
+	failures += tzone::fixed(-5 * 3600 - 1800).name() != "UTC-05:30" || tzone::fixed(-5 * 3600 - 1800).offsetat(0) != -5 * 3600 - 1800;
+	failures += tzone::fixed(0) != tzone::utc() || tzone() != tzone::utc() || tzone::utc().name() != "UTC" || &tzone::local() != &tzone::local();
+	const char garbage[64] = "TZif2";
+	failures += tzone::fromtzif(garbage, sizeof(garbage), "garbage", zone) || tzone::locate("No/Such_Zone", zone) || tzone::locate("../etc/passwd", zone);
+
+	//The system copy of the zone agrees with the rule from 2007, when the rule took effect. A second thread works through the
+	//same periods at the same time, and each thread switches between the two zones on every lookup.
+	if (tzone::locate("America/New_York", zone))
+	{
+		failures += zone.name() != "America/New_York";
+		std::atomic<int> differences{ 0 };
+		auto compare = [&](long long from) {
+			for (long long t = from; t < 4102444800; t += 3607 * 5)
+				differences += zone.offsetat(t) != eastern.offsetat(t) || zone.offsetfromlocal(t) != eastern.offsetfromlocal(t);
+		};
+		std::thread other(compare, 1167609600 + 3600);
+		compare(1167609600);
+		other.join();
+		failures += differences;
+	}
+
+	printf("tzone: %d failures\n", failures);
+	return failures;
+}
+
+//Conversions to and from the chrono backed types are exact, and invalid survives them. Returns the number of failures.
+int testcompact()
+{
+	int failures = 0;
+	timestamp t;
+	failures += !t.fromstring("2018/07/14 22:14:35.123456789", compiled_format("%Y/%M/%d %H:%m:%s.%f"), 0);
+	const compact_timestamp c(t);
+	failures += c.count() != 1531606475123456789LL || !c.isvalid() || compact_timestamp(c.totimestamp()) != c;
+	failures += compact_timestamp().isvalid() || compact_timestamp(timestamp()).isvalid() || compact_timestamp().totimestamp().isvalid();
+	failures += compact_timestamp(-1).totimestamp().tostdstring("%Y/%M/%d %H:%m:%s.%f", 0) != "1969/12/31 23:59:59.999999999";
+
+	const compact_timediff d = c - compact_timestamp(1531606475LL * 1000000000);
+	failures += d.count() != 123456789 || d.asmicroseconds<long long>() != 123456 || d.asmilliseconds<int>() != 123;
+	failures += compact_timediff(d.totimediff()) != d || compact_timediff(std::chrono::hours(-1)).asminutes<int>() != -60;
+	failures += c - d + d != c || c + -d != c - d || d * 3 / 3 != d || -(-d) != d;
+	failures += !(c - d < c) || !(d > compact_timediff()) || !(c >= c) || c != compact_timestamp(t);
+	//The chrono types agree on differences
+	failures += compact_timediff(t - (c - d).totimestamp()) != d || compact_timestamp(t + d.totimediff()) != c + d;
+
+	printf("compact types: %d failures\n", failures);
+	return failures;
+}
+
+//Column operations against the same loops written over operator[], at sizes either side of a validity word and with
+//runs of valid words broken by the odd invalid entry. Returns the number of failures.
+int testarrays()
+{
+	int failures = 0;
+	std::uint64_t seed = 777;
+	for (size_t n : { 0, 1, 2, 63, 64, 65, 129, 300 })
+	{
+		timestamp_array a, b;
+		for (size_t i = 0; i < n; ++i)
+		{
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			const compact_timestamp t(1500000000LL * 1000000000 + std::int64_t(seed >> 24));
+			a.push_back(i >= 64 && i < 128 && seed % 9 == 0 ? compact_timestamp() : t);
+			b.push_back(seed % 5 == 0 ? compact_timestamp() : t - compact_timediff(std::int64_t(seed >> 40)));
+		}
+
+		size_t valid = 0;
+		compact_timestamp lo, hi;
+		for (size_t i = 0; i < n; ++i)
+			if (a.isvalid(i))
+			{
+				++valid;
+				lo = lo.isvalid() && lo < a[i] ? lo : a[i];
+				hi = hi.isvalid() && hi > a[i] ? hi : a[i];
+			}
+		failures += a.size() != n || a.validcount() != valid || a.min() != lo || a.max() != hi;
+
+		//Valid only where both sides are, and 0 otherwise
+		const timediff_array diff = a - b;
+		const timediff_array steps = a.deltas();
+		failures += diff.size() != n || steps.size() != (n ? n - 1 : 0);
+		compact_timediff total, dlo, dhi;
+		bool any = false;
+		for (size_t i = 0; i < n; ++i)
+		{
+			const bool both = a.isvalid(i) && b.isvalid(i);
+			failures += diff.isvalid(i) != both || diff[i] != (both ? a[i] - b[i] : compact_timediff());
+			total += diff[i];
+			if (both)
+			{
+				dlo = any && dlo < diff[i] ? dlo : diff[i];
+				dhi = any && dhi > diff[i] ? dhi : diff[i];
+				any = true;
+			}
+			if (i + 1 < n)
+			{
+				const bool pair = a.isvalid(i) && a.isvalid(i + 1);
+				failures += steps.isvalid(i) != pair || steps[i] != (pair ? a[i + 1] - a[i] : compact_timediff());
+			}
+		}
+		failures += diff.sum() != total || diff.min() != dlo || diff.max() != dhi;
+
+		//Shifts skip invalid entries, which keep their 0
+		timestamp_array shifted = a;
+		shifted += compact_timediff(std::chrono::seconds(90));
+		shifted -= seconds<int>(30);
+		for (size_t i = 0; i < n; ++i)
+			failures += shifted.isvalid(i) != a.isvalid(i) || (a.isvalid(i) ? shifted[i] != a[i] + compact_timediff(std::chrono::minutes(1)) : shifted.data()[i] != 0);
+	}
+
+	//Single entry updates, and unit conversions
+	timediff_array d(3);
+	failures += d.validcount() != 0 || d.min() != compact_timediff();
+	d.set(0, std::chrono::milliseconds(1500));
+	d.set(2, std::chrono::milliseconds(-2500));
+	d.push_back(seconds<int>(4));
+	d.push_invalid();
+	failures += d.size() != 5 || d.validcount() != 3 || d.min().count() != -2500000000 || d.max().count() != 4000000000;
+	failures += d.asmilliseconds<int>() != std::vector<int>{ 1500, 0, -2500, 4000, 0 } || d.asseconds<double>()[0] != 1.5;
+	d.setinvalid(3);
+	failures += d.isvalid(3) || d[3] != compact_timediff() || d.sum().count() != -1000000000;
+	timestamp_array empty;
+	failures += empty.min().isvalid() || !empty.deltas().empty() || timestamp_array(2).validcount() != 0;
+
+	printf("arrays: %d failures\n", failures);
+	return failures;
+}
+
+//Lines, offsets and times from a buffer, a file and, where there are named pipes, a pipe. Returns the number of failures.
+int testlogreader()
+{
+	const compiled_format format(CHRONOFORMAT);
+	const log_reader reader(format);
+	int failures = 0;
+
+	struct seen { std::string text; size_t offset; long long time; };
+	auto collect = [](std::vector<seen>& out) {
+		return [&out](const log_line& line) {
+			out.push_back({ std::string(line.text), line.offset, line.time.isvalid() ? compact_timestamp(line.time).count() : -1 });
+		};
+	};
+	timestamp t;
+	failures += !t.fromstring(TIMESTAMP, format);
+	const long long first = compact_timestamp(t).count();
+
+	const std::string buffer = std::string(TIMESTAMP) + " start\r\n\nno time here\n2018/07/14 22:14:36.5 next, longer than one 16 byte block\n2018/07/14 22:14:37.000";
+	std::vector<seen> lines;
+	failures += reader.scan(buffer, collect(lines)) != 5 || lines.size() != 5;
+	if (lines.size() == 5)
+	{
+		failures += lines[0].text != std::string(TIMESTAMP) + " start" || lines[0].offset != 0 || lines[0].time != first;
+		failures += lines[1].text != "" || lines[1].offset != 31 || lines[1].time != -1;
+		failures += lines[2].text != "no time here" || lines[2].offset != 32 || lines[2].time != -1;
+		failures += lines[3].offset != 45 || lines[3].time != first + 1257000000;
+		failures += lines[4].text != "2018/07/14 22:14:37.000" || lines[4].time != first + 1757000000;
+	}
+	failures += reader.scan("", 0, collect(lines)) != 0 || reader.scan("\n", collect(lines)) != 1;
+
+	//A file of more than a read chunk gives the same lines as the buffer
+	std::string big;
+	for (int i = 0; big.size() < log_reader::CHUNK + log_reader::CHUNK / 3; ++i)
+		big += (compact_timestamp(first) + compact_timediff(std::chrono::milliseconds(i))).totimestamp().tostdstring(CHRONOFORMAT) + (i % 3 ? " a\n" : " a longer message\n");
+	std::vector<seen> expected, got;
+	size_t count = 0;
+	reader.scan(big, collect(expected));
+	const char* const path = "chronowrap_testlog.out";
+	remove(path);
+	std::ofstream(path, std::ios::binary) << big;
+	failures += !reader.scanfile(path, collect(got), &count) || count != expected.size();
+	for (size_t i = 0; i < std::min(expected.size(), got.size()); ++i)
+		failures += got[i].offset != expected[i].offset || got[i].time != expected[i].time || got[i].time != first + 1000000 * std::int64_t(i);
+	remove(path);
+	failures += reader.scanfile("chronowrap_no_such_file.log", collect(got));
+
+#ifdef CHRONOWRAP_MMAP
+	//A pipe can't be mapped, so it goes through the chunked reads, opened only once
+	if (mkfifo(path, 0600) == 0)
+	{
+		std::thread writer([&] { std::ofstream(path, std::ios::binary) << big; });
+		got.clear();
+		failures += !reader.scanfile(path, collect(got), &count) || count != expected.size();
+		writer.join();
+		for (size_t i = 0; i < std::min(expected.size(), got.size()); ++i)
+			failures += got[i].offset != expected[i].offset || got[i].time != expected[i].time;
+		remove(path);
+	}
+#endif
+
+	printf("log reader: %d failures\n", failures);
+	return failures;
+}
+
+int testfieldparse()
+{
+	int failures = 0;
+	const char good[] = "2018/07/14";
+	const char* const end = good + 10;
+	int value = -1;
+	field_result r = parse_fixed(good, end, 4, value);
+	failures += !r || value != 2018 || r.ptr != good + 4;
+	//Short input and non-digits say where they stopped, and leave the value alone
+	value = -1;
+	r = parse_fixed(good + 8, end, 4, value);
+	failures += r.ec != field_errc::too_short || r.ptr != end || value != -1;
+	r = parse_fixed(good + 2, end, 4, value);
+	failures += r.ec != field_errc::not_digit || r.ptr != good + 4 || value != -1;
+	r = parse_bounded(good + 5, end, 2, 2, 1, 6, value);
+	failures += r.ec != field_errc::out_of_range || r.ptr != good + 5 || value != -1;
+	r = parse_bounded(good + 5, end, 2, 2, 1, 12, value);
+	failures += !r || value != 7;
+	//Fractions are right padded: ".5" as milliseconds is 500
+	const char frac[] = "5Z";
+	r = parse_fraction(frac, frac + 2, 1, 3, value);
+	failures += !r || value != 500 || r.ptr != frac + 1;
+	r = parse_fraction(frac + 1, frac + 2, 1, 3, value);
+	failures += r.ec != field_errc::not_digit;
+
+	//Every path rejects a malformed field instead of throwing or reading past it
+	timestamp t;
+	failures += t.fromstring("2018/07/14 22:1-:35.243", "%Y/%M/%d %H:%m:%s.%x");
+	failures += t.fromstring("2018/07/14 22:1-:35.243", compiled_format("%Y/%M/%d %H:%m:%s.%x"));
+	failures += !t.fromstring("2018/07/14 22:14:35.2", "%Y/%M/%d %H:%m:%s.%x");
+	failures += t.tostdstring("%s.%x") != "35.200";
+
+	printf("fieldparse: %d failures\n", failures);
+	return failures;
+}
+
+int testparseresult()
+{
+	int failures = 0;
+	const compiled_format format("%Y/%M/%d %H:%m:%s.%x");
+	timestamp t;
+	parse_result r = t.tryparse("2018/07/14 22:14:35.243", format, 0);
+	failures += !r || t.tostdstring("%Y/%M/%d %H:%m:%s.%x", 0) != "2018/07/14 22:14:35.243";
+	r = t.tryparse("2018/07/14 22:1x:35.243", format, 0);
+	failures += r.ec != parse_errc::not_digit || r.field != fmtfield::minute || r.offset != 15;
+	r = t.tryparse("2018/13/14 22:14:35.243", format, 0);
+	failures += r.ec != parse_errc::out_of_range || r.field != fmtfield::month || r.offset != 5;
+	r = t.tryparse("2018-07/14 22:14:35.243", format, 0);
+	failures += r.ec != parse_errc::literal_mismatch || r.field != fmtfield::literal || r.offset != 4;
+	r = t.tryparse("2018/07/14 22:14", format, 0);
+	failures += r.ec != parse_errc::too_short || r.offset != 16;
+	//tryparse and fromstring agree
+	for (const char* s : { "2018/07/14 22:14:35.243", "2018/07/14 24:14:35.243", "2018/07/14 22:14:35.", "2018/07/14 22:14:35.5" })
+		failures += bool(t.tryparse(s, format, 0)) != t.fromstring(s, format, 0);
+
+	const std::string_view batch[] = { "2018/07/14 22:14:35.243", "2018/07/14 22:14:3x.243", "2018/07/14 22:14:35.243", "2018/00/14 22:14:35.243" };
+	timestamp out[4];
+	parse_stats stats;
+	failures += parse_batch(batch, out, 4, format, stats) != 2;
+	failures += stats.parsed != 2 || stats.failed != 2 || stats.fields[int(fmtfield::second)] != 1 || stats.fields[int(fmtfield::month)] != 1;
+	failures += stats.errors[int(parse_errc::not_digit)] != 1 || stats.firstindex != 1 || stats.first.offset != 18;
+	failures += out[1].isvalid() || !out[2].isvalid();
+
+	printf("parse result: %d failures\n", failures);
+	return failures;
+}
+
+//parse_batch on a pool flags exactly the strings one at a time parsing rejects, in whole words per chunk, for any count.
+//Returns the number of failures.
+int testparallelparse()
+{
+	const compiled_format format(CHRONOFORMAT);
+	thread_pool pool(4);
+	inline_executor serial;
+	int failures = 0;
+
+	//Every index runs exactly once, and the pool can be reused
+	for (size_t count : { 0, 1, 1000 })
+	{
+		std::vector<std::atomic<int>> runs(count);
+		pool.parallel_for(count, [&](size_t i) { runs[i].fetch_add(1, std::memory_order_relaxed); });
+		for (const std::atomic<int>& r : runs)
+			failures += r.load() != 1;
+	}
+
+	std::vector<std::string> strings;
+	std::uint64_t seed = 99;
+	for (size_t i = 0; i < 2 * PARSE_CHUNK + 100; ++i)
+	{
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		std::string s = (compact_timestamp(1531606475LL * 1000000000) + compact_timediff(std::int64_t(seed >> 20))).totimestamp().tostdstring(CHRONOFORMAT);
+		if (seed % 7 == 0)
+			s[(seed >> 8) % s.size()] = 'x';
+		strings.push_back(s);
+	}
+	const std::vector<std::string_view> views(strings.begin(), strings.end());
+	for (size_t count : { size_t(0), size_t(70), PARSE_CHUNK, views.size() })
+	{
+		std::vector<timestamp> out(count), serialout(count);
+		std::vector<std::uint64_t> errors((count + 63) / 64, ~std::uint64_t(0)), serialerrors(errors.size());
+		const size_t parsed = parse_batch(views.data(), out.data(), count, format, pool, errors.data());
+		failures += parse_batch(views.data(), serialout.data(), count, format, serial, serialerrors.data()) != parsed;
+		failures += errors != serialerrors || parse_batch(views.data(), out.data(), count, format, pool, nullptr) != parsed;
+		size_t expected = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			timestamp t;
+			const bool ok = t.fromstring(views[i], format);
+			expected += ok;
+			failures += ((errors[i / 64] >> (i % 64)) & 1) != !ok || out[i].isvalid() != ok || (ok && compact_timestamp(out[i]) != compact_timestamp(t));
+		}
+		//Bits past the end are clear
+		failures += parsed != expected || (count % 64 && errors.back() >> (count % 64));
+	}
+
+	//A zone given for the batch applies to every string, on every worker
+	tzone eastern;
+	failures += !tzone::fromposix("EST5EDT,M3.2.0,M11.1.0", eastern);
+	std::vector<timestamp> zoned(views.size());
+	failures += parse_batch(views.data(), zoned.data(), views.size(), format, eastern, pool, nullptr) == 0;
+	for (size_t i = 0; i < views.size(); ++i)
+	{
+		timestamp t;
+		const bool ok = t.fromstring(views[i], format, eastern);
+		failures += zoned[i].isvalid() != ok || (ok && compact_timestamp(zoned[i]) != compact_timestamp(t));
+	}
+
+	printf("parallel parse: %d failures\n", failures);
+	return failures;
+}
+
+int testdetect()
+{
+	int failures = 0;
+	failures += detect_format("2018-07-14T22:14:35.243").layout != time_layout::iso8601;
+	failures += detect_format("2018-07-14T22:14:35+02:00").layout != time_layout::rfc3339;
+	failures += detect_format("Sat, 14 Jul 2018 22:14:35 +0000").layout != time_layout::rfc2822;
+	failures += detect_format("Jul  4 22:14:35").layout != time_layout::syslog;
+	failures += detect_format("1531606475").layout != time_layout::epoch_seconds;
+	failures += detect_format("1531606475243").layout != time_layout::epoch_millis;
+	failures += bool(detect_format("14/07/2018"));
+
+	//Every layout of the same instant parses to it, and the parser only re-detects when the layout changes
+	auto_parser parser(tzone::utc(), 2018);
+	const compact_timestamp expected(1531606475LL * 1000000000);
+	const char* const same[] = { "2018-07-14 22:14:35", "2018-07-14T22:14:35", "2018-07-15T00:14:35+02:00", "Sat, 14 Jul 2018 22:14:35 GMT",
+		"Jul 14 22:14:35", "1531606475", "1531606475000" };
+	for (const char* s : same)
+	{
+		timestamp t;
+		failures += !parser.parse(s, t) || compact_timestamp(t) != expected;
+		failures += !parser.parse(s, t);
+	}
+	failures += parser.detectcount() != 7 || parser.failcount() != 0;
+	timestamp t;
+	failures += parser.parse("2018-07-14 22:14:35 trailing", t) || parser.failcount() != 1;
+	failures += parser.format().layout != time_layout::epoch_millis;
+
+	//Days past the end of the month are refused, not rolled into the next one; 2020 is a leap year
+	failures += detect_format("2018-07-14T22:14:35z").layout != time_layout::rfc3339;
+	failures += !parser.parse("2018-07-14T22:14:35z", t) || compact_timestamp(t) != expected;
+	failures += parser.parse("Feb 30 10:00:00", t) || parser.parse("Sat, 31 Jun 2018 22:14:35 GMT", t);
+	failures += auto_parser(tzone::utc(), 2018).parse("Feb 29 10:00:00", t) || !auto_parser(tzone::utc(), 2020).parse("Feb 29 10:00:00", t);
+
+	//A lowercase t separates date and time too, and a detected format doesn't depend on which copy of the compiled format it
+	//points at, as when it comes from another translation unit
+	failures += !parser.parse("2018-07-14t22:14:35", t) || compact_timestamp(t) != expected;
+	failures += !parser.parse("2018-07-15t00:14:35.5+02:00", t) || compact_timestamp(t).count() != expected.count() + 500000000;
+	const compiled_format copy("%Y-%M-%dT%H:%m:%s.%f");
+	detected_format elsewhere = detect_format("2018-07-14T22:14:35.243");
+	elsewhere.format = &copy;
+	failures += !elsewhere.fraction || !parse_detected("2018-07-14T22:14:35.243", elsewhere, t, tzone::utc(), 2018);
+	failures += compact_timestamp(t).count() != expected.count() + 243000000 || parse_detected("2018-07-14T22:14:35.243x", elsewhere, t, tzone::utc(), 2018);
+
+	printf("detect: %d failures\n", failures);
+	return failures;
+}
+
+int testiso8601()
+{
+	int failures = 0;
+	const long long base = 1531606475LL * 1000000000; //2018-07-14T22:14:35Z
+	auto ns = [](const timestamp& t) { return t.isvalid() ? compact_timestamp(t).count() : -1; };
+	failures += ns(timestamp::parse_iso8601("2018-07-14T22:14:35Z")) != base;
+	failures += ns(timestamp::parse_iso8601("2018-07-14t22:14:35.243z")) != base + 243000000;
+	failures += ns(timestamp::parse_iso8601("2018-07-14 22:14:35.5")) != base + 500000000;
+	failures += ns(timestamp::parse_iso8601("2018-07-15T00:14:35.123456789+02:00")) != base + 123456789;
+	failures += ns(timestamp::parse_iso8601("2018-07-14T16:44:35.1234567891-05:30")) != base + 123456789;
+	//Malformed, out of range and impossible dates
+	for (const char* bad : { "2018-07-14T22:14:35", "2018-07-14T22:14:35.Z", "2018-07-14T24:14:35Z", "2018-02-29T22:14:35Z",
+		"2018-07-14T22:14:35+2:00", "2018-07-14T22:14:35+02:00 ", "2018/07/14T22:14:35Z", "2018-07-14T22:14:3" })
+		failures += timestamp::parse_iso8601(bad).isvalid() != !strcmp(bad, "2018-07-14T22:14:35");
+	failures += !timestamp::parse_iso8601("2020-02-29T22:14:35Z").isvalid();
+
+	//Leap seconds
+	const long long newyear = 1483228800LL * 1000000000; //2017-01-01T00:00:00Z
+	failures += timestamp::parse_iso8601("2016-12-31T23:59:60Z").isvalid();
+	failures += ns(timestamp::parse_iso8601("2016-12-31T23:59:60.5Z", leap_policy::clamp)) != newyear - 1;
+	failures += ns(timestamp::parse_iso8601("2016-12-31T23:59:60.5Z", leap_policy::roll)) != newyear + 500000000;
+
+	//Formatting, and round trips through it
+	const timestamp t = compact_timestamp(base + 243000000).totimestamp();
+	failures += t.format_rfc3339() != "2018-07-14T22:14:35.243Z";
+	failures += t.format_rfc3339(0) != "2018-07-14T22:14:35Z";
+	failures += t.format_rfc3339(9, -5 * 3600 - 1800) != "2018-07-14T16:44:35.243000000-05:30";
+	failures += ns(timestamp::parse_iso8601(t.format_rfc3339(6, 3600))) != ns(t);
+	char small[10];
+	failures += t.format_rfc3339(small, sizeof(small)) != 0;
+
+	printf("iso8601: %d failures\n", failures);
+	return failures;
+}
+
+//Static storage so they can be used as template arguments
+constexpr compiled_format NAMEDFORMAT("%a %e %b %Y %I:%m:%s.%u %p %z");
+constexpr compiled_format EPOCHFORMAT("%B %j %E");
+
+int testformatspecs()
+{
+	int failures = 0;
+	const long long base = 1530695135LL * 1000000000; //2018-07-04T09:05:35Z, a Wednesday
+	auto ns = [](const timestamp& t) { return t.isvalid() ? compact_timestamp(t).count() : -1; };
+	timestamp t = compact_timestamp(base + 243500000).totimestamp();
+
+	const std::string named = t.tostdstring("%a %e %b %Y %I:%m:%s.%u %p %z", 0);
+	failures += named != "Wed  4 Jul 2018 09:05:35.243500 AM +0000";
+	failures += t.tostdstring("%B %j %E %3f", -5 * 3600) != "July 185 1530695135 243";
+	failures += t.tostdstring("%I%p %z", 13 * 3600) != "10PM +1300";
+	failures += !compiled_format("%B").isvalid() || compiled_format("%B").isfixedoutput() || !compiled_format("%b %z").isfixedoutput();
+	failures += compiled_format("%0f").isvalid() || compiled_format("%Q").isvalid();
+
+	//Round trips. A parsed %z or %E wins over the offset passed in.
+	timestamp out;
+	failures += !out.fromstring(named, compiled_format("%a %e %b %Y %I:%m:%s.%u %p %z"), 3600) || ns(out) != ns(t);
+	failures += !out.fromstring("Wed  4 Jul 2018 04:05:35.243500 AM -0500", compiled_format("%a %e %b %Y %I:%m:%s.%u %p %z"), tzone::local()) || ns(out) != ns(t);
+	failures += !out.fromstring("july 185 1530695135 2435", compiled_format("%B %j %E %4f"), 7200) || ns(out) != ns(t);
+	failures += !out.fromstring("-86400", compiled_format("%E"), 0) || ns(out) != -86400LL * 1000000000;
+	failures += !out.fromstring("2020 060 12:30 am", compiled_format("%Y %j %I:%m %p"), 0) || out.tostdstring("%Y/%M/%d %H:%m", 0) != "2020/02/29 00:30";
+
+	//Compile time and SIMD paths agree with the runtime one
+	failures += ns(timestamp::parse<NAMEDFORMAT>(named)) != ns(t) || ns(timestamp::parse<EPOCHFORMAT>("July 185 1530695135")) != base;
+	failures += t.tostdstring<NAMEDFORMAT>() != t.tostdstring("%a %e %b %Y %I:%m:%s.%u %p %z");
+	failures += t.tostdstring<EPOCHFORMAT>() != t.tostdstring("%B %j %E");
+	const simd_parser parser(compiled_format("%Y/%M/%d %I:%m:%s %p %z"));
+	failures += !parser.parse("2018/07/04 11:05:35 AM +0200", out) || ns(out) != base;
+	failures += parser.parse("2018/07/04 11:05:35 XM +0200", out) || parser.parse("2018/07/04 13:05:35 PM +0200", out);
+
+	//The uncompiled path reads the same specifiers
+	failures += !out.fromstring("Jul  4 2018 09:05:35 +0000", "%b %e %Y %H:%m:%s %z") || ns(out) != base;
+
+	//Failures name the field
+	parse_result r = out.tryparse("2019 366", compiled_format("%Y %j"));
+	failures += r.ec != parse_errc::out_of_range || r.field != fmtfield::yearday || r.offset != 5;
+	r = out.tryparse("13 PM", compiled_format("%I %p"));
+	failures += r.ec != parse_errc::out_of_range || r.field != fmtfield::hour;
+	r = out.tryparse("Jux 2018", compiled_format("%b %Y"));
+	failures += r.ec != parse_errc::unknown_name || r.field != fmtfield::month || r.offset != 0;
+	r = out.tryparse("2018 +2500", compiled_format("%Y %z"));
+	failures += r.ec != parse_errc::out_of_range || r.field != fmtfield::utcoffset || r.offset != 5;
+
+	printf("format specs: %d failures\n", failures);
+	return failures;
+}
+
+//simd_parser at every level must agree with the scalar compiled path, on good strings and on ones with a byte changed.
+//Formats that would share gather lanes have to stay scalar. Returns the number of failures.
+int testsimdparity()
+{
+	const char* const formats[] = { "%Y/%M/%d %H:%m:%s.%x", "%Y-%M-%dT%H:%m:%s.%f", "%Y%M%d%H%m%s", "%d.%M.%Y %H:%m:%s.%u", "%Y/%M/%d %H:%m:%s.%3f",
+		"%a %e %b %Y %I:%m:%s %p", "%x %f %Y/%M/%d %H", "%Y %Y/%M/%d %H:%m", "%Y/%M/%d %H:%m:%s %I %p" };
+	//The last three put two ops in the same gather lanes, the last one from both source halves
+	const size_t shared = 3;
+	const char replacements[] = "09 :/a";
+	int failures = 0;
+	int checked = 0;
+	std::uint64_t seed = 12345;
+	for (size_t n = 0; n < std::size(formats); ++n)
+	{
+		const char* const f = formats[n];
+		const compiled_format format(f);
+		const bool scalar = n >= std::size(formats) - shared;
+		failures += cpusimdlevel() != simdlevel::scalar && scalar != (simd_parser(format).activelevel() == simdlevel::scalar);
+		for (int i = 0; i < 200; ++i)
+		{
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			//1900 to 2100, any nanosecond
+			const compact_timestamp t(std::int64_t(seed >> 1) % (6311433600LL * 1000000000) - 2208988800LL * 1000000000);
+			std::string good = t.totimestamp().tostdstring(f);
+			std::string bad = good;
+			bad[(seed >> 40) % bad.size()] = replacements[(seed >> 20) % (sizeof(replacements) - 1)];
+			for (const std::string& str : { good, bad })
+			{
+				timestamp expected;
+				const bool ok = expected.fromstring(str, format);
+				for (int level = 0; level <= int(simdlevel::avx2); ++level)
+				{
+					timestamp got;
+					const bool simdok = simd_parser(format, simdlevel(level)).parse(str, got);
+					failures += simdok != ok || (ok && compact_timestamp(got) != compact_timestamp(expected));
+					++checked;
+				}
+			}
+		}
+	}
+
+	printf("simd parity: %d failures in %d parses\n", failures, checked);
+	return failures;
+}
+
 int main()
 {
-	return 0;
+	int failures = 0;
+	failures += testtscclock();
+	failures += testcoarseclock();
+	failures += testratelimit();
+	failures += testtimerwheel();
+	failures += testtrace();
+	failures += teststopwatch();
+	failures += testhistogram();
+	failures += testslidingwindow();
+	failures += testrounding();
+	failures += testcompiledformat();
+	failures += testcompiletimeformat();
+	failures += testformatter();
+	failures += testcivil();
+	failures += testtzone();
+	failures += testcompact();
+	failures += testarrays();
+	failures += testlogreader();
+	failures += testfieldparse();
+	failures += testparseresult();
+	failures += testparallelparse();
+	failures += testdetect();
+	failures += testiso8601();
+	failures += testformatspecs();
+	failures += testsimdparity();
+	return failures;
 }
\ No newline at end of file